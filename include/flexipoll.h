@@ -2,14 +2,73 @@
 #define _FLEXIPOLL_H_
 
 #include <poll.h>
+#include <sys/socket.h>
 
-/* Opaque handle to a set of fds to poll. */
-typedef struct Flexipoll* Flexipoll;
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque handle to a set of fds to poll.  Use the typedef: the struct
+ *  tag was Flexipoll until C++ support, which can't have it share the
+ *  typedef's name, so code spelling struct Flexipoll* must change.
+ */
+typedef struct Flexipoll_* Flexipoll;
+
+/* Flags for flexipoll_add_fd_ex(). */
+#define FLEXIPOLL_EDGE 0x1 /* report an fd only when it becomes ready,
+                            *  like EPOLLET, not every call it stays so
+                            */
+#define FLEXIPOLL_ONESHOT 0x2 /* report an fd once, then ignore it until
+                               *  flexipoll_rearm(), like EPOLLONESHOT
+                               */
+#define FLEXIPOLL_DRAIN 0x40 /* have flexipoll_poll_drain() read it */
+
+/* Hints, for fds whose behaviour is known up front, so they needn't
+ *  earn their place; see flexipoll_add_fd_ex().
+ */
+#define FLEXIPOLL_START_POLL 0x4 /* start in the poll tier */
+#define FLEXIPOLL_START_EPOLL 0x8 /* start in the epoll tier */
+#define FLEXIPOLL_PIN_POLL 0x10 /* stay in the poll tier, however idle */
+#define FLEXIPOLL_PIN_EPOLL 0x20 /* stay in the epoll tier, however busy */
+/* Start with an activity of pct percent, 0 to 100. */
+#define FLEXIPOLL_PRIOR(pct) ((((unsigned)(pct))+1)<<8)
+
+/* Priority classes: ready fds are reported highest class first.  0,
+ *  the default, is for bulk traffic; see flexipoll_add_fd_ex().
+ */
+#define FLEXIPOLL_CLASSES 4
+#define FLEXIPOLL_CLASS(c) (((unsigned)(c))<<16) /* c<FLEXIPOLL_CLASSES */
+
+/* Opaque handle to a one-shot timer owned by a Flexipoll. */
+typedef struct FlexipollTimer_* FlexipollTimer;
+
+/* One ready fd, as reported by flexipoll_poll_events().  data is the
+ *  cookie passed to flexipoll_add_fd_data() (NULL if the fd was
+ *  registered with plain flexipoll_add_fd()).  An expired timer is
+ *  reported with fd -1, revents 0 and the data passed to
+ *  flexipoll_timer_new().
+ */
+typedef struct FlexipollEvent {
+  int fd;
+  short revents;
+  void* data;
+} FlexipollEvent;
 
 /* Constructor.  On error, returns NULL.
  */
 Flexipoll flexipoll_new(void);
-/* Destructor. */
+
+/* Flags for flexipoll_new_ex(). */
+#define FLEXIPOLL_NEW_CALIBRATE 0x1 /* flexipoll_measure_costs() and
+                                     *  flexipoll_apply_costs() before
+                                     *  returning; takes a few ms
+                                     */
+
+/* As flexipoll_new(), with flags.  Returns NULL on error, including
+ *  failure to calibrate.
+ */
+Flexipoll flexipoll_new_ex(unsigned flags);
+/* Destructor.  Delete fp's timers first. */
 void flexipoll_delete(Flexipoll fp);
 
 /* Register a file descriptor to be polled.  events is a bitmap, the
@@ -20,19 +79,219 @@ void flexipoll_delete(Flexipoll fp);
  */
 int flexipoll_add_fd(Flexipoll fp, int fd, short events);
 
-/* Unregister a file descriptor.
+/* As flexipoll_add_fd(), but also attaches data to the fd; it is
+ *  handed back in FlexipollEvent.data by flexipoll_poll_events().
+ *  Re-registering an fd replaces both events and data; plain
+ *  flexipoll_add_fd() on a registered fd leaves data alone.
+ */
+int flexipoll_add_fd_data(Flexipoll fp, int fd, short events, void* data);
+
+/* As flexipoll_add_fd_data(), but also sets flags, a bitmap of
+ *  FLEXIPOLL_EDGE and FLEXIPOLL_ONESHOT, plus hints.  Plain
+ *  flexipoll_add_fd() and flexipoll_add_fd_data() on a registered fd
+ *  leave its flags alone.
+ *
+ * The flags mean the same whichever tier the fd is in.  In the epoll
+ *  tier they map onto EPOLLET and EPOLLONESHOT; in the poll tier
+ *  flexipoll emulates them, an edge being a revents bit that was clear
+ *  on the previous call.  An fd changing tiers may be reported once
+ *  more than strictly necessary, never less.
+ *
+ * Re-registering an fd rearms it.
+ *
+ * New fds start in the poll tier with an activity of 0.6 (60%), just
+ *  between the default thresholds, and move as their activity says.
+ *  Hints skip that for fds known to be busy or idle.  FLEXIPOLL_PRIOR()
+ *  sets the starting activity, and with it the starting tier: the epoll
+ *  tier if it's below the lower threshold.  FLEXIPOLL_START_POLL and
+ *  FLEXIPOLL_START_EPOLL pick the tier outright; an fd started in the
+ *  epoll tier without a prior starts at 0.  These only count when the
+ *  fd is first registered.
+ *
+ * FLEXIPOLL_PIN_POLL and FLEXIPOLL_PIN_EPOLL keep the fd in that tier
+ *  until it's re-registered without them, moving it there now if it's
+ *  elsewhere.  Its activity is still tracked, for flexipoll_fd_stats().
+ *
+ * FLEXIPOLL_CLASS(c) puts the fd in priority class c, whichever tier
+ *  it's in.  Of the fds ready at once, higher classes are reported
+ *  first, so when they don't all fit in the caller's array, it's the
+ *  lowest classes that wait for the next call.  And while any are
+ *  waiting, that next call first polls the fds of class 1 and up
+ *  (short of FLEXIPOLL_EDGE and FLEXIPOLL_ONESHOT ones, which wait
+ *  their turn) without blocking, so they don't queue behind the
+ *  backlog.
+ *
+ * Returns <0 on error (EINVAL for contradictory hints or a prior over
+ *  100).
+ */
+int flexipoll_add_fd_ex(Flexipoll fp, int fd, short events,
+                        unsigned flags, void* data);
+
+/* Rearm a FLEXIPOLL_ONESHOT fd after it has been reported.  It is not
+ *  an error to rearm an fd which is already armed.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_rearm(Flexipoll fp, int fd);
+
+/* Unregister a file descriptor.  Takes constant time, however many
+ *  fds are registered or waiting to be reported.
+ *
+ * Best done before closing the fd.  If it's closed while registered,
+ *  flexipoll notices, reports it once with POLLNVAL and unregisters it
+ *  itself: at once in the poll tier, where poll() says so; later in the
+ *  epoll tier, a few fds of which are checked every 64 calls that find
+ *  anything.  Re-registering the fd number before then is fine too.
+ *  But epoll only forgets an fd once every duplicate of it (dup(),
+ *  fork()) is closed; until then it keeps reporting the old file, and
+ *  such events, being for a registration that has ended, are dropped.
  *
  * Returns 0 on success, or <0 on error.  It is not an error to unregister
  *  a file descriptor which is not currently registered.
  */
 int flexipoll_remove_fd(Flexipoll fp, int fd);
 
+/* The functions above, like the rest of this API, may only be called
+ *  from the thread that polls.  The following may be called from any
+ *  thread: they queue the request, lock-free, for the polling thread
+ *  to carry out at the start of its next flexipoll_poll() or
+ *  flexipoll_poll_events(), and wake it if it's blocked.  Requests
+ *  from one thread are carried out in the order they were posted.
+ *
+ * flexipoll_post_add_fd() registers or re-registers an fd, as
+ *  flexipoll_add_fd_ex(); flexipoll_post_rearm() is flexipoll_rearm()
+ *  and flexipoll_post_remove_fd() is flexipoll_remove_fd().  Bad
+ *  arguments are caught here; anything that goes wrong carrying out
+ *  the request goes to the error handler, if any (see
+ *  flexipoll_set_error_handler()).  An fd being removed from another
+ *  thread must not be closed until the polling thread has seen the
+ *  request.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_post_add_fd(Flexipoll fp, int fd, short events,
+                          unsigned flags, void* data);
+int flexipoll_post_rearm(Flexipoll fp, int fd);
+int flexipoll_post_remove_fd(Flexipoll fp, int fd);
+
+/* Wake the polling thread if it's blocked in flexipoll_poll() or
+ *  flexipoll_poll_events(), or make its next call return at once if
+ *  it isn't; the call may return 0.  May be called from any thread.
+ *  Cheap when a wakeup is already pending.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_wakeup(Flexipoll fp);
+
 /* Block for fds with events to report.  Returns N, number of fds with
  *  events; fills out fds_with_events[0..N] with the fds in question.
- *  Find the events with flexipoll_events(), below.
+ *  Find the events with flexipoll_events(), below.  Returns 0 only
+ *  after flexipoll_wakeup() or a flexipoll_post_*() call.
+ *
+ * If more fds are ready than fit in max_fds, the rest are held over
+ *  and reported first next call, without going back to the kernel;
+ *  within each priority class (see flexipoll_add_fd_ex()), the two
+ *  tiers take turns at the front of the line.  So a small array is
+ *  fine, and no fd starves but for higher classes.  Held-over events
+ *  may be a call out of date.
  */
 int flexipoll_poll(Flexipoll fp, int* fds_with_events, int max_fds);
 
+/* As flexipoll_poll(), but never blocks: returns 0 at once if nothing
+ *  is ready.
+ */
+int flexipoll_poll_nowait(Flexipoll fp, int* fds_with_events, int max_fds);
+
+/* As flexipoll_poll(), but fills out events[0..N] with the fd, its
+ *  revents and its data cookie, so no flexipoll_events() call or
+ *  fd lookup is needed per ready fd.  Expired timers are reported
+ *  too, after the fds.
+ *
+ * Blocks for at most timeout milliseconds (-1: no limit), or until
+ *  the next timer is due, whichever is sooner.  Returns 0 if nothing
+ *  was ready by then; that can also happen a little before a timer
+ *  is due, while the timer wheel rearranges itself.
+ */
+int flexipoll_poll_events(Flexipoll fp, FlexipollEvent* events,
+                          int max_events, int timeout);
+
+/* One fd that polls readable whenever fp has something to report: an
+ *  fd ready in either tier, fds held over from last call, a timer due,
+ *  or a wakeup or post.  So fp can sit inside another event loop
+ *  (glib, libuv and the like) with no thread of its own: have the loop
+ *  watch it for POLLIN, level-triggered, and call
+ *  flexipoll_poll_nowait() (or flexipoll_poll_events() or
+ *  flexipoll_poll_drain() with timeout 0, to have timers too) when
+ *  it's readable.  Don't read from it.  It may be readable with
+ *  nothing to report after all; the call then returns 0.
+ *
+ * It's an epoll set, made on the first call and closed by
+ *  flexipoll_delete(), holding the epoll tier's fd (or io_uring's), a
+ *  timerfd, and the poll tier's fds while they're there.  So from
+ *  then on, each fd joining, leaving or disarmed in the poll tier
+ *  costs an epoll_ctl(); with io_uring, it's readable at once while
+ *  registrations wait for the next call to submit them.  An fd closed
+ *  while registered in the poll tier isn't noticed until some other
+ *  call.
+ *
+ * Returns the fd, or <0 on error.
+ */
+int flexipoll_fd(Flexipoll fp);
+
+/* One ready fd as reported by flexipoll_poll_drain(), with, for a
+ *  FLEXIPOLL_DRAIN fd, what was read from it.
+ *
+ * buf and len are one read()'s worth of a stream, or one datagram; a
+ *  datagram socket gives a chunk per message.  len 0 with buf set is
+ *  end of file (or an empty datagram).  error is the errno of a failed
+ *  read, buf then being NULL, or EMSGSIZE for a datagram cut short to
+ *  fit.  from and fromlen are a datagram's sender (fromlen 0 if it has
+ *  none); NULL and 0 for streams.
+ *
+ * Fds without FLEXIPOLL_DRAIN, or not ready for reading, come with buf
+ *  NULL and error 0; timers as in FlexipollEvent.
+ */
+typedef struct FlexipollChunk {
+  int fd;
+  short revents;
+  void* data;
+  char* buf;
+  int len;
+  int error;
+  struct sockaddr* from;
+  socklen_t fromlen;
+} FlexipollChunk;
+
+/* As flexipoll_poll_events(), but FLEXIPOLL_DRAIN fds ready for
+ *  reading are read too, without blocking, into a slab that fp owns:
+ *  no buffer per fd, and datagram sockets are read a batch at a time
+ *  with recvmmsg().  Chunks' buffers stay valid until the next call.
+ *
+ * A read that finds nothing after all gives no chunk.  One that fills
+ *  its share of the slab may have left more behind, so its fd is
+ *  reported again next call, before going back to the kernel, even if
+ *  FLEXIPOLL_EDGE (but not if FLEXIPOLL_ONESHOT).
+ *
+ * Fds needn't be non-blocking: reads use recv() with MSG_DONTWAIT, or
+ *  preadv2() with RWF_NOWAIT.  The odd file that can't do the latter
+ *  (a tty, say) must be, or gives a chunk with error EOPNOTSUPP.
+ *
+ * Returns the number of chunks, or <0 on error.
+ */
+int flexipoll_poll_drain(Flexipoll fp, FlexipollChunk* chunks,
+                         int max_chunks, int timeout);
+
+/* Size the slab for flexipoll_poll_drain(): slab_bytes in all, of
+ *  which each read() or datagram may take read_bytes.  Every fd taken
+ *  in a call is sure of its read_bytes, a little more for datagrams,
+ *  so a call takes no more fds than fit.  Defaults are 256 KiB and 4
+ *  KiB, about 60 fds a call.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL unless read_bytes>0
+ *  and slab_bytes is big enough for one datagram).
+ */
+int flexipoll_set_drain(Flexipoll fp, int slab_bytes, int read_bytes);
+
 /* Get the events bitmap for this fd as of the last call to
  *  flexipoll_poll().  Returns <0 on error.  Not valid if
  *  fd was not in fds_with_events from the last flexipoll_poll();
@@ -41,4 +300,266 @@ int flexipoll_poll(Flexipoll fp, int* fds_with_events, int max_fds);
  */
 int flexipoll_events(Flexipoll fp, int fd);
 
+/* Set the activity thresholds for moving fds between tiers.  Each
+ *  fd's activity is a decaying average, between 0 and 1, of how often
+ *  it is ready per call to flexipoll_poll(); fds whose activity drops
+ *  below below are handed to epoll, and fds whose activity rises
+ *  above above are taken back into the poll() set.  The gap between
+ *  the two damps fds that hover near the boundary.  Defaults are
+ *  0.58 and 0.62.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL unless
+ *  0<=below<=above<=1).
+ */
+int flexipoll_set_thresholds(Flexipoll fp, float below, float above);
+
+/* Set how quickly activity forgets the past: a sample counts half as
+ *  much calls calls later.  Small values track load shifts quickly;
+ *  large ones ride out bursts.  Default is 16.  Activity is kept to
+ *  16 bits, so anything beyond about 45000 acts like 45000.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL unless calls>0).
+ */
+int flexipoll_set_half_life(Flexipoll fp, int calls);
+
+/* Limit how many fds may change tiers in one call to flexipoll_poll();
+ *  each move costs an epoll_ctl().  When more want to move, the ones
+ *  furthest past their threshold go first and the rest wait for later
+ *  calls.  0 means no limit.  Default is 128.
+ *
+ * Fds that keep moving back and forth are held in place for longer
+ *  after each move.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_set_migration_budget(Flexipoll fp, int max_per_call);
+
+/* Spin before blocking, for loops where waking up from poll() costs
+ *  more than the work: each call first polls both tiers without
+ *  blocking, again and again, for up to max_spin_us microseconds, and
+ *  only then blocks for the rest of its timeout.  How long it spins
+ *  follows how long recent calls have waited for something to turn
+ *  up: about twice that, or not at all once that's over max_spin_us,
+ *  until it comes back down.  0, the default, turns spinning off.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL if max_spin_us<0).
+ */
+int flexipoll_set_busy_poll(Flexipoll fp, int max_spin_us);
+
+/* What the kernel charges, on this machine, for the work each tier
+ *  does.  The thresholds and migration budget follow from these; see
+ *  flexipoll_apply_costs().
+ */
+typedef struct FlexipollCosts {
+  float poll_ns; /* per fd per poll(), ready or not */
+  float epoll_event_ns; /* per ready fd per epoll_wait() */
+  float epoll_ctl_ns; /* per epoll_ctl(); two per round trip */
+} FlexipollCosts;
+
+/* Measure costs on this machine, with a few hundred fds dup()ed from
+ *  two pipes, taking the best of several runs.  Takes a few ms; fds
+ *  beyond RLIMIT_NOFILE just make it less precise.  The result can be
+ *  applied to any number of Flexipolls.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_measure_costs(FlexipollCosts* costs);
+
+/* Set fp's thresholds and migration budget to suit costs.  An fd is
+ *  worth keeping in the poll tier when its activity is above
+ *  poll_ns/epoll_event_ns; the thresholds sit either side of that, as
+ *  far apart as it takes for an fd hovering at one of them to have
+ *  cost a round trip's worth of epoll_ctl() in one half-life, but
+ *  at most 0.25 from it, or half way to 0 or 1.  The budget allows
+ *  about 100us of epoll_ctl() per call.  Set the half-life first.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL unless every cost is
+ *  positive).
+ */
+int flexipoll_apply_costs(Flexipoll fp, const FlexipollCosts* costs);
+
+/* Get the costs last applied to fp, or measured by recalibration.
+ *  All 0 if there haven't been any.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_get_costs(Flexipoll fp, FlexipollCosts* costs);
+
+/* Re-derive the costs every calls calls from what fp observes itself:
+ *  the quickest poll() per fd, and the average epoll_wait() per ready
+ *  fd and epoll_ctl(), over the interval.  Costs with nothing to go
+ *  on, such as epoll's while io_uring keeps the epoll tier, keep
+ *  their last values; until every cost has a value, the thresholds
+ *  are left alone.  Costs a clock_gettime() pair per system call.  0,
+ *  the default, turns it off.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_set_recalibration(Flexipoll fp, int calls);
+
+/* Have the epoll tier kept by io_uring instead of epoll, if the
+ *  running kernel has it (5.6 or later, and not blocked by a seccomp
+ *  filter).  Fds are watched with IORING_OP_POLL_ADD, and every
+ *  change to what's watched, including fds changing tiers, is queued
+ *  and submitted in a single io_uring_enter() at the start of the
+ *  next call, rather than one epoll_ctl() apiece.  Ready fds are read
+ *  straight out of the completion ring, with no epoll_wait().  The
+ *  flags mean the same as with epoll.
+ *
+ * Call it before registering any fds.  If io_uring isn't available,
+ *  fp carries on with epoll, so the error can be ignored.
+ *
+ * Returns 0 on success, or <0 on error (EBUSY if fds are registered
+ *  already; ENOSYS, EPERM or the like if io_uring isn't available).
+ */
+int flexipoll_use_io_uring(Flexipoll fp);
+
+/* Counters kept by each Flexipoll; see flexipoll_get_stats(). */
+#define FLEXIPOLL_HISTOGRAM_BUCKETS 32
+
+typedef struct FlexipollStats {
+  unsigned long long calls; /* to flexipoll_poll() and
+                             *  flexipoll_poll_events()
+                             */
+  unsigned long long events; /* fds and timers reported */
+  unsigned long long wakeups; /* calls cut short by flexipoll_wakeup()
+                               *  or a post
+                               */
+  unsigned long long posted; /* flexipoll_post_*() requests carried
+                              *  out
+                              */
+
+  /* System calls made, by type. */
+  unsigned long long poll_calls, epoll_wait_calls, epoll_ctl_calls;
+  unsigned long long epoll_ctl_failures; /* including EBADF and ENOENT
+                                          *  on removing a closed fd
+                                          */
+  unsigned long long io_uring_enter_calls; /* see
+                                            *  flexipoll_use_io_uring()
+                                            */
+  unsigned long long drain_reads; /* read()s and recvmmsg()s, by
+                                  *  flexipoll_poll_drain()
+                                  */
+
+  /* Only while busy polling; see flexipoll_set_busy_poll().  Spins'
+   *  poll()s count in poll_calls too.
+   */
+  unsigned long long spins; /* calls that spun */
+  unsigned long long spin_hits; /* of those, ones that found something
+                                 *  before giving up
+                                 */
+  unsigned long long spin_polls; /* poll()s spinning */
+
+  unsigned long long urgent_polls; /* poll()s of just the fds of class
+                                    *  1 and up, ahead of held-over
+                                    *  ones; counted in poll_calls too
+                                    */
+
+  unsigned long long to_epoll, to_poll; /* fds that changed tiers */
+  unsigned long long retired; /* fds found closed, and unregistered */
+  unsigned long long stale_events; /* from epoll, for a registration
+                                    *  since ended; see
+                                    *  flexipoll_remove_fd()
+                                    */
+
+  /* Right now, not cumulative. */
+  int poll_tier_fds, epoll_tier_fds;
+  int migrations_pending; /* queued, waiting for budget */
+  unsigned long long spin_budget_ns; /* how long the next call may spin */
+
+  /* Only while timing is on; see flexipoll_set_timing().  latency[i]
+   *  counts calls that spent 2^i to 2^(i+1)-1 ns other than blocked
+   *  in poll(); the last bucket takes anything longer.
+   */
+  unsigned long long poll_ns; /* blocked in poll() */
+  unsigned long long latency[FLEXIPOLL_HISTOGRAM_BUCKETS];
+} FlexipollStats;
+
+/* Copy fp's counters into stats.  Cheap enough to call every call;
+ *  like the rest of the API, call it from the polling thread.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_get_stats(Flexipoll fp, FlexipollStats* stats);
+
+/* Zero fp's cumulative counters.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_reset_stats(Flexipoll fp);
+
+/* Turn timing of calls on (on_bool!=0) or off (the default).  It
+ *  costs a few clock_gettime() calls per call.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_set_timing(Flexipoll fp, int on_bool);
+
+/* Where a registered fd stands. */
+typedef struct FlexipollFdStats {
+  float activity; /* 0..1, as compared with the thresholds */
+  int in_epoll_bool;
+  unsigned migrations; /* recent moves between tiers */
+} FlexipollFdStats;
+
+/* Fill out stats for fd.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL if fd isn't
+ *  registered).
+ */
+int flexipoll_fd_stats(Flexipoll fp, int fd, FlexipollFdStats* stats);
+
+/* Called when a system call inside flexipoll fails, or a request
+ *  posted from another thread can't be carried out.  what names the
+ *  call that failed, error is its errno, and fd is the fd concerned,
+ *  or -1.  It's called whether or not the error is also returned to
+ *  the caller, so some failures are reported at two levels.  Called
+ *  on the polling thread; it must not call back into fp.
+ */
+typedef void (*FlexipollErrorHandler)(Flexipoll fp, const char* what,
+                                      int fd, int error, void* ctx);
+
+/* Set, or with handler NULL remove, the error handler.  There is none
+ *  by default: errors are counted and, where there's a caller to
+ *  tell, returned, but not printed.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_set_error_handler(Flexipoll fp,
+                                FlexipollErrorHandler handler, void* ctx);
+
+/* Create a timer, initially disarmed.  data is reported back in
+ *  FlexipollEvent.data when it expires.  Timers cost no fds: they
+ *  live in a timer wheel inside fp, checked by flexipoll_poll_events().
+ *
+ * Returns NULL on error.
+ */
+FlexipollTimer flexipoll_timer_new(Flexipoll fp, void* data);
+/* Destructor; cancels the timer if need be. */
+void flexipoll_timer_delete(FlexipollTimer timer);
+
+/* Arm the timer to expire timeout milliseconds from now, replacing
+ *  any previous expiry; never sooner, and up to a millisecond later.
+ *  It fires once; arm it again to repeat.  O(1).
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_timer_arm(FlexipollTimer timer, int timeout);
+
+/* Disarm the timer.  An expired timer that has not been reported yet
+ *  won't be.  O(1).  It is not an error to cancel a disarmed timer.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_timer_cancel(FlexipollTimer timer);
+
+/* Returns 1 if the timer is armed (or expired but not yet reported),
+ *  0 if not, <0 on error.
+ */
+int flexipoll_timer_armed(FlexipollTimer timer);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /*_FLEXIPOLL_H_*/
@@ -0,0 +1,496 @@
+#ifndef _FLEXIPOLL_HPP_
+#define _FLEXIPOLL_HPP_
+
+/* C++ wrapper.  Header-only; C++17.
+ *
+ * flexipoll::Poller<Policy> owns a set of fds to poll and hands back
+ *  the ready ones as a range of flexipoll::Event.  The policy, fixed at
+ *  compile time, says how:
+ *
+ *    Poller<PollOnly>             poll(), on a flat pollfd array
+ *    Poller<EpollOnly>            epoll, level-triggered
+ *    Poller<Adaptive<Thresholds>> a Flexipoll, with Thresholds'
+ *                                 thresholds and half-life
+ *
+ *  PollOnly and EpollOnly don't touch the Flexipoll library at all, so
+ *  a service whose fds are known to be all busy, or all idle, pays for
+ *  neither the other tier nor the activity bookkeeping.  Adaptive also
+ *  offers the Flexipoll extras: flags, rearming, timers via
+ *  native_handle().
+ *
+ * Errors are thrown as std::system_error, with the errno of the call
+ *  that failed.  Pollers are movable, not copyable, and like the C API
+ *  belong to one thread.
+ */
+
+#include <flexipoll.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace flexipoll {
+
+/* A bitmap of poll(2) events, as in pollfd.events. */
+enum class Events : short {
+  none=0,
+  in=POLLIN,
+  out=POLLOUT,
+  pri=POLLPRI,
+  err=POLLERR,
+  hup=POLLHUP,
+#ifdef POLLRDHUP
+  rdhup=POLLRDHUP,
+#endif
+  nval=POLLNVAL
+};
+
+constexpr Events operator|(Events a, Events b)
+{
+  return static_cast<Events>(static_cast<short>(a)|static_cast<short>(b));
+}
+
+constexpr Events operator&(Events a, Events b)
+{
+  return static_cast<Events>(static_cast<short>(a)&static_cast<short>(b));
+}
+
+constexpr Events operator~(Events a)
+{
+  return static_cast<Events>(~static_cast<short>(a));
+}
+
+inline Events& operator|=(Events& a, Events b)
+{
+  return a=a|b;
+}
+
+inline Events& operator&=(Events& a, Events b)
+{
+  return a=a&b;
+}
+
+/* Whether any bit of a is set: any(ev.revents() & Events::in). */
+constexpr bool any(Events a)
+{
+  return a!=Events::none;
+}
+
+/* Flags for Poller<Adaptive<...>>::add(). */
+enum class Flags : unsigned {
+  none=0,
+  edge=FLEXIPOLL_EDGE,
+  oneshot=FLEXIPOLL_ONESHOT,
+  start_poll=FLEXIPOLL_START_POLL,
+  start_epoll=FLEXIPOLL_START_EPOLL,
+  pin_poll=FLEXIPOLL_PIN_POLL,
+  pin_epoll=FLEXIPOLL_PIN_EPOLL
+};
+
+constexpr Flags operator|(Flags a, Flags b)
+{
+  return static_cast<Flags>(static_cast<unsigned>(a)
+                            |static_cast<unsigned>(b));
+}
+
+/* FLEXIPOLL_PRIOR(pct), as Flags. */
+constexpr Flags prior(unsigned pct)
+{
+  return static_cast<Flags>(FLEXIPOLL_PRIOR(pct));
+}
+
+/* FLEXIPOLL_CLASS(c), as Flags. */
+constexpr Flags priority_class(unsigned c)
+{
+  return static_cast<Flags>(FLEXIPOLL_CLASS(c));
+}
+
+/* One ready fd, or with Adaptive, an expired timer (fd() -1). */
+class Event {
+ public:
+  explicit Event(const FlexipollEvent& ev) : ev_(ev) {}
+
+  int fd() const { return ev_.fd; }
+  Events revents() const { return static_cast<Events>(ev_.revents); }
+  template <class T=void> T* data() const { return static_cast<T*>(ev_.data); }
+  bool is_timer() const { return ev_.fd<0; }
+
+ private:
+  FlexipollEvent ev_;
+};
+
+/* What Poller::wait() found: a range of Event, good until the next
+ *  wait().
+ */
+class Ready {
+ public:
+  class iterator {
+   public:
+    using value_type=Event;
+    using difference_type=std::ptrdiff_t;
+    using reference=Event;
+    using pointer=void;
+    using iterator_category=std::input_iterator_tag;
+
+    explicit iterator(const FlexipollEvent* p) : p_(p) {}
+    Event operator*() const { return Event(*p_); }
+    iterator& operator++() { ++p_; return *this; }
+    iterator operator++(int) { iterator res=*this; ++p_; return res; }
+    bool operator==(const iterator& other) const { return p_==other.p_; }
+    bool operator!=(const iterator& other) const { return p_!=other.p_; }
+
+   private:
+    const FlexipollEvent* p_;
+  };
+
+  Ready(const FlexipollEvent* begin, std::size_t size)
+    : begin_(begin), size_(size) {}
+
+  iterator begin() const { return iterator(begin_); }
+  iterator end() const { return iterator(begin_+size_); }
+  std::size_t size() const { return size_; }
+  bool empty() const { return !size_; }
+  Event operator[](std::size_t i) const { return Event(begin_[i]); }
+
+ private:
+  const FlexipollEvent* begin_;
+  std::size_t size_;
+};
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char* what)
+{
+  throw std::system_error(errno,std::generic_category(),what);
+}
+
+inline void check(int res, const char* what)
+{
+  if (res<0)
+    throw_errno(what);
+}
+
+} // namespace detail
+
+/* Policies. */
+struct PollOnly {};
+struct EpollOnly {};
+
+/* Thresholds for Adaptive: the library's defaults.  Write your own
+ *  with the same members to fix others at compile time.
+ */
+struct DefaultThresholds {
+  static constexpr float below=0.58f;
+  static constexpr float above=0.62f;
+  static constexpr int half_life=16;
+};
+
+template <class Thresholds=DefaultThresholds>
+struct Adaptive {
+  static_assert((0<=Thresholds::below)
+                && (Thresholds::below<=Thresholds::above)
+                && (Thresholds::above<=1),
+                "thresholds must satisfy 0<=below<=above<=1");
+  static_assert(Thresholds::half_life>0, "half_life must be positive");
+};
+
+template <class Policy>
+class Poller; /* only the specializations below exist */
+
+/* Every fd in one pollfd array, handed to poll() each call. */
+template <>
+class Poller<PollOnly> {
+ public:
+  explicit Poller(int max_events=64) : ready_(max_events>0 ? max_events : 1) {}
+
+  Poller(Poller&&)=default;
+  Poller& operator=(Poller&&)=default;
+
+  /* Register fd, or change what it's registered for. */
+  void add(int fd, Events events, void* data=nullptr)
+  {
+    if (fd<0) {
+      errno=EBADF;
+      detail::throw_errno("add");
+    }
+    if ((std::size_t)(fd)>=slots_.size())
+      slots_.resize(fd+1,-1);
+
+    int slot=slots_[fd];
+    if (slot<0) {
+      slot=slots_[fd]=(int)(pollfds_.size());
+      pollfds_.push_back(pollfd());
+      data_.push_back(nullptr);
+    }
+    pollfds_[slot].fd=fd;
+    pollfds_[slot].events=static_cast<short>(events);
+    pollfds_[slot].revents=0;
+    data_[slot]=data;
+  }
+
+  /* Unregister fd.  Not an error if it isn't registered. */
+  void remove(int fd)
+  {
+    if ((fd<0) || ((std::size_t)(fd)>=slots_.size()) || (slots_[fd]<0))
+      return;
+
+    int slot=slots_[fd], last=(int)(pollfds_.size())-1;
+    pollfds_[slot]=pollfds_[last];
+    data_[slot]=data_[last];
+    slots_[pollfds_[slot].fd]=slot;
+    slots_[fd]=-1;
+    pollfds_.pop_back();
+    data_.pop_back();
+  }
+
+  /* Block for up to timeout ms (-1: no limit) for ready fds.  When
+   *  more are ready than fit, the scan starts further along next time,
+   *  so none starves.
+   */
+  Ready wait(int timeout=-1)
+  {
+    int N=::poll(pollfds_.data(),pollfds_.size(),timeout);
+    if (N<0)
+      detail::throw_errno("poll");
+
+    std::size_t num=0, size=pollfds_.size();
+    for (std::size_t i=0; (i<size) && N && (num<ready_.size()); i++) {
+      std::size_t slot=(start_+i)%size;
+      if (!pollfds_[slot].revents)
+        continue;
+      ready_[num].fd=pollfds_[slot].fd;
+      ready_[num].revents=pollfds_[slot].revents;
+      ready_[num].data=data_[slot];
+      num++;
+      N--;
+    }
+    if (size)
+      start_=(start_+1)%size;
+    return Ready(ready_.data(),num);
+  }
+
+  std::size_t size() const { return pollfds_.size(); }
+
+ private:
+  std::vector<pollfd> pollfds_;
+  std::vector<void*> data_; /* parallel to pollfds_ */
+  std::vector<int> slots_; /* fd to index in pollfds_, or -1 */
+  std::vector<FlexipollEvent> ready_;
+  std::size_t start_=0;
+};
+
+/* Every fd in an epoll set. */
+template <>
+class Poller<EpollOnly> {
+ public:
+  explicit Poller(int max_events=64)
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      epvs_(max_events>0 ? max_events : 1),
+      ready_(epvs_.size())
+  {
+    if (epoll_fd_<0)
+      detail::throw_errno("epoll_create1");
+  }
+
+  ~Poller()
+  {
+    if (epoll_fd_>=0)
+      close(epoll_fd_);
+  }
+
+  Poller(Poller&& other) noexcept
+    : epoll_fd_(std::exchange(other.epoll_fd_,-1)),
+      epvs_(std::move(other.epvs_)),
+      ready_(std::move(other.ready_)),
+      data_(std::move(other.data_)),
+      registered_(std::move(other.registered_)),
+      count_(other.count_) {}
+
+  Poller& operator=(Poller&& other) noexcept
+  {
+    std::swap(epoll_fd_,other.epoll_fd_);
+    epvs_.swap(other.epvs_);
+    ready_.swap(other.ready_);
+    data_.swap(other.data_);
+    registered_.swap(other.registered_);
+    std::swap(count_,other.count_);
+    return *this;
+  }
+
+  void add(int fd, Events events, void* data=nullptr)
+  {
+    if (fd<0) {
+      errno=EBADF;
+      detail::throw_errno("add");
+    }
+    if ((std::size_t)(fd)>=data_.size()) {
+      data_.resize(fd+1,nullptr);
+      registered_.resize(fd+1,0);
+    }
+
+    epoll_event epv;
+    epv.events=(unsigned short)(static_cast<short>(events));
+    epv.data.fd=fd;
+    detail::check(epoll_ctl(epoll_fd_,
+                            registered_[fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                            fd,&epv),
+                  "epoll_ctl");
+    if (!registered_[fd])
+      count_++;
+    registered_[fd]=1;
+    data_[fd]=data;
+  }
+
+  /* A closed fd has left the epoll set already; that's not an error. */
+  void remove(int fd)
+  {
+    if ((fd<0) || ((std::size_t)(fd)>=registered_.size()) || !registered_[fd])
+      return;
+    if ((epoll_ctl(epoll_fd_,EPOLL_CTL_DEL,fd,nullptr)<0)
+        && (errno!=EBADF) && (errno!=ENOENT))
+      detail::throw_errno("epoll_ctl");
+    registered_[fd]=0;
+    data_[fd]=nullptr;
+    count_--;
+  }
+
+  Ready wait(int timeout=-1)
+  {
+    int N=epoll_wait(epoll_fd_,epvs_.data(),(int)(epvs_.size()),timeout);
+    if (N<0)
+      detail::throw_errno("epoll_wait");
+
+    for (int i=0; i<N; i++) {
+      int fd=epvs_[i].data.fd;
+      ready_[i].fd=fd;
+      ready_[i].revents=(short)(epvs_[i].events);
+      ready_[i].data=data_[fd];
+    }
+    return Ready(ready_.data(),N);
+  }
+
+  std::size_t size() const { return count_; }
+
+ private:
+  int epoll_fd_;
+  std::vector<epoll_event> epvs_;
+  std::vector<FlexipollEvent> ready_;
+  std::vector<void*> data_; /* by fd */
+  std::vector<char> registered_; /* by fd */
+  std::size_t count_=0;
+};
+
+/* A Flexipoll, set up per Thresholds. */
+template <class Thresholds>
+class Poller<Adaptive<Thresholds>> {
+ public:
+  explicit Poller(int max_events=64, unsigned new_flags=0)
+    : fp_(flexipoll_new_ex(new_flags)),
+      ready_(max_events>0 ? max_events : 1)
+  {
+    if (!fp_)
+      detail::throw_errno("flexipoll_new_ex");
+    /* Calibration, if asked for, decides the thresholds instead. */
+    if (!(new_flags & FLEXIPOLL_NEW_CALIBRATE))
+      flexipoll_set_thresholds(fp_,Thresholds::below,Thresholds::above);
+    flexipoll_set_half_life(fp_,Thresholds::half_life);
+  }
+
+  ~Poller()
+  {
+    flexipoll_delete(fp_);
+  }
+
+  Poller(Poller&& other) noexcept
+    : fp_(std::exchange(other.fp_,nullptr)),
+      ready_(std::move(other.ready_)),
+      count_(other.count_) {}
+
+  Poller& operator=(Poller&& other) noexcept
+  {
+    std::swap(fp_,other.fp_);
+    ready_.swap(other.ready_);
+    std::swap(count_,other.count_);
+    return *this;
+  }
+
+  void add(int fd, Events events, void* data=nullptr,
+           Flags flags=Flags::none)
+  {
+    int existing_bool=registered(fd);
+    detail::check(flexipoll_add_fd_ex(fp_,fd,static_cast<short>(events),
+                                      static_cast<unsigned>(flags),data),
+                  "flexipoll_add_fd_ex");
+    if (!existing_bool)
+      count_++;
+  }
+
+  void rearm(int fd)
+  {
+    detail::check(flexipoll_rearm(fp_,fd),"flexipoll_rearm");
+  }
+
+  void remove(int fd)
+  {
+    int existing_bool=registered(fd);
+    detail::check(flexipoll_remove_fd(fp_,fd),"flexipoll_remove_fd");
+    if (existing_bool)
+      count_--;
+  }
+
+  /* As the others, but may also report expired timers, and may come
+   *  back empty after a wakeup.
+   */
+  Ready wait(int timeout=-1)
+  {
+    int N=flexipoll_poll_events(fp_,ready_.data(),(int)(ready_.size()),
+                                timeout);
+    if (N<0)
+      detail::throw_errno("flexipoll_poll_events");
+
+    /* Closed fds are reported once with POLLNVAL, and unregistered. */
+    for (int i=0; i<N; i++)
+      if ((ready_[i].revents & POLLNVAL) && (ready_[i].fd>=0)
+          && !registered(ready_[i].fd))
+        count_--;
+    return Ready(ready_.data(),N);
+  }
+
+  std::size_t size() const { return count_; }
+
+  /* For another event loop to watch; see flexipoll_fd().  wait(0)
+   *  when it's readable.
+   */
+  int fd()
+  {
+    int res=flexipoll_fd(fp_);
+    if (res<0)
+      detail::throw_errno("flexipoll_fd");
+    return res;
+  }
+
+  /* For the rest of the C API. */
+  Flexipoll native_handle() const { return fp_; }
+
+ private:
+  /* flexipoll_events() would say yes for a closed fd until it's
+   *  reported.
+   */
+  bool registered(int fd) const
+  {
+    FlexipollFdStats stats;
+    return flexipoll_fd_stats(fp_,fd,&stats)==0;
+  }
+
+  Flexipoll fp_;
+  std::vector<FlexipollEvent> ready_;
+  std::size_t count_=0;
+};
+
+} // namespace flexipoll
+
+#endif /*_FLEXIPOLL_HPP_*/
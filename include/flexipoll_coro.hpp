@@ -0,0 +1,264 @@
+#ifndef _FLEXIPOLL_CORO_HPP_
+#define _FLEXIPOLL_CORO_HPP_
+
+/* Coroutines driven by a Flexipoll.  Header-only; C++20.
+ *
+ *   flexipoll::Task serve(flexipoll::Loop<>& loop, int fd)
+ *   {
+ *     for (;;) {
+ *       co_await loop.readable(fd);
+ *       ... read() until EAGAIN ...
+ *     }
+ *   }
+ *
+ * A coroutine waiting on an fd is parked in that fd's entry: the entry
+ *  is registered FLEXIPOLL_ONESHOT with, as its data, a small per-fd
+ *  record that points at the awaiter in the coroutine's frame.  The
+ *  ready loop follows the pointer and resumes the coroutine there and
+ *  then; waiting allocates nothing.  An fd whose coroutines wait on it
+ *  often earns its place in the poll tier, where rearming is free; one
+ *  that's seldom ready goes to epoll, and costs an epoll_ctl() per wait
+ *  only when it is.
+ *
+ * Each fd can have one coroutine waiting to read and one to write.
+ *  Wakeups may be spurious, e.g. when an fd is forgotten and reused
+ *  within one batch of events, so handlers should treat EAGAIN as "wait
+ *  again".  Like a Flexipoll, a Loop belongs to one thread.
+ */
+
+#include <flexipoll.hpp>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <vector>
+
+namespace flexipoll {
+
+/* The return type for a coroutine the Loop should just run: it starts
+ *  at once and frees itself when done.  Exceptions must not escape it.
+ */
+struct Task {
+  struct promise_type {
+    Task get_return_object() noexcept { return Task(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+template <class Thresholds=DefaultThresholds>
+class Loop {
+  struct Watch;
+
+ public:
+  /* What co_await loop.readable(fd) and co_await loop.writable(fd)
+   *  hand back: the fd's revents.
+   */
+  class Awaiter {
+   public:
+    Awaiter(Loop& loop, int fd, Events events)
+      : loop_(loop), fd_(fd), events_(events) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      handle_=handle;
+      loop_.park(fd_,events_,this);
+    }
+
+    Events await_resume() const noexcept { return revents_; }
+
+   private:
+    friend class Loop;
+
+    Loop& loop_;
+    int fd_;
+    Events events_;
+    Events revents_=Events::none;
+    std::coroutine_handle<> handle_;
+  };
+
+  explicit Loop(int max_events=64, unsigned new_flags=0)
+    : poller_(max_events,new_flags) {}
+
+  Loop(const Loop&)=delete;
+  Loop& operator=(const Loop&)=delete;
+
+  /* Coroutines still parked never resume; their frames are destroyed. */
+  ~Loop()
+  {
+    for (auto& watch : watches_) {
+      if (!watch)
+        continue;
+      Awaiter* waiters[2]={watch->reader,watch->writer};
+      watch->reader=watch->writer=nullptr;
+      for (Awaiter* waiter : waiters)
+        if (waiter)
+          waiter->handle_.destroy();
+    }
+  }
+
+  Awaiter readable(int fd) { return Awaiter(*this,fd,Events::in); }
+  Awaiter writable(int fd) { return Awaiter(*this,fd,Events::out); }
+
+  /* Stop watching fd, before closing it.  Throws EBUSY if a coroutine
+   *  is waiting on it.
+   */
+  void forget(int fd)
+  {
+    Watch* watch=find(fd);
+    if (!watch || !watch->registered_bool)
+      return;
+    if (watch->reader || watch->writer) {
+      errno=EBUSY;
+      detail::throw_errno("forget");
+    }
+    poller_.remove(fd);
+    watch->registered_bool=false;
+    watch->armed_bool=false;
+    watch->events=Events::none;
+  }
+
+  /* Wait up to timeout ms (-1: no limit) for ready fds, and resume the
+   *  coroutines waiting on them.  Returns how many were resumed.
+   */
+  int run_once(int timeout=-1)
+  {
+    int resumed=0;
+    for (Event ev : poller_.wait(timeout)) {
+      Watch* watch=ev.template data<Watch>();
+      if (!watch) /* a timer added via native_handle() */
+        continue;
+      watch->armed_bool=false;
+
+      Events revents=ev.revents();
+      if (any(revents & Events::nval)) /* closed: retired, see
+                                         *  flexipoll_remove_fd()
+                                         */
+        watch->registered_bool=false;
+      Awaiter* reader=nullptr;
+      Awaiter* writer=nullptr;
+      if (watch->reader && any(revents & reader_events)) {
+        reader=watch->reader;
+        watch->reader=nullptr;
+      }
+      if (watch->writer && any(revents & writer_events)) {
+        writer=watch->writer;
+        watch->writer=nullptr;
+      }
+      if (watch->reader || watch->writer)
+        arm(*watch);
+
+      parked_-=(reader!=nullptr)+(writer!=nullptr);
+      if (reader) {
+        reader->revents_=revents;
+        reader->handle_.resume();
+        resumed++;
+      }
+      if (writer) {
+        writer->revents_=revents;
+        writer->handle_.resume();
+        resumed++;
+      }
+    }
+    return resumed;
+  }
+
+  /* run_once() until no coroutine is waiting. */
+  void run()
+  {
+    while (parked_)
+      run_once(-1);
+  }
+
+  /* How many coroutines are waiting. */
+  std::size_t parked() const { return parked_; }
+
+  /* For the rest of the C API. */
+  Flexipoll native_handle() const { return poller_.native_handle(); }
+
+ private:
+  static constexpr Events reader_events=Events::in|Events::pri|Events::err
+    |Events::hup|Events::nval
+#ifdef POLLRDHUP
+    |Events::rdhup
+#endif
+    ;
+  static constexpr Events writer_events=Events::out|Events::err
+    |Events::hup|Events::nval;
+
+  /* One per fd ever waited on, kept until the Loop goes: it's the
+   *  entry's data, so must not move.
+   */
+  struct Watch {
+    int fd;
+    Events events=Events::none; /* as registered */
+    bool registered_bool=false, armed_bool=false;
+    Awaiter* reader=nullptr;
+    Awaiter* writer=nullptr;
+  };
+
+  Watch* find(int fd)
+  {
+    if ((fd<0) || ((std::size_t)(fd)>=watches_.size()))
+      return nullptr;
+    return watches_[fd].get();
+  }
+
+  /* Registers or rearms the fd for whatever its waiters want. */
+  void arm(Watch& watch)
+  {
+    Events want=(watch.reader ? Events::in : Events::none)
+      |(watch.writer ? Events::out : Events::none);
+    if (watch.registered_bool && (want==watch.events)) {
+      if (!watch.armed_bool)
+        poller_.rearm(watch.fd);
+    } else {
+      poller_.add(watch.fd,want,&watch,Flags::oneshot);
+      watch.registered_bool=true;
+      watch.events=want;
+    }
+    watch.armed_bool=true;
+  }
+
+  void park(int fd, Events events, Awaiter* waiter)
+  {
+    if (fd<0) {
+      errno=EBADF;
+      detail::throw_errno("co_await");
+    }
+    if ((std::size_t)(fd)>=watches_.size())
+      watches_.resize(fd+1);
+    if (!watches_[fd]) {
+      watches_[fd].reset(new Watch());
+      watches_[fd]->fd=fd;
+    }
+
+    Watch& watch=*watches_[fd];
+    Awaiter*& slot=(events==Events::in) ? watch.reader : watch.writer;
+    if (slot) {
+      errno=EBUSY;
+      detail::throw_errno("co_await");
+    }
+    slot=waiter;
+    try {
+      arm(watch);
+    }
+    catch (...) {
+      slot=nullptr;
+      throw;
+    }
+    parked_++;
+  }
+
+  Poller<Adaptive<Thresholds>> poller_;
+  std::vector<std::unique_ptr<Watch>> watches_; /* by fd */
+  std::size_t parked_=0;
+};
+
+} // namespace flexipoll
+
+#endif /*_FLEXIPOLL_CORO_HPP_*/
@@ -0,0 +1,112 @@
+#ifndef _FLEXIPOLL_SHARDS_H_
+#define _FLEXIPOLL_SHARDS_H_
+
+#include <flexipoll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A multi-threaded front end: N worker threads, each running its own
+ *  Flexipoll over its own share of the fds, so the adaptive poll/epoll
+ *  split happens per shard.  Ready fds are handed to a callback on a
+ *  worker thread.
+ *
+ * Each fd is registered FLEXIPOLL_ONESHOT behind the scenes and
+ *  rearmed when the callback returns, so no two threads ever handle
+ *  the same fd at once.  That lets a worker with nothing to do steal
+ *  ready fds queued on a busy one, and lets hot fds be moved from an
+ *  overloaded shard to a quiet one.
+ *
+ * Link with -pthread.
+ */
+
+typedef struct FlexipollShards_* FlexipollShards;
+
+/* Called on some worker thread for each ready fd.  event->data is
+ *  the data passed to flexipoll_shards_add_fd().  The fd is not
+ *  reported again until this returns.
+ */
+typedef void (*FlexipollHandler)(const FlexipollEvent* event, void* ctx);
+
+/* Picks the shard, 0..num_shards-1, for a new fd.  See
+ *  flexipoll_shards_set_policy().
+ */
+typedef int (*FlexipollShardPolicy)(FlexipollShards shards, int fd,
+                                    void* data, void* ctx);
+
+/* Flags for flexipoll_shards_new(). */
+#define FLEXIPOLL_SHARDS_PIN 0x1 /* pin worker i to the i'th CPU we may
+                                  *  run on (modulo their number)
+                                  */
+#define FLEXIPOLL_SHARDS_NO_STEAL 0x2 /* never hand ready fds to another
+                                       *  shard's worker
+                                       */
+#define FLEXIPOLL_SHARDS_NO_REBALANCE 0x4 /* never move fds between
+                                           *  shards
+                                           */
+
+/* Constructor.  num_shards<=0 means one per CPU we may run on.  The
+ *  workers don't start until flexipoll_shards_start().
+ *
+ * Returns NULL on error.
+ */
+FlexipollShards flexipoll_shards_new(int num_shards,
+                                     FlexipollHandler handler, void* ctx,
+                                     unsigned flags);
+/* Destructor.  Stops and joins the workers; must not be called from
+ *  one of them.
+ */
+void flexipoll_shards_delete(FlexipollShards shards);
+
+/* Replace the policy for assigning new fds to shards.  The default is
+ *  flexipoll_shard_least_loaded.  Call before adding fds.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_shards_set_policy(FlexipollShards shards,
+                                FlexipollShardPolicy policy, void* ctx);
+
+/* Built-in policies.  flexipoll_shard_by_fd picks fd modulo
+ *  num_shards; flexipoll_shard_least_loaded picks the shard with the
+ *  fewest fds.  ctx is ignored.
+ */
+int flexipoll_shard_by_fd(FlexipollShards shards, int fd,
+                          void* data, void* ctx);
+int flexipoll_shard_least_loaded(FlexipollShards shards, int fd,
+                                 void* data, void* ctx);
+
+/* Start the worker threads.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_shards_start(FlexipollShards shards);
+
+/* Number of shards, or <0 on error. */
+int flexipoll_shards_count(FlexipollShards shards);
+/* Number of fds currently assigned to shard, or <0 on error. */
+int flexipoll_shards_num_fds(FlexipollShards shards, int shard);
+
+/* Register, or re-register, an fd; as flexipoll_add_fd_data().  May be
+ *  called from any thread, including from the handler.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_shards_add_fd(FlexipollShards shards, int fd, short events,
+                            void* data);
+
+/* Unregister an fd.  May be called from any thread, including from
+ *  the handler.  Once this returns, the handler won't be called for
+ *  the fd again, unless a call for it is already running; after that
+ *  the fd may be closed.  It is not an error to unregister an fd which
+ *  is not currently registered.
+ *
+ * Returns 0 on success, or <0 on error.
+ */
+int flexipoll_shards_remove_fd(FlexipollShards shards, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_FLEXIPOLL_SHARDS_H_*/
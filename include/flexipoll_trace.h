@@ -0,0 +1,84 @@
+#ifndef _FLEXIPOLL_TRACE_H_
+#define _FLEXIPOLL_TRACE_H_
+
+#include <flexipoll.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A trace of what a Flexipoll saw and did, call by call: how big each
+ *  tier was, which fds were ready, and which changed tiers.  Records go
+ *  in a ring, in memory, and are written out in binary on demand, so
+ *  tracing costs a few stores per ready fd.  tools/fpreplay re-runs a
+ *  trace under other thresholds and half-lives, and estimates what each
+ *  would have cost.
+ *
+ * A trace file is any number of dumps back to back, each a
+ *  FlexipollTraceHeader followed by its records, in the byte order of
+ *  the machine that wrote it.
+ */
+
+#define FLEXIPOLL_TRACE_MAGIC 0x52545046 /* "FPTR" */
+#define FLEXIPOLL_TRACE_VERSION 1
+
+typedef struct FlexipollTraceHeader {
+  uint32_t magic; /* FLEXIPOLL_TRACE_MAGIC */
+  uint32_t version; /* FLEXIPOLL_TRACE_VERSION */
+  uint32_t record_bytes; /* sizeof(FlexipollTraceRecord) */
+  uint32_t half_life; /* the settings traced under, as of the dump */
+  float threshold_below, threshold_above;
+  FlexipollCosts costs; /* 0 if never applied nor recalibrated */
+  uint32_t migration_budget;
+  uint64_t records; /* following this header */
+  uint64_t dropped; /* overwritten before they could be written out */
+} FlexipollTraceHeader;
+
+/* Record types, and what fd, a and b are for each. */
+#define FLEXIPOLL_TRACE_CALL 1 /* a poll(): fd is what it returned, a
+                                *  and b the poll and epoll tiers' fds
+                                *  at the time.  Its READYs follow.
+                                */
+#define FLEXIPOLL_TRACE_READY 2 /* fd was ready: a is its tier, b its
+                                 *  revents
+                                 */
+#define FLEXIPOLL_TRACE_MIGRATE 3 /* fd moved: a is the tier it moved to */
+#define FLEXIPOLL_TRACE_ADD 4 /* fd registered: a is its tier, b its
+                               *  flags
+                               */
+#define FLEXIPOLL_TRACE_REMOVE 5 /* fd unregistered: a is its tier */
+
+/* Tiers, in records. */
+#define FLEXIPOLL_TRACE_POLL_TIER 0
+#define FLEXIPOLL_TRACE_EPOLL_TIER 1
+
+typedef struct FlexipollTraceRecord {
+  uint32_t type; /* FLEXIPOLL_TRACE_CALL etc. */
+  int32_t fd;
+  uint32_t a, b;
+} FlexipollTraceRecord;
+
+/* Start tracing into a ring of at least records records (rounded up to
+ *  a power of 2), dropping anything not yet written out; or, with
+ *  records 0, stop.  Once the ring is full, each record overwrites the
+ *  oldest.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL if records<0).
+ */
+int flexipoll_set_trace(Flexipoll fp, int records);
+
+/* Write out the records traced since the last call, oldest first,
+ *  after a FlexipollTraceHeader, to fd.  Blocks until it's all
+ *  written.
+ *
+ * Returns 0 on success, or <0 on error (EINVAL if not tracing); the
+ *  records are gone either way.
+ */
+int flexipoll_write_trace(Flexipoll fp, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_FLEXIPOLL_TRACE_H_*/
@@ -0,0 +1,163 @@
+#include <flexipoll.h>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* Fds to measure with: dup()s of an idle pipe for poll(), of a
+ *  readable one for epoll.  Best of CALIBRATION_ROUNDS runs counts,
+ *  so preemption and cold caches don't.
+ */
+#define CALIBRATION_FDS 256
+#define CALIBRATION_MIN_FDS 16
+#define CALIBRATION_ROUNDS 16
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000000000+ts.tv_nsec;
+}
+
+/* Runs the measurements proper, on num_fds of each sort of fd. */
+static int measure(FlexipollCosts* costs, const int* idle, const int* busy,
+                   int num_fds, int epoll_fd)
+{
+  struct pollfd pollfds[CALIBRATION_FDS];
+  struct epoll_event epvs[CALIBRATION_FDS];
+  unsigned long long best_one=~0ULL, best_all=~0ULL, best_wait=~0ULL,
+    best_empty=~0ULL, best_ctl=~0ULL;
+  int i, round;
+
+  for (i=0; i<num_fds; i++) {
+    pollfds[i].fd=idle[i];
+    pollfds[i].events=POLLIN;
+  }
+
+  for (round=0; round<CALIBRATION_ROUNDS; round++) {
+    unsigned long long start;
+
+    /* poll(): the difference between one fd and all of them, so the
+     *  cost of the system call itself drops out.
+     */
+    start=now_ns();
+    if (poll(pollfds,1,0)<0)
+      return -1;
+    start=now_ns()-start;
+    if (start<best_one)
+      best_one=start;
+
+    start=now_ns();
+    if (poll(pollfds,num_fds,0)<0)
+      return -1;
+    start=now_ns()-start;
+    if (start<best_all)
+      best_all=start;
+
+    /* epoll_ctl(): registering and unregistering every busy fd. */
+    start=now_ns();
+    for (i=0; i<num_fds; i++) {
+      struct epoll_event epv;
+      epv.events=EPOLLIN;
+      epv.data.fd=busy[i];
+      if (epoll_ctl(epoll_fd,EPOLL_CTL_ADD,busy[i],&epv)<0)
+        return -1;
+    }
+    start=now_ns()-start;
+
+    /* epoll_wait(): all of them ready, less none of them. */
+    {
+      unsigned long long wait=now_ns();
+      if (epoll_wait(epoll_fd,epvs,num_fds,0)!=num_fds) {
+        errno=EAGAIN; /* a pipe that should be readable isn't */
+        return -1;
+      }
+      wait=now_ns()-wait;
+      if (wait<best_wait)
+        best_wait=wait;
+    }
+
+    {
+      unsigned long long del=now_ns();
+      for (i=0; i<num_fds; i++)
+        if (epoll_ctl(epoll_fd,EPOLL_CTL_DEL,busy[i],0)<0)
+          return -1;
+      start+=now_ns()-del;
+      if (start<best_ctl)
+        best_ctl=start;
+    }
+
+    {
+      unsigned long long empty=now_ns();
+      if (epoll_wait(epoll_fd,epvs,num_fds,0)<0)
+        return -1;
+      empty=now_ns()-empty;
+      if (empty<best_empty)
+        best_empty=empty;
+    }
+  }
+
+  /* Clock granularity can make a difference come out 0 or less. */
+  costs->poll_ns=(best_all>best_one) ?
+    (float)(best_all-best_one)/(num_fds-1) : 1;
+  costs->epoll_event_ns=(best_wait>best_empty) ?
+    (float)(best_wait-best_empty)/num_fds : 1;
+  costs->epoll_ctl_ns=(float)(best_ctl)/(2*num_fds);
+  if (costs->epoll_ctl_ns<1)
+    costs->epoll_ctl_ns=1;
+  return 0;
+}
+
+int flexipoll_measure_costs(FlexipollCosts* costs)
+{
+  if (!costs) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  int idle[CALIBRATION_FDS], busy[CALIBRATION_FDS];
+  int idle_pipe[2]={-1,-1}, busy_pipe[2]={-1,-1};
+  int num_idle=0, num_busy=0, epoll_fd=-1;
+  int res=-1;
+
+  if ((pipe(idle_pipe)==0) && (pipe(busy_pipe)==0)
+      && (write(busy_pipe[1],"x",1)==1)
+      && ((epoll_fd=epoll_create1(EPOLL_CLOEXEC))>=0)) {
+    /* As many as we can get, up to CALIBRATION_FDS of each. */
+    while (num_idle<CALIBRATION_FDS) {
+      int fd=dup(idle_pipe[0]);
+      if (fd<0)
+        break;
+      idle[num_idle++]=fd;
+
+      fd=dup(busy_pipe[0]);
+      if (fd<0)
+        break;
+      busy[num_busy++]=fd;
+    }
+
+    /* Too few to tell anything, and errno says why. */
+    if (num_busy>=CALIBRATION_MIN_FDS)
+      res=measure(costs,idle,busy,num_busy,epoll_fd);
+  }
+
+  {
+    int tmp=errno, i;
+    for (i=0; i<num_idle; i++)
+      close(idle[i]);
+    for (i=0; i<num_busy; i++)
+      close(busy[i]);
+    if (epoll_fd>=0)
+      close(epoll_fd);
+    for (i=0; i<2; i++) {
+      if (idle_pipe[i]>=0)
+        close(idle_pipe[i]);
+      if (busy_pipe[i]>=0)
+        close(busy_pipe[i]);
+    }
+    errno=tmp;
+  }
+  return res;
+}
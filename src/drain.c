@@ -0,0 +1,100 @@
+#define _GNU_SOURCE /* for recvmmsg() */
+
+#include "drain.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int drain_kind(int fd)
+{
+  int type;
+  socklen_t len=sizeof(type);
+  if (getsockopt(fd,SOL_SOCKET,SO_TYPE,&type,&len)<0)
+    return DRAIN_STREAM; /* ENOTSOCK: a pipe, say */
+  return ((type==SOCK_DGRAM) || (type==SOCK_SEQPACKET)) ?
+    DRAIN_DATAGRAM : DRAIN_SOCKET;
+}
+
+/* A read that found nothing, because another reader got there first
+ *  or the readiness was stale, is no error.
+ */
+static int nothing_there(void)
+{
+  return (errno==EAGAIN) || (errno==EWOULDBLOCK) || (errno==EINTR);
+}
+
+/* As read(), but without blocking: RWF_NOWAIT, or for what can't do
+ *  that (a tty, say), read() if fd is non-blocking anyway.  A blocking
+ *  fd of that sort fails with EOPNOTSUPP.
+ */
+static ssize_t read_nowait(int fd, char* space, int read_bytes)
+{
+  struct iovec iov;
+  iov.iov_base=space;
+  iov.iov_len=read_bytes;
+  ssize_t N=preadv2(fd,&iov,1,-1,RWF_NOWAIT);
+  if ((N<0) && (errno==EOPNOTSUPP)) {
+    int flags=fcntl(fd,F_GETFL);
+    if (flags<0)
+      return -1;
+    if (!(flags & O_NONBLOCK)) {
+      errno=EOPNOTSUPP;
+      return -1;
+    }
+    N=read(fd,space,read_bytes);
+  }
+  return N;
+}
+
+int drain_stream(int fd, int kind, char* space, int read_bytes,
+                 FlexipollChunk* chunk)
+{
+  ssize_t N=(kind==DRAIN_SOCKET) ? recv(fd,space,read_bytes,MSG_DONTWAIT)
+    : read_nowait(fd,space,read_bytes);
+  if (N<0)
+    return nothing_there() ? 0 : -1;
+
+  chunk->buf=space;
+  chunk->len=(int)(N);
+  chunk->error=0;
+  chunk->from=0;
+  chunk->fromlen=0;
+  return 1;
+}
+
+int drain_datagrams(int fd, char* space, int stride, int read_bytes,
+                    FlexipollChunk* chunks, int max_chunks)
+{
+  struct mmsghdr msgs[DRAIN_MAX_MESSAGES];
+  struct iovec iovs[DRAIN_MAX_MESSAGES];
+  int i;
+
+  for (i=0; i<max_chunks; i++) {
+    char* addr=space+i*stride;
+    iovs[i].iov_base=addr+DRAIN_ADDR_BYTES;
+    iovs[i].iov_len=read_bytes;
+    msgs[i].msg_hdr.msg_name=addr;
+    msgs[i].msg_hdr.msg_namelen=DRAIN_ADDR_BYTES;
+    msgs[i].msg_hdr.msg_iov=&(iovs[i]);
+    msgs[i].msg_hdr.msg_iovlen=1;
+    msgs[i].msg_hdr.msg_control=0;
+    msgs[i].msg_hdr.msg_controllen=0;
+    msgs[i].msg_hdr.msg_flags=0;
+  }
+
+  int N=recvmmsg(fd,msgs,max_chunks,MSG_DONTWAIT,0);
+  if (N<0)
+    return nothing_there() ? 0 : -1;
+
+  for (i=0; i<N; i++) {
+    chunks[i].buf=(char*)(iovs[i].iov_base);
+    chunks[i].len=(int)(msgs[i].msg_len);
+    chunks[i].error=(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? EMSGSIZE : 0;
+    chunks[i].from=(struct sockaddr*)(msgs[i].msg_hdr.msg_name);
+    chunks[i].fromlen=msgs[i].msg_hdr.msg_namelen;
+  }
+  return N;
+}
@@ -0,0 +1,45 @@
+#ifndef _DRAIN_H_
+#define _DRAIN_H_
+
+/* The reads behind flexipoll_poll_drain(), kept apart since recvmmsg()
+ *  needs _GNU_SOURCE.  They fill in a FlexipollChunk's buf, len, error,
+ *  from and fromlen, and leave the rest to the caller.
+ */
+
+#include <flexipoll.h>
+
+#define DRAIN_UNKNOWN 0 /* not yet asked */
+#define DRAIN_STREAM 1 /* one preadv2() per call */
+#define DRAIN_DATAGRAM 2 /* recvmmsg(), a chunk per message */
+#define DRAIN_SOCKET 3 /* one recv() per call */
+
+/* Each datagram takes this much slab space for its sender, ahead of
+ *  its payload.
+ */
+#define DRAIN_ADDR_BYTES 128 /* sizeof(struct sockaddr_storage) */
+
+/* Most datagrams taken off one fd per recvmmsg(). */
+#define DRAIN_MAX_MESSAGES 64
+
+/* Which of DRAIN_STREAM, DRAIN_DATAGRAM and DRAIN_SOCKET fd is.
+ *  Anything that isn't a socket, or can't be asked, is a stream.
+ */
+int drain_kind(int fd);
+
+/* One read of up to read_bytes into space, from fd of kind
+ *  DRAIN_STREAM or DRAIN_SOCKET, that never blocks, even if fd does.
+ *  Returns 1 if that made a chunk, 0 if there was nothing to read
+ *  after all, or <0 on error (errno set), with no chunk.
+ */
+int drain_stream(int fd, int kind, char* space, int read_bytes,
+                 FlexipollChunk* chunk);
+
+/* One recvmmsg() of up to max_chunks (at most DRAIN_MAX_MESSAGES)
+ *  datagrams; the i-th goes at space+i*stride, its sender first.
+ *  Returns how many chunks that made, 0 if none, or <0 on error (errno
+ *  set).
+ */
+int drain_datagrams(int fd, char* space, int stride, int read_bytes,
+                    FlexipollChunk* chunks, int max_chunks);
+
+#endif /*_DRAIN_H_*/
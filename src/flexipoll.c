@@ -1,11 +1,25 @@
 #include <flexipoll.h>
+#include <flexipoll_trace.h>
+#include "timerwheel.h"
+#include "mpscq.h"
+#include "uring.h"
+#include "drain.h"
+#include "scan.h"
 
 #include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <stdlib.h>
-#include <stdio.h>
 #include <errno.h>
 
 static const short all_events=(POLLIN
@@ -17,112 +31,621 @@ static const short all_events=(POLLIN
                                |POLLERR
                                |POLLHUP);
 
+/* Each fd's activity is an exponentially decaying average of how
+ *  often it was ready, per call of flexipoll_poll() that found
+ *  anything: an fd ready every time tends to 1, an idle one to 0.
+ *  Fds below the lower threshold move from poll to epoll; above the
+ *  upper one, back again.  New fds start at atr_threshold.
+ *
+ * These are the defaults; see flexipoll_set_thresholds() and
+ *  flexipoll_set_half_life().
+ */
 static const float atr_threshold=0.6,
   atr_threshold_below=0.58,
   atr_threshold_above=0.62;
+static const int atr_half_life=16;
 
+/* Activities are fixed point, ACTIVITY_ONE standing for 1.  Integer
+ *  math keeps the per-fd work down, and, unlike a float, an idle fd's
+ *  activity can't decay into denormals, which are slow to multiply.
+ */
+#define ACTIVITY_BITS 16
+#define ACTIVITY_ONE (1U<<ACTIVITY_BITS)
+
+static inline unsigned to_activity(float x)
+{
+  return (unsigned)(x*ACTIVITY_ONE+0.5f);
+}
+
+/* activity*factor, both fixed point.  Either may be ACTIVITY_ONE, so
+ *  the product needs more than 32 bits.
+ */
+static inline unsigned scale_activity(unsigned activity, unsigned factor)
+{
+  return (unsigned)((((unsigned long long)(activity))*factor)
+                    >>ACTIVITY_BITS);
+}
+
+/* Beyond this many half-lives, an activity has decayed to nothing. */
+#define MAX_DECAY_HALF_LIVES 32
+
+/* decay**(2**i) is kept for i<DECAY_POWERS, which covers more calls
+ *  than MAX_DECAY_HALF_LIVES of the longest half-life.
+ */
+#define DECAY_POWERS 30
+
+/* At most this many fds change tiers per call, by default; see
+ *  flexipoll_set_migration_budget().
+ */
+static const int default_migration_budget=128;
+
+/* What flexipoll_apply_costs() makes of the costs: the break-even
+ *  activity stays within these bounds, the thresholds within MAX_GAP
+ *  of it (and, room permitting, no nearer than MIN_GAP), and the
+ *  migration budget allows MIGRATION_NS_PER_CALL of epoll_ctl(),
+ *  within those bounds.
+ */
+#define MIN_BREAKEVEN 0.02f
+#define MAX_BREAKEVEN 0.98f
+#define MIN_GAP 0.01f
+#define MAX_GAP 0.25f
+#define MIGRATION_NS_PER_CALL 100000
+#define MIN_MIGRATION_BUDGET 16
+#define MAX_MIGRATION_BUDGET 4096
+
+/* Recalibration only trusts poll() timings over at least this many
+ *  fds, so the cost of the system call itself is spread thin.
+ */
+#define RECALIBRATION_MIN_FDS 64
+
+/* After migrating, an fd stays put for half_life<<n calls, where n
+ *  counts its recent migrations (capped at MAX_MIGRATION_BACKOFF), so
+ *  an fd flapping between tiers settles down.  n is forgotten after
+ *  the fd has stayed put for twice the longest hold.
+ */
+#define MAX_MIGRATION_BACKOFF 6
+
+/* Where FLEXIPOLL_PRIOR() and FLEXIPOLL_CLASS() go. */
+#define PRIOR_FLAGS 0xff00
+#define CLASS_SHIFT 16
+#define CLASS_FLAGS (((unsigned)(FLEXIPOLL_CLASSES-1))<<CLASS_SHIFT)
+
+static const unsigned all_flags=(FLEXIPOLL_EDGE
+                                 |FLEXIPOLL_ONESHOT
+                                 |FLEXIPOLL_START_POLL
+                                 |FLEXIPOLL_START_EPOLL
+                                 |FLEXIPOLL_PIN_POLL
+                                 |FLEXIPOLL_PIN_EPOLL
+                                 |FLEXIPOLL_DRAIN
+                                 |PRIOR_FLAGS
+                                 |CLASS_FLAGS);
+
+#define PIN_FLAGS (FLEXIPOLL_PIN_POLL|FLEXIPOLL_PIN_EPOLL)
+
+/* The percentage in FLEXIPOLL_PRIOR(pct), or -1 if flags has none. */
+static inline int prior_pct(unsigned flags)
+{
+  return (int)((flags & PRIOR_FLAGS)>>8)-1;
+}
+
+/* The class in FLEXIPOLL_CLASS(c), 0 if flags has none. */
+static inline int class_of(unsigned flags)
+{
+  return (int)((flags & CLASS_FLAGS)>>CLASS_SHIFT);
+}
+
+/* Returns nonzero unless flags asks for something impossible. */
+static int valid_flags(unsigned flags)
+{
+  unsigned poll_bool=flags & (FLEXIPOLL_START_POLL|FLEXIPOLL_PIN_POLL),
+    epoll_bool=flags & (FLEXIPOLL_START_EPOLL|FLEXIPOLL_PIN_EPOLL);
+  return !(flags & (~all_flags)) && !(poll_bool && epoll_bool)
+    && (prior_pct(flags)<=100);
+}
+
+/* The fields touched on every report come first, so they share a
+ *  cache line; the rest are only needed when an fd changes tiers or
+ *  is registered or removed.  While an fd is in the poll tier, its
+ *  activity lives in fp->poll.activity instead, so a sweep of the poll
+ *  tier need not touch idle entries at all.
+ */
 typedef struct FlexipollEntry {
   int fd;
   short events,revents;
-
-  int active,total,in_epoll_bool;
+  unsigned flags; /* FLEXIPOLL_EDGE etc. */
+  int armed_bool; /* 0 once a FLEXIPOLL_ONESHOT fd has been reported */
+  int in_epoll_bool;
+  int slot; /* index into fp->pollfds while in the poll tier, else -1 */
+  void* data; /* caller's cookie, from flexipoll_add_fd_data() */
+  int drain_kind; /* DRAIN_STREAM etc., once FLEXIPOLL_DRAIN is used */
+
+  unsigned activity; /* epoll tier only: as of call number stamp */
+  unsigned stamp;
+  int dirty_slot; /* index into fp->dirty, or -1 */
+  int queued_bool; /* in fp->ready, under the current gen */
+  int priority; /* its class, from FLEXIPOLL_CLASS() */
+  int urgent_slot; /* index into fp->urgent, or -1 */
+  unsigned reflected; /* poll tier only: the epoll_event.events it's in
+                       *  fp->embed.fd with, or 0
+                       */
+  unsigned gen; /* bumped when the registration ends, or epoll's is
+                 *  replaced, so that anything still queued for it, or
+                 *  tagged with it, can be told for stale
+                 */
+
+  short last_revents; /* poll tier only: revents as of poll() call
+                       *  number edge_stamp, so FLEXIPOLL_EDGE can
+                       *  report only rising bits
+                       */
+  unsigned edge_stamp;
+
+  unsigned uring_gen; /* io_uring only: tells this registration's
+                       *  completions from those of earlier ones
+                       */
+  int uring_polling_bool; /* io_uring only: a POLL_ADD is outstanding */
+
+  unsigned migrations; /* recent ones; see MAX_MIGRATION_BACKOFF */
+  unsigned last_migration, hold; /* may not migrate again until
+                                  *  last_migration+hold
+                                  */
 
   struct FlexipollEntry *next_overall, *next_in_chain,
-    *prev_overall, *prev_in_chain;
+    *prev_overall, *prev_in_chain; /* the chain is the epoll tier */
 } FlexipollEntry;
 
-struct Flexipoll {
-  int num_fds; /* Initialized to syconf(OPEN_MAX). */
-  FlexipollEntry* fd_to_entry; /* array of length num_fds */
+struct FlexipollTimer_ {
+  TimerWheelNode node; /* must be first: the wheel hands back nodes */
+  Flexipoll fp;
+  void* data;
+};
 
-  struct pollfd* pollfds; /* array of length num_fds,
-                           *  preallocated so we don't have to malloc()
-                           *  it on each call to poll().
+/* What a flexipoll_post_*() call asks the polling thread to do. */
+typedef enum {
+  POSTED_ADD,
+  POSTED_REARM,
+  POSTED_REMOVE
+} PostedType;
+
+/* An entry in the ready queue, as of its registration gen. */
+typedef struct QueuedEntry {
+  FlexipollEntry* entry;
+  unsigned gen;
+} QueuedEntry;
+
+/* A ring of capacity QueuedEntries. */
+typedef struct ReadyQueue {
+  QueuedEntry* ring;
+  int head, count;
+} ReadyQueue;
+
+typedef struct PostedCommand {
+  MpscNode node; /* must be first: the queue hands back nodes */
+  PostedType type;
+  int fd;
+  short events;
+  unsigned flags;
+  void* data;
+} PostedCommand;
+
+/* The fd table is two-level: fd_to_entry[fd>>ENTRY_PAGE_BITS] points
+ *  to a page of ENTRY_PAGE_SIZE entries, allocated the first time an
+ *  fd in its range is registered.  Pages never move, so pointers to
+ *  entries stay valid; only the top-level array is realloc()ed.
+ */
+#define ENTRY_PAGE_BITS 8
+#define ENTRY_PAGE_SIZE (1<<ENTRY_PAGE_BITS)
+
+/* Initial size of the per-call arrays; they double as needed, so
+ *  stay a power of 2.
+ */
+#define INITIAL_CAPACITY 16
+
+/* SQ ring size, when the epoll tier is kept by io_uring.  More SQEs
+ *  than this in one call just cost an extra io_uring_enter().
+ */
+#define URING_ENTRIES 256
+
+/* io_uring user_data for the polls of wake_fd and of fds (see
+ *  uring_tag()), and for POLL_REMOVEs, whose completions are of no
+ *  interest.
+ */
+#define URING_WAKE (~0ULL)
+#define URING_IGNORE (~0ULL-1)
+
+/* epoll_event.data for wake_fd; fds have epoll_tag()s. */
+#define EPOLL_WAKE (~0ULL)
+
+/* A closed fd leaves the epoll set without a word, so every
+ *  AUDIT_INTERVAL calls that find anything, AUDIT_BATCH epoll-tier fds
+ *  are checked, round the tier in turn.
+ */
+#define AUDIT_INTERVAL 64
+#define AUDIT_BATCH 4
+
+/* Busy polling spins for about SPIN_WAITS times the recent wait for
+ *  something to turn up, that being an average over about
+ *  2**SPIN_AVERAGE_SHIFT calls.
+ */
+#define SPIN_WAITS 2
+#define SPIN_AVERAGE_SHIFT 3
+
+/* Drain slab defaults; see flexipoll_set_drain(). */
+#define DEFAULT_DRAIN_SLAB_BYTES (256*1024)
+#define DEFAULT_DRAIN_READ_BYTES (4*1024)
+
+struct Flexipoll_ {
+  FlexipollEntry** fd_to_entry; /* array of num_pages page pointers,
+                                 *  some of them 0
+                                 */
+  int num_pages;
+  int fd_limit; /* RLIMIT_NOFILE as of the last look; no open fd is
+                 *  as big
+                 */
+
+  int capacity; /* length of the arrays below (pollfds and the poll
+                 *  tier's have one more); always > all.count
+                 */
+
+  struct pollfd* pollfds; /* passed to poll() as is: pollfds[0] is
+                           *  epoll_fd (or ring.fd), and
+                           *  pollfds[1..poll.count] are the poll
+                           *  tier.  Kept up to date as fds come and
+                           *  go, so it never has to be rebuilt.
                            */
 
-  struct epoll_event* epvs; /* preallocated array of length num_fds */
-  int* dirty_fds; /* preallocated array of length num_fds; elements are
-                   *  fds that should be moved from poll to epoll, or
-                   *  vice versa.
-                   */
+  struct epoll_event* epvs; /* preallocated for epoll_wait() */
+  FlexipollEntry** dirty; /* preallocated; elements are entries that
+                           *  should be moved from poll to epoll, or
+                           *  vice versa, but haven't been yet.
+                           */
+  int num_dirty;
+
+  ReadyQueue ready[FLEXIPOLL_CLASSES]; /* by class: entries found ready
+                                        *  but not yet reported, because
+                                        *  the caller's array was full.
+                                        *  They only fill up while
+                                        *  empty, each registered entry
+                                        *  going in at most once, so
+                                        *  can't overflow.  Removed
+                                        *  entries are left in, stale.
+                                        */
+  int ready_count; /* over all classes */
+  int epoll_first_bool; /* which tier to harvest first, alternating */
 
   struct {
     FlexipollEntry *entries;
     int count;
-  } all, poll, epoll;
+  } all, epoll;
+  FlexipollEntry* audit_next; /* epoll tier's next to check, or 0 for
+                               *  its head
+                               */
+
+  struct {
+    /* Level-triggered fds of class 1 and up, whichever tier they're
+     *  in, for a quick look while others are held over.  Slots move
+     *  together, as in the poll tier.
+     */
+    struct pollfd* pollfds;
+    FlexipollEntry** entries;
+    int count;
+  } urgent;
+
+  struct {
+    /* Parallel to pollfds; [0] of each is unused.  Slots move
+     *  together.
+     */
+    FlexipollEntry** entries; /* entries[i] owns pollfds[i] */
+    unsigned* activity; /* entries[i]'s activity, as of call number
+                         *  stamp[i], or for good while it's disarmed
+                         */
+    unsigned* stamp;
+    int count;
+
+    /* Idle fds' activities are only brought up to date by a sweep of
+     *  the whole tier, due by the time the first of them could have
+     *  dropped below threshold_below.  In between, each call looks at
+     *  the ready fds alone.
+     */
+    unsigned sweep_at; /* call number */
+    int* ready_slots; /* preallocated, for scan_ready() */
+
+    int parked; /* FLEXIPOLL_EDGE fds this call has taken out of poll()
+                 *  for staying ready; see park_edge()
+                 */
+  } poll;
+
+  int epoll_fd; /* -1 if uring_bool */
+
+  int uring_bool; /* the epoll tier is kept by ring instead; see
+                   *  flexipoll_use_io_uring()
+                   */
+  Uring ring; /* its fd is pollfds[0], and SQEs queue up in it until
+               *  the next call
+               */
 
-  int epoll_fd;
+  unsigned calls; /* calls to poll() that found something */
+  unsigned polls; /* calls to poll(), full stop */
+
+  unsigned threshold_below, threshold_above; /* fixed point */
+  int half_life; /* in calls */
+  unsigned decay; /* per call, fixed point: 2^(-1/half_life) */
+  unsigned decay_pow[DECAY_POWERS]; /* decay**(2**i) */
+
+  int migration_budget; /* max migrations per call; 0 for no limit */
+
+  TimerWheel timers;
+
+  MpscQueue posted; /* PostedCommands from any thread */
+  int wake_fd; /* eventfd, in the epoll set as EPOLL_WAKE, or
+                * polled by ring as URING_WAKE
+                */
+  atomic_int wake_pending_bool; /* wake_fd has been, or is about to
+                                 *  be, written since the polling
+                                 *  thread last read it
+                                 */
+
+  FlexipollStats stats; /* cumulative fields only */
+  int timing_bool;
+  unsigned long long blocked_ns; /* in poll(), this call */
+
+  FlexipollCosts costs; /* as last applied or recalibrated; 0 if never */
+  struct {
+    int interval; /* calls between recalibrations; 0 for none */
+    int countdown;
+    float poll_ns; /* quickest per fd this interval, or 0 */
+    unsigned long long epoll_wait_ns, epoll_events;
+    unsigned long long epoll_ctl_ns, epoll_ctl_calls;
+  } recalibration;
+
+  FlexipollErrorHandler error_handler;
+  void* error_ctx;
+
+  struct {
+    unsigned long long max_ns; /* 0 if not busy polling */
+    unsigned long long budget_ns; /* for the next call */
+    unsigned long long wait_ns; /* recent average, before anything
+                                 *  turned up
+                                 */
+  } spin;
+
+  struct {
+    FlexipollTraceRecord* ring; /* 0 if not tracing */
+    unsigned mask; /* its length, a power of 2, less 1 */
+    unsigned long long next; /* records ever traced */
+    unsigned long long unwritten; /* the first of them still to be
+                                   *  written out, if not overwritten
+                                   */
+  } trace;
+
+  struct {
+    int slab_bytes, read_bytes;
+    char* slab; /* allocated on first use */
+    FlexipollEvent* events; /* as many as a call can take */
+  } drain;
+
+  struct {
+    int fd; /* epoll set for flexipoll_fd(), or -1 until asked for */
+    int timer_fd; /* in it: due when fp needs a call whatever the fds */
+    unsigned long long due; /* timer_fd's expiry, in timer wheel ticks;
+                             *  0 if disarmed, 1 if at once
+                             */
+    int edges; /* entries reflected with EPOLLET */
+  } embed;
 };
 
+/* Makes sure the per-call arrays have room for one more fd, allocating
+ *  them the first time.  Returns <0 on error, leaving them big enough
+ *  for what's registered already.
+ */
+static int reserve_capacity(Flexipoll fp)
+{
+  if (fp->all.count+1<fp->capacity)
+    return 0;
+
+  int capacity=fp->capacity ? fp->capacity*2 : INITIAL_CAPACITY;
+
+  struct pollfd* pollfds=
+    (struct pollfd*)(realloc(fp->pollfds,
+                             sizeof(struct pollfd)*(capacity+1)));
+  if (!pollfds)
+    return -1;
+  fp->pollfds=pollfds;
+
+  FlexipollEntry** poll_entries=
+    (FlexipollEntry**)(realloc(fp->poll.entries,
+                               sizeof(FlexipollEntry*)*(capacity+1)));
+  if (!poll_entries)
+    return -1;
+  fp->poll.entries=poll_entries;
+
+  unsigned* poll_activity=
+    (unsigned*)(realloc(fp->poll.activity,sizeof(unsigned)*(capacity+1)));
+  if (!poll_activity)
+    return -1;
+  fp->poll.activity=poll_activity;
+
+  unsigned* poll_stamp=
+    (unsigned*)(realloc(fp->poll.stamp,sizeof(unsigned)*(capacity+1)));
+  if (!poll_stamp)
+    return -1;
+  fp->poll.stamp=poll_stamp;
+
+  int* ready_slots=
+    (int*)(realloc(fp->poll.ready_slots,sizeof(int)*capacity));
+  if (!ready_slots)
+    return -1;
+  fp->poll.ready_slots=ready_slots;
+
+  struct epoll_event* epvs=
+    (struct epoll_event*)(realloc(fp->epvs,
+                                  sizeof(struct epoll_event)*capacity));
+  if (!epvs)
+    return -1;
+  fp->epvs=epvs;
+
+  FlexipollEntry** dirty=
+    (FlexipollEntry**)(realloc(fp->dirty,sizeof(FlexipollEntry*)*capacity));
+  if (!dirty)
+    return -1;
+  fp->dirty=dirty;
+
+  struct pollfd* urgent_pollfds=
+    (struct pollfd*)(realloc(fp->urgent.pollfds,
+                             sizeof(struct pollfd)*capacity));
+  if (!urgent_pollfds)
+    return -1;
+  fp->urgent.pollfds=urgent_pollfds;
+
+  FlexipollEntry** urgent_entries=
+    (FlexipollEntry**)(realloc(fp->urgent.entries,
+                               sizeof(FlexipollEntry*)*capacity));
+  if (!urgent_entries)
+    return -1;
+  fp->urgent.entries=urgent_entries;
+
+  /* The rings can't just be realloc()ed: they may wrap around. */
+  int klass;
+  for (klass=0; klass<FLEXIPOLL_CLASSES; klass++) {
+    ReadyQueue* queue=fp->ready+klass;
+    QueuedEntry* ring=(QueuedEntry*)(malloc(sizeof(QueuedEntry)*capacity));
+    if (!ring)
+      return -1;
+
+    int i;
+    for (i=0; i<queue->count; i++)
+      ring[i]=queue->ring[(queue->head+i) & (fp->capacity-1)];
+    if (queue->ring)
+      free(queue->ring);
+    queue->ring=ring;
+    queue->head=0;
+  }
+
+  fp->capacity=capacity;
+  return 0;
+}
+
 Flexipoll flexipoll_new(void)
 {
-  Flexipoll res=(Flexipoll)(malloc(sizeof(struct Flexipoll)));
+  Flexipoll res=(Flexipoll)(malloc(sizeof(struct Flexipoll_)));
   if (!res)
     return 0;
 
-  res->num_fds=sysconf(_SC_OPEN_MAX);
-  res->fd_to_entry=(FlexipollEntry*)(malloc(sizeof(struct FlexipollEntry)
-                                            *(res->num_fds)));
-  if (!res->fd_to_entry) {
+  /* Enough that flexipoll_delete() can clean up after a failure. */
+  res->fd_to_entry=0;
+  res->num_pages=0;
+  res->fd_limit=0;
+  res->all.entries=res->epoll.entries=0;
+  res->audit_next=0;
+  res->all.count=res->poll.count=res->epoll.count=0;
+  res->capacity=0;
+  res->pollfds=0;
+  res->poll.entries=0;
+  res->poll.activity=0;
+  res->poll.stamp=0;
+  res->poll.ready_slots=0;
+  res->epvs=0;
+  res->dirty=0;
+  memset(res->ready,0,sizeof(res->ready));
+  res->ready_count=0;
+  res->urgent.pollfds=0;
+  res->urgent.entries=0;
+  res->urgent.count=0;
+  res->epoll_fd=res->wake_fd=-1;
+  res->uring_bool=0;
+  res->drain.slab=0;
+  res->drain.events=0;
+  res->trace.ring=0;
+  res->embed.fd=res->embed.timer_fd=-1;
+  mpscq_init(&(res->posted));
+
+  if (reserve_capacity(res)<0) {
     int tmp=errno;
-    free(res);
+    flexipoll_delete(res);
     errno=tmp;
     return 0;
   }
 
-  res->pollfds=(struct pollfd*)(malloc(sizeof(struct pollfd)
-                                       *(res->num_fds)));
-  if (!res->pollfds) {
+  res->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+  if ((res->epoll_fd)<0) {
     int tmp=errno;
-    free(res->fd_to_entry);
-    free(res);
+    flexipoll_delete(res);
     errno=tmp;
     return 0;
   }
 
-  res->epvs=(struct epoll_event*)(malloc(sizeof(struct epoll_event)
-                                         *(res->num_fds)));
-  if (!res->pollfds) {
+  res->wake_fd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  if ((res->wake_fd)<0) {
     int tmp=errno;
-    free(res->pollfds);
-    free(res->fd_to_entry);
-    free(res);
+    flexipoll_delete(res);
     errno=tmp;
     return 0;
   }
 
-  res->dirty_fds=(int*)(malloc(sizeof(int)
-                               *(res->num_fds)));
-  if (!res->dirty_fds) {
-    int tmp=errno;
-    free(res->epvs);
-    free(res->pollfds);
-    free(res->fd_to_entry);
-    free(res);
-    errno=tmp;
-    return 0;
+  {
+    struct epoll_event epv;
+    epv.events=EPOLLIN;
+    epv.data.u64=EPOLL_WAKE;
+    if (epoll_ctl(res->epoll_fd,EPOLL_CTL_ADD,res->wake_fd,&epv)<0) {
+      int tmp=errno;
+      flexipoll_delete(res);
+      errno=tmp;
+      return 0;
+    }
   }
 
-  res->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
-  if ((res->epoll_fd)<0) {
-    int tmp=errno;
-    free(res->dirty_fds);
-    free(res->epvs);
-    free(res->pollfds);
-    free(res->fd_to_entry);
-    free(res);
-    errno=tmp;
+  atomic_init(&(res->wake_pending_bool),0);
+
+  res->pollfds[0].fd=res->epoll_fd;
+  res->pollfds[0].events=POLLIN;
+  res->pollfds[0].revents=0;
+  res->poll.entries[0]=0;
+
+  res->num_dirty=0;
+  res->epoll_first_bool=0;
+  res->migration_budget=default_migration_budget;
+
+  res->calls=res->polls=0;
+  res->poll.sweep_at=1U<<DECAY_POWERS; /* nothing to sweep yet */
+  res->poll.parked=0;
+  memset(&(res->stats),0,sizeof(res->stats));
+  res->timing_bool=0;
+  res->blocked_ns=0;
+  memset(&(res->costs),0,sizeof(res->costs));
+  memset(&(res->recalibration),0,sizeof(res->recalibration));
+  res->error_handler=0;
+  res->error_ctx=0;
+  memset(&(res->spin),0,sizeof(res->spin));
+  res->drain.slab_bytes=DEFAULT_DRAIN_SLAB_BYTES;
+  res->drain.read_bytes=DEFAULT_DRAIN_READ_BYTES;
+  flexipoll_set_thresholds(res,atr_threshold_below,atr_threshold_above);
+  flexipoll_set_half_life(res,atr_half_life);
+
+  timerwheel_init(&(res->timers),timerwheel_clock());
+
+  return res;
+}
+
+Flexipoll flexipoll_new_ex(unsigned flags)
+{
+  if (flags & (~FLEXIPOLL_NEW_CALIBRATE)) {
+    errno=EINVAL;
     return 0;
   }
 
-  {
-    int i;
-    for (i=0; i<res->num_fds; i++)
-      res->fd_to_entry[i].fd=-1;
-  }
+  Flexipoll res=flexipoll_new();
+  if (!res)
+    return 0;
 
-  res->all.entries=res->poll.entries=res->epoll.entries=0;
-  res->all.count=res->poll.count=res->epoll.count=0;
+  if (flags & FLEXIPOLL_NEW_CALIBRATE) {
+    FlexipollCosts costs;
+    if ((flexipoll_measure_costs(&costs)<0)
+        || (flexipoll_apply_costs(res,&costs)<0)) {
+      int tmp=errno;
+      flexipoll_delete(res);
+      errno=tmp;
+      return 0;
+    }
+  }
 
   return res;
 }
@@ -132,268 +655,2658 @@ void flexipoll_delete(Flexipoll fp)
   if (!fp)
     return;
 
-  if (fp->dirty_fds)
-    free(fp->dirty_fds);
+  {
+    int klass;
+    for (klass=0; klass<FLEXIPOLL_CLASSES; klass++)
+      if (fp->ready[klass].ring)
+        free(fp->ready[klass].ring);
+  }
+  if (fp->urgent.pollfds)
+    free(fp->urgent.pollfds);
+  if (fp->urgent.entries)
+    free(fp->urgent.entries);
+  if (fp->dirty)
+    free(fp->dirty);
   if (fp->epvs)
     free(fp->epvs);
+  if (fp->poll.entries)
+    free(fp->poll.entries);
+  if (fp->poll.activity)
+    free(fp->poll.activity);
+  if (fp->poll.stamp)
+    free(fp->poll.stamp);
+  if (fp->poll.ready_slots)
+    free(fp->poll.ready_slots);
   if (fp->pollfds)
     free(fp->pollfds);
-  if (fp->fd_to_entry)
+  if (fp->drain.slab)
+    free(fp->drain.slab);
+  if (fp->drain.events)
+    free(fp->drain.events);
+  if (fp->trace.ring)
+    free(fp->trace.ring);
+  if (fp->fd_to_entry) {
+    int i;
+    for (i=0; i<fp->num_pages; i++)
+      if (fp->fd_to_entry[i])
+        free(fp->fd_to_entry[i]);
     free(fp->fd_to_entry);
+  }
+  {
+    MpscNode* node;
+    while ((node=mpscq_pop(&(fp->posted))))
+      free(node);
+  }
+  if (fp->embed.timer_fd>=0)
+    close(fp->embed.timer_fd);
+  if (fp->embed.fd>=0)
+    close(fp->embed.fd);
+  if (fp->wake_fd>=0)
+    close(fp->wake_fd);
+  if (fp->uring_bool)
+    uring_destroy(&(fp->ring));
   if (fp->epoll_fd>=0)
     close(fp->epoll_fd);
   free(fp);
 }
 
-int flexipoll_add_fd(Flexipoll fp, int fd, short events)
+/* Hands errno to the error handler, if any, leaving it as it was. */
+static void failed(Flexipoll fp, const char* what, int fd)
 {
-  if (!fp) {
-    errno=EFAULT;
-    return -1;
-  }
-
-  if ((fd<0) || (fd>=fp->num_fds)) {
-    errno=EBADF;
-    return -1;
+  if (fp->error_handler) {
+    int tmp=errno;
+    fp->error_handler(fp,what,fd,tmp,fp->error_ctx);
+    errno=tmp;
   }
+}
 
-  if (events & (~all_events)) {
-    errno=EINVAL;
-    return -1;
-  }
+/* Appends a record to the trace, if tracing. */
+static inline void trace(Flexipoll fp, unsigned type, int fd,
+                         unsigned a, unsigned b)
+{
+  if (!fp->trace.ring)
+    return;
 
-  FlexipollEntry* entry=fp->fd_to_entry+fd;
-  if (entry->fd<0) {
-    entry->fd=fd;
-    entry->active=entry->total=0;
-    entry->in_epoll_bool=0;
-    entry->revents=0;
+  FlexipollTraceRecord* record=
+    fp->trace.ring+((fp->trace.next++) & fp->trace.mask);
+  record->type=type;
+  record->fd=fd;
+  record->a=a;
+  record->b=b;
+}
 
-    entry->next_overall=fp->all.entries;
-    entry->prev_overall=0;
-    fp->all.entries=entry;
-    fp->all.count++;
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000000000+ts.tv_nsec;
+}
 
-    entry->next_in_chain=fp->poll.entries;
-    entry->prev_in_chain=0;
-    fp->poll.entries=entry;
-    fp->poll.count++;
-  } else {
-    if (entry->in_epoll_bool) {
-      struct epoll_event epv;
-      epv.events=events;
-      epv.data.ptr=entry;
+/* epoll_ctl() on fp's epoll set, counted, and timed if need be. */
+static int ctl(Flexipoll fp, int op, int fd, struct epoll_event* epv)
+{
+  fp->stats.epoll_ctl_calls++;
 
-      if (epoll_ctl(fp->epoll_fd,EPOLL_CTL_MOD,fd,&epv)<0) {
-        int tmp=errno;
-        perror("epoll_ctl");
-        errno=tmp;
-        return -1;
-      }
-    }
+  if (!fp->recalibration.interval) {
+    int res=epoll_ctl(fp->epoll_fd,op,fd,epv);
+    if (res<0)
+      fp->stats.epoll_ctl_failures++;
+    return res;
   }
 
-  entry->events=events;
-  return 0;
+  unsigned long long before=now_ns();
+  int res=epoll_ctl(fp->epoll_fd,op,fd,epv);
+  int tmp=errno;
+  fp->recalibration.epoll_ctl_ns+=now_ns()-before;
+  fp->recalibration.epoll_ctl_calls++;
+  errno=tmp;
+  if (res<0)
+    fp->stats.epoll_ctl_failures++;
+  return res;
 }
 
-int flexipoll_remove_fd(Flexipoll fp, int fd)
+/* Returns fd's entry, or 0 if no fd in its page has been registered.
+ *  The entry might be unused (entry->fd<0).
+ */
+static inline FlexipollEntry* lookup_entry(Flexipoll fp, int fd)
 {
-  if (!fp) {
-    errno=EFAULT;
-    return -1;
+  int page=fd>>ENTRY_PAGE_BITS;
+  if (page>=fp->num_pages || !fp->fd_to_entry[page])
+    return 0;
+  return fp->fd_to_entry[page]+(fd & (ENTRY_PAGE_SIZE-1));
+}
+
+/* As lookup_entry(), but allocates fd's page if need be.  Returns 0
+ *  on error.
+ */
+static FlexipollEntry* make_entry(Flexipoll fp, int fd)
+{
+  int page=fd>>ENTRY_PAGE_BITS;
+
+  if (page>=fp->num_pages) {
+    int num_pages=fp->num_pages ? fp->num_pages : 1;
+    while (num_pages<=page)
+      num_pages*=2;
+
+    FlexipollEntry** pages=
+      (FlexipollEntry**)(realloc(fp->fd_to_entry,
+                                 sizeof(FlexipollEntry*)*num_pages));
+    if (!pages)
+      return 0;
+
+    int i;
+    for (i=fp->num_pages; i<num_pages; i++)
+      pages[i]=0;
+    fp->fd_to_entry=pages;
+    fp->num_pages=num_pages;
   }
 
-  if ((fd<0) || (fd>=fp->num_fds)) {
-    errno=EBADF;
-    return -1;
+  if (!fp->fd_to_entry[page]) {
+    FlexipollEntry* entries=
+      (FlexipollEntry*)(malloc(sizeof(FlexipollEntry)*ENTRY_PAGE_SIZE));
+    if (!entries)
+      return 0;
+
+    int i;
+    for (i=0; i<ENTRY_PAGE_SIZE; i++) {
+      entries[i].fd=-1;
+      entries[i].dirty_slot=-1;
+      entries[i].queued_bool=0;
+      entries[i].revents=0;
+      entries[i].gen=0; /* likewise, for queued and stale events */
+      entries[i].uring_gen=0; /* and for completions in flight */
+      entries[i].uring_polling_bool=0;
+    }
+    fp->fd_to_entry[page]=entries;
   }
 
-  FlexipollEntry* entry=fp->fd_to_entry+fd;
-  if (entry->fd<0)
+  return fp->fd_to_entry[page]+(fd & (ENTRY_PAGE_SIZE-1));
+}
+
+/* Returns decay**calls: how much of an activity survives calls idle
+ *  calls.
+ */
+static unsigned decay_over(Flexipoll fp, unsigned calls)
+{
+  if (calls>=(unsigned)(fp->half_life)*MAX_DECAY_HALF_LIVES)
     return 0;
 
-  if (entry->in_epoll_bool) {
-    if (epoll_ctl(fp->epoll_fd,EPOLL_CTL_DEL,fd,0)<0) {
-      int tmp=errno;
-      perror("epoll_ctl");
-      errno=tmp;
-      return -1;
+  unsigned res=ACTIVITY_ONE;
+  int i;
+  for (i=0; calls; i++, calls>>=1)
+    if (calls & 1)
+      res=scale_activity(res,fp->decay_pow[i]);
+  return res;
+}
+
+/* How many idle calls activity can take before dropping below
+ *  threshold_below; less than 2**DECAY_POWERS.
+ */
+static unsigned calls_above(Flexipoll fp, unsigned activity)
+{
+  unsigned res=0;
+  int i;
+  if (activity<fp->threshold_below)
+    return 0;
+  for (i=DECAY_POWERS-1; i>=0; i--) {
+    unsigned next=scale_activity(activity,fp->decay_pow[i]);
+    if (next>=fp->threshold_below) {
+      activity=next;
+      res+=1U<<i;
     }
   }
+  return res;
+}
 
-  entry->fd=0;
+/* Has the poll tier swept no later than call number call. */
+static inline void sweep_by(Flexipoll fp, unsigned call)
+{
+  if ((int)(call-fp->poll.sweep_at)<0)
+    fp->poll.sweep_at=call;
 }
 
-int flexipoll_poll(Flexipoll fp, int* fds_with_events, int max_fds)
+/* Has the poll tier swept in time for slot's activity, left idle from
+ *  now on, to have dropped below threshold_below.
+ */
+static void sweep_for(Flexipoll fp, int slot)
 {
-  if (!(fp && fds_with_events)) {
-    errno=EFAULT;
-    return -1;
-  }
+  sweep_by(fp,fp->poll.stamp[slot]
+           +calls_above(fp,fp->poll.activity[slot])+1);
+}
 
-  if (max_fds<=0) {
-    errno=EINVAL;
-    return -1;
+/* Brings an epoll-tier entry's activity up to date with a sample for
+ *  the current call, after however many idle calls it has missed.
+ */
+static inline void update_activity(Flexipoll fp, FlexipollEntry* entry,
+                                   int active_bool)
+{
+  unsigned missed=fp->calls-entry->stamp;
+  if (missed==1)
+    entry->activity=scale_activity(entry->activity,fp->decay);
+  else if (missed)
+    entry->activity=scale_activity(entry->activity,decay_over(fp,missed));
+
+  if (active_bool)
+    entry->activity+=ACTIVITY_ONE-fp->decay;
+  entry->stamp=fp->calls;
+}
+
+/* entry's activity as of now, whichever tier it's in. */
+static unsigned current_activity(Flexipoll fp, const FlexipollEntry* entry)
+{
+  if (!entry->in_epoll_bool) {
+    int slot=entry->slot;
+    if (!entry->armed_bool)
+      return fp->poll.activity[slot];
+    return scale_activity(fp->poll.activity[slot],
+                          decay_over(fp,fp->calls-fp->poll.stamp[slot]));
   }
+  if (!entry->armed_bool) /* it stands still while parked */
+    return entry->activity;
+  return scale_activity(entry->activity,
+                        decay_over(fp,fp->calls-entry->stamp));
+}
 
-  int num_dirty_fds=0;
+/* The fd to hand poll() for entry: negative, so poll() skips it,
+ *  while it's disarmed.
+ */
+static inline int poll_tier_fd(const FlexipollEntry* entry)
+{
+  return entry->armed_bool ? entry->fd : -1-entry->fd;
+}
 
-  fp->pollfds[0].fd=fp->epoll_fd;
-  fp->pollfds[0].events=POLLIN;
-  fp->pollfds[0].revents=0;
+/* The epoll_event.events to register entry with. */
+static inline unsigned epoll_tier_events(const FlexipollEntry* entry)
+{
+  unsigned res=(unsigned short)(entry->events);
+  if (entry->flags & FLEXIPOLL_EDGE)
+    res|=EPOLLET;
+  if (entry->flags & FLEXIPOLL_ONESHOT)
+    res|=EPOLLONESHOT;
+  return res;
+}
 
-  {
-    int i=1;
-    FlexipollEntry* entry=fp->poll.entries;
-    while (entry) {
-      fp->pollfds[i].fd=entry->fd;
-      fp->pollfds[i].events=entry->events;
-      fp->pollfds[i].revents=0;
+/* Brings entry's place in fp->embed.fd up to date: there, as in
+ *  pollfds, while it's in the poll tier (in_bool) and armed.  Poll-tier
+ *  FLEXIPOLL_EDGE goes in as EPOLLET, so that fds reported already
+ *  don't keep it readable; see embed_settle().
+ */
+static void embed_reflect(Flexipoll fp, FlexipollEntry* entry, int in_bool)
+{
+  if (fp->embed.fd<0)
+    return;
 
-      entry=entry->next_in_chain;
-      i+=1;
-    }
+  unsigned want=0;
+  if (in_bool && entry->armed_bool) {
+    want=(unsigned short)(entry->events);
+    if (entry->flags & FLEXIPOLL_EDGE)
+      want|=EPOLLET;
   }
+  if (want==entry->reflected)
+    return;
 
-  {
-    int N=poll(fp->pollfds,fp->poll.count+1,-1);
-    if (N<0) {
-      int tmp=errno;
-      perror("poll");
-      errno=tmp;
-      return -1;
-    }
-    if (N==0) {
-      fprintf(stderr,"poll() returned 0\n");
-      errno=0;
-      return 0;
+  int op=!entry->reflected ? EPOLL_CTL_ADD
+    : want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  struct epoll_event epv;
+  epv.events=want;
+  epv.data.u64=(unsigned)(entry->fd);
+
+  fp->stats.epoll_ctl_calls++;
+  if (epoll_ctl(fp->embed.fd,op,entry->fd,&epv)<0) {
+    fp->stats.epoll_ctl_failures++;
+    /* Closed, it's gone already. */
+    if (!((op==EPOLL_CTL_DEL) && ((errno==EBADF) || (errno==ENOENT)))) {
+      failed(fp,"epoll_ctl",entry->fd);
+      return;
     }
   }
 
-  int fds_index=0;
+  fp->embed.edges+=((want & EPOLLET)!=0)-((entry->reflected & EPOLLET)!=0);
+  entry->reflected=want;
+}
 
-  {
-    int i=1;
-    FlexipollEntry* entry=fp->poll.entries;
-    while (entry) {
-      entry->revents=fp->pollfds[i].revents;
-      entry->total++;
-
-      if ((entry->revents) && (fds_index<max_fds)) {
-        fds_with_events[fds_index++]=entry->fd;
-        entry->active++;
-      }
+/* Between calls, with fp->embed.fd in use: clears edges reported
+ *  already, and sets embed.timer_fd for held-over fds, SQEs yet to be
+ *  submitted, or the next timer.  Submitting them here instead would
+ *  have the polls of fds just reported go in before the caller has
+ *  read them.
+ */
+static void embed_settle(Flexipoll fp)
+{
+  /* Nobody else epoll_wait()s on it, to take EPOLLET fds off its
+   *  ready list.
+   */
+  if (fp->embed.edges) {
+    struct epoll_event epvs[16];
+    int N;
+    do {
+      fp->stats.epoll_wait_calls++;
+      N=epoll_wait(fp->embed.fd,epvs,16,0);
+    } while (N==16);
+  }
 
-      float atr=((float)(entry->active))/(entry->total);
-      if (atr<atr_threshold_below)
-        fp->dirty_fds[num_dirty_fds++]=entry->fd;
+  unsigned long long now=timerwheel_clock(), due=0;
+  if (fp->ready_count || timerwheel_have_expired(&(fp->timers))
+      || (fp->uring_bool && uring_pending(&(fp->ring)))) {
+    due=1;
+  } else {
+    int next=timerwheel_next_timeout(&(fp->timers),now);
+    if (next>0)
+      due=now+next;
+    else if (!next)
+      due=1;
+  }
+  if (due==fp->embed.due)
+    return;
 
-      entry=entry->next_in_chain;
-      i+=1;
-    }
+  struct itimerspec its;
+  memset(&its,0,sizeof(its));
+  if (due==1) {
+    its.it_value.tv_nsec=1;
+  } else if (due) {
+    its.it_value.tv_sec=(time_t)((due-now)/1000);
+    its.it_value.tv_nsec=(long)(((due-now)%1000)*1000000);
+  }
+  if (timerfd_settime(fp->embed.timer_fd,0,&its,0)<0) {
+    failed(fp,"timerfd_settime",fp->embed.timer_fd);
+    return;
   }
+  fp->embed.due=due;
+}
 
-  if (fp->pollfds[0].revents & POLLIN) {
-    int num_events=epoll_wait(fp->epoll_fd,fp->epvs,fp->num_fds,0);
-    if (num_events<0) {
-      int tmp=errno;
-      perror("epoll");
-      errno=tmp;
-      return -1;
-    }
+/* For public calls that may leave fp->embed.fd out of date.  Returns
+ *  res.
+ */
+static inline int settled(Flexipoll fp, int res)
+{
+  if ((res>=0) && fp && (fp->embed.fd>=0))
+    embed_settle(fp);
+  return res;
+}
 
-    int i;
-    for (i=0; (i<num_events) && (fds_index<max_fds); i++) {
-      FlexipollEntry* entry=(FlexipollEntry*)(fp->epvs[i].data.ptr);
-      entry->revents=fp->epvs[i].events;
+/* Appends entry to the poll tier, in the first free pollfds slot,
+ *  with the given activity as of now.
+ */
+static void poll_tier_add(Flexipoll fp, FlexipollEntry* entry,
+                          unsigned activity)
+{
+  int slot=++(fp->poll.count);
+
+  entry->last_revents=0;
+  fp->pollfds[slot].fd=poll_tier_fd(entry);
+  fp->pollfds[slot].events=entry->events;
+  fp->pollfds[slot].revents=0;
+  fp->poll.entries[slot]=entry;
+  fp->poll.activity[slot]=activity;
+  fp->poll.stamp[slot]=fp->calls;
+  entry->slot=slot;
+  sweep_for(fp,slot);
+  embed_reflect(fp,entry,1);
+}
 
-      entry->total++;
+/* Removes entry from the poll tier by moving the last slot into its
+ *  place.
+ */
+static void poll_tier_remove(Flexipoll fp, FlexipollEntry* entry)
+{
+  int slot=entry->slot;
+  int last=(fp->poll.count)--;
 
-      if (entry->revents) {
-        fds_with_events[fds_index++]=entry->fd;
-        entry->active++;
-      }
+  embed_reflect(fp,entry,0);
 
-      float atr=((float)(entry->active))/(entry->total);
-      if (atr>atr_threshold_above)
-        fp->dirty_fds[num_dirty_fds++]=entry->fd;
-    }
+  if (slot!=last) {
+    fp->pollfds[slot]=fp->pollfds[last];
+    fp->poll.entries[slot]=fp->poll.entries[last];
+    fp->poll.activity[slot]=fp->poll.activity[last];
+    fp->poll.stamp[slot]=fp->poll.stamp[last];
+    fp->poll.entries[slot]->slot=slot;
   }
+  entry->slot=-1;
+}
 
-  {
-    int i;
-    for (i=0; i<num_dirty_fds; i++) {
-      int fd=fp->dirty_fds[i];
-      FlexipollEntry* entry=fp->fd_to_entry+fd;
-      if (entry->in_epoll_bool) {
-        if (epoll_ctl(fp->epoll_fd,EPOLL_CTL_DEL,fd,0)<0) {
-          int tmp=errno;
-          perror("can't transition fd from epoll to poll: epoll_ctl");
-          errno=tmp;
-          continue;
-        }
-
-        if (entry->prev_in_chain) {
-          entry->prev_in_chain->next_in_chain=entry->next_in_chain;
-        } else {
-          fp->epoll.entries=entry->next_in_chain;
-        }
-        entry->prev_in_chain=0;
-        entry->next_in_chain=fp->poll.entries;
-        fp->poll.entries=entry;
-
-        fp->epoll.count--;
-        fp->poll.count++;
-        entry->in_epoll_bool=0;
-      } else {
-        struct epoll_event epv;
-        epv.events=entry->events;
-        epv.data.ptr=entry;
-
-        if (epoll_ctl(fp->epoll_fd,EPOLL_CTL_ADD,fd,&epv)<0) {
-          int tmp=errno;
-          perror("can't transition fd from poll to epoll: epoll_ctl");
-          errno=tmp;
-          continue;
-        }
-
-        if (entry->prev_in_chain) {
-          entry->prev_in_chain->next_in_chain=entry->next_in_chain;
-        } else {
-          fp->poll.entries=entry->next_in_chain;
-        }
-        entry->prev_in_chain=0;
-        entry->next_in_chain=fp->epoll.entries;
-        fp->epoll.entries=entry;
-
-        fp->poll.count--;
-        fp->epoll.count++;
-        entry->in_epoll_bool=1;
-      }
-    }
-  }
+static void epoll_tier_link(Flexipoll fp, FlexipollEntry* entry)
+{
+  entry->prev_in_chain=0;
+  entry->next_in_chain=fp->epoll.entries;
+  if (fp->epoll.entries)
+    fp->epoll.entries->prev_in_chain=entry;
+  fp->epoll.entries=entry;
+  fp->epoll.count++;
+}
 
-  return fds_index;
+static void epoll_tier_unlink(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (fp->audit_next==entry)
+    fp->audit_next=entry->next_in_chain;
+  if (entry->prev_in_chain)
+    entry->prev_in_chain->next_in_chain=entry->next_in_chain;
+  else
+    fp->epoll.entries=entry->next_in_chain;
+  if (entry->next_in_chain)
+    entry->next_in_chain->prev_in_chain=entry->prev_in_chain;
+  entry->next_in_chain=entry->prev_in_chain=0;
+  fp->epoll.count--;
 }
 
-int flexipoll_events(Flexipoll fp, int fd)
+/* Ends entry's registration as far as anything queued or tagged for
+ *  it is concerned.
+ */
+static inline void new_generation(FlexipollEntry* entry)
 {
-  if (!fp) {
-    errno=EFAULT;
+  entry->gen++;
+  entry->queued_bool=0;
+}
+
+/* epoll_event.data for entry: its fd and gen, so an event from an
+ *  earlier registration can be told for what it is.  That happens when
+ *  an fd is closed while a duplicate of it keeps epoll's registration
+ *  alive, and its number is reused.
+ */
+static inline unsigned long long epoll_tag(const FlexipollEntry* entry)
+{
+  return (((unsigned long long)(entry->gen & 0x7fffffff))<<32)
+    | (unsigned)(entry->fd);
+}
+
+/* io_uring user_data for entry's polls: its fd and uring_gen, so a
+ *  completion for an fd that has since been removed, moved or
+ *  re-registered can be told for what it is.
+ */
+static inline unsigned long long uring_tag(const FlexipollEntry* entry)
+{
+  return (((unsigned long long)(entry->uring_gen & 0x7fffffff))<<32)
+    | (unsigned)(entry->fd);
+}
+
+/* Queues a POLL_ADD for entry.  A FLEXIPOLL_EDGE fd gets a multishot
+ *  poll, which completes at each wakeup, like EPOLLET.  Anything else
+ *  gets a one-shot poll, queued again after each completion while the
+ *  fd is armed: a poll added while the fd is ready completes at once,
+ *  so it's reported every call it stays ready, like level-triggered
+ *  epoll.
+ */
+static int uring_poll_add(Flexipoll fp, FlexipollEntry* entry)
+{
+  struct io_uring_sqe* sqe=uring_get_sqe(&(fp->ring));
+  if (!sqe)
+    return -1;
+
+  sqe->opcode=IORING_OP_POLL_ADD;
+  sqe->fd=entry->fd;
+  sqe->poll_events=(unsigned short)(entry->events);
+  if ((entry->flags & (FLEXIPOLL_EDGE|FLEXIPOLL_ONESHOT))==FLEXIPOLL_EDGE)
+    sqe->len=IORING_POLL_ADD_MULTI;
+  sqe->user_data=uring_tag(entry);
+  entry->uring_polling_bool=1;
+  return 0;
+}
+
+/* Queues cancellation of entry's poll, if any, and disowns anything
+ *  it has yet to complete.
+ */
+static int uring_poll_remove(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (entry->uring_polling_bool) {
+    struct io_uring_sqe* sqe=uring_get_sqe(&(fp->ring));
+    if (!sqe)
+      return -1;
+
+    sqe->opcode=IORING_OP_POLL_REMOVE;
+    sqe->fd=-1;
+    sqe->addr=uring_tag(entry);
+    sqe->user_data=URING_IGNORE;
+    entry->uring_polling_bool=0;
+  }
+  entry->uring_gen++;
+  return 0;
+}
+
+/* The epoll tier's kernel side: entry joins, changes, or leaves the
+ *  epoll set, or fp->ring's polls.  Return <0 on error, having told
+ *  the error handler.
+ */
+static int epoll_tier_watch(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (fp->uring_bool) {
+    if (uring_poll_add(fp,entry)<0) {
+      failed(fp,"io_uring_enter",entry->fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  struct epoll_event epv;
+  epv.events=epoll_tier_events(entry);
+  epv.data.u64=epoll_tag(entry);
+
+  if (ctl(fp,EPOLL_CTL_ADD,entry->fd,&epv)<0) {
+    failed(fp,"epoll_ctl",entry->fd);
+    return -1;
+  }
+  return 0;
+}
+
+static int epoll_tier_rewatch(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (fp->uring_bool) {
+    if ((uring_poll_remove(fp,entry)<0) || (uring_poll_add(fp,entry)<0)) {
+      failed(fp,"io_uring_enter",entry->fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  struct epoll_event epv;
+  epv.events=epoll_tier_events(entry);
+  epv.data.u64=epoll_tag(entry);
+
+  if (ctl(fp,EPOLL_CTL_MOD,entry->fd,&epv)<0) {
+    /* The fd was closed, epoll forgot it, and its number has been
+     *  reused.  The new file is registered afresh, under a new gen, in
+     *  case a duplicate keeps the old one's registration going.
+     */
+    if (errno==ENOENT) {
+      new_generation(entry);
+      epv.data.u64=epoll_tag(entry);
+      if (ctl(fp,EPOLL_CTL_ADD,entry->fd,&epv)>=0)
+        return 0;
+    }
+    failed(fp,"epoll_ctl",entry->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* If the fd has been closed, epoll has forgotten it already; that's
+ *  no reason to hang on to the entry, so that's not an error.
+ */
+static int epoll_tier_unwatch(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (fp->uring_bool) {
+    if (uring_poll_remove(fp,entry)<0) {
+      failed(fp,"io_uring_enter",entry->fd);
+      return -1;
+    }
+    return 0;
+  }
+
+  if ((ctl(fp,EPOLL_CTL_DEL,entry->fd,0)<0)
+      && (errno!=EBADF) && (errno!=ENOENT)) {
+    failed(fp,"epoll_ctl",entry->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Moves entry to the other tier.  Returns <0 on error, having told
+ *  the error handler; entry stays where it was.
+ */
+static int migrate_entry(Flexipoll fp, FlexipollEntry* entry)
+{
+  /* Back off exponentially if it keeps flapping, but not forever. */
+  if (fp->calls-entry->last_migration>
+      ((unsigned)(fp->half_life)<<(MAX_MIGRATION_BACKOFF+1)))
+    entry->migrations=0;
+  entry->hold=((unsigned)(fp->half_life))
+    <<(entry->migrations<MAX_MIGRATION_BACKOFF ?
+       entry->migrations : MAX_MIGRATION_BACKOFF);
+  entry->last_migration=fp->calls;
+  entry->migrations++;
+
+  unsigned activity=current_activity(fp,entry);
+
+  if (entry->in_epoll_bool) {
+    if (epoll_tier_unwatch(fp,entry)<0)
+      return -1;
+
+    epoll_tier_unlink(fp,entry);
+    poll_tier_add(fp,entry,activity);
+    entry->in_epoll_bool=0;
+    fp->stats.to_poll++;
+    trace(fp,FLEXIPOLL_TRACE_MIGRATE,entry->fd,FLEXIPOLL_TRACE_POLL_TIER,0);
+  } else {
+    if (epoll_tier_watch(fp,entry)<0)
+      return -1;
+
+    poll_tier_remove(fp,entry);
+    epoll_tier_link(fp,entry);
+    entry->activity=activity;
+    entry->stamp=fp->calls;
+    entry->in_epoll_bool=1;
+    fp->stats.to_epoll++;
+    trace(fp,FLEXIPOLL_TRACE_MIGRATE,entry->fd,FLEXIPOLL_TRACE_EPOLL_TIER,
+          0);
+  }
+  return 0;
+}
+
+/* Puts entry in, takes it out of, or updates it in the urgent set, as
+ *  its class, flags and events say.
+ */
+static void urgent_update(Flexipoll fp, FlexipollEntry* entry)
+{
+  int want_bool=(entry->fd>=0) && entry->priority
+    && !(entry->flags & (FLEXIPOLL_EDGE|FLEXIPOLL_ONESHOT));
+  int slot=entry->urgent_slot;
+
+  if (want_bool) {
+    if (slot<0) {
+      slot=fp->urgent.count++;
+      fp->urgent.entries[slot]=entry;
+      entry->urgent_slot=slot;
+    }
+    fp->urgent.pollfds[slot].fd=entry->fd;
+    fp->urgent.pollfds[slot].events=entry->events;
+    fp->urgent.pollfds[slot].revents=0;
+  } else if (slot>=0) {
+    int last=--(fp->urgent.count);
+    if (slot!=last) {
+      fp->urgent.pollfds[slot]=fp->urgent.pollfds[last];
+      fp->urgent.entries[slot]=fp->urgent.entries[last];
+      fp->urgent.entries[slot]->urgent_slot=slot;
+    }
+    entry->urgent_slot=-1;
+  }
+}
+
+/* Unregisters entry, in O(1): whatever the ready queue holds for it
+ *  goes stale, and it leaves fp->dirty, the last there taking its
+ *  place.  Returns <0 on error, having told the error handler.
+ */
+static int remove_entry(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (entry->in_epoll_bool) {
+    if (epoll_tier_unwatch(fp,entry)<0)
+      return -1;
+    epoll_tier_unlink(fp,entry);
+  } else {
+    poll_tier_remove(fp,entry);
+  }
+  trace(fp,FLEXIPOLL_TRACE_REMOVE,entry->fd,entry->in_epoll_bool,0);
+
+  new_generation(entry);
+
+  if (entry->dirty_slot>=0) {
+    int slot=entry->dirty_slot, last=--(fp->num_dirty);
+    if (slot!=last) {
+      fp->dirty[slot]=fp->dirty[last];
+      fp->dirty[slot]->dirty_slot=slot;
+    }
+    entry->dirty_slot=-1;
+  }
+
+  if (entry->prev_overall)
+    entry->prev_overall->next_overall=entry->next_overall;
+  else
+    fp->all.entries=entry->next_overall;
+  if (entry->next_overall)
+    entry->next_overall->prev_overall=entry->prev_overall;
+  fp->all.count--;
+
+  entry->fd=-1;
+  urgent_update(fp,entry);
+  return 0;
+}
+
+/* Which of add_fd()'s optional arguments to apply. */
+#define ADD_FD_DATA 1
+#define ADD_FD_FLAGS 2
+
+/* Returns nonzero if fd could be open, so that a garbage fd doesn't
+ *  have fd_to_entry grow to fit it.  The limit can be raised, so it's
+ *  looked up again for fds past the last look.
+ */
+static int fd_in_range(Flexipoll fp, int fd)
+{
+  if (fd<fp->fd_limit)
+    return 1;
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE,&limit)<0)
+    return 0;
+  fp->fd_limit=((limit.rlim_cur==RLIM_INFINITY)
+                || (limit.rlim_cur>(rlim_t)(INT_MAX))) ?
+    INT_MAX : (int)(limit.rlim_cur);
+  return fd<fp->fd_limit;
+}
+
+static int add_fd(Flexipoll fp, int fd, short events,
+                  int what, unsigned flags, void* data)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if ((fd<0) || !fd_in_range(fp,fd)) {
+    errno=EBADF;
+    return -1;
+  }
+
+  if ((events & (~all_events)) || !valid_flags(flags)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  FlexipollEntry* entry=make_entry(fp,fd);
+  if (!entry)
+    return -1;
+
+  /* Found closed, but not yet reported as such, and its number reused
+   *  already: the caller knows.  Start over.
+   */
+  if ((entry->fd>=0) && entry->queued_bool && (entry->revents & POLLNVAL)
+      && (remove_entry(fp,entry)<0))
+    return -1;
+
+  if (entry->fd<0) {
+    if (reserve_capacity(fp)<0)
+      return -1;
+
+    entry->fd=fd;
+    entry->events=events;
+    entry->flags=(what & ADD_FD_FLAGS) ? flags : 0;
+    entry->armed_bool=1;
+    entry->stamp=fp->calls;
+    entry->migrations=0;
+    entry->last_migration=fp->calls;
+    entry->hold=0;
+    entry->revents=0;
+    entry->data=0;
+    entry->drain_kind=DRAIN_UNKNOWN;
+    entry->urgent_slot=-1;
+    entry->reflected=0;
+
+    /* Where to start, and with what activity, per the hints. */
+    unsigned activity;
+    int epoll_bool;
+    {
+      int pct=prior_pct(entry->flags);
+      activity=(pct>=0) ?
+        (unsigned)(((unsigned long long)(pct)*ACTIVITY_ONE+50)/100)
+        : to_activity(atr_threshold);
+
+      if (entry->flags & (FLEXIPOLL_START_EPOLL|FLEXIPOLL_PIN_EPOLL)) {
+        epoll_bool=1;
+        if (pct<0)
+          activity=0;
+      } else if (entry->flags & (FLEXIPOLL_START_POLL|FLEXIPOLL_PIN_POLL)) {
+        epoll_bool=0;
+      } else {
+        epoll_bool=(pct>=0) && (activity<fp->threshold_below);
+      }
+    }
+
+    if (epoll_bool) {
+      entry->in_epoll_bool=1;
+      entry->slot=-1;
+      if (epoll_tier_watch(fp,entry)<0) {
+        entry->fd=-1;
+        return -1;
+      }
+      epoll_tier_link(fp,entry);
+      entry->activity=activity;
+    } else {
+      entry->in_epoll_bool=0;
+      poll_tier_add(fp,entry,activity);
+    }
+
+    entry->next_overall=fp->all.entries;
+    entry->prev_overall=0;
+    if (fp->all.entries)
+      fp->all.entries->prev_overall=entry;
+    fp->all.entries=entry;
+    fp->all.count++;
+    trace(fp,FLEXIPOLL_TRACE_ADD,fd,entry->in_epoll_bool,entry->flags);
+  } else {
+    FlexipollEntry old=*entry;
+
+    entry->events=events;
+    if (what & ADD_FD_FLAGS)
+      entry->flags=flags;
+    if (!entry->armed_bool) {
+      entry->armed_bool=1;
+      entry->stamp=fp->calls;
+    }
+
+    unsigned pinned_away=entry->flags
+      & (entry->in_epoll_bool ? FLEXIPOLL_PIN_POLL : FLEXIPOLL_PIN_EPOLL);
+
+    if (pinned_away) {
+      /* Moving registers it afresh, with the new events and flags. */
+      if (migrate_entry(fp,entry)<0) {
+        int tmp=errno;
+        *entry=old;
+        errno=tmp;
+        return -1;
+      }
+    } else if (entry->in_epoll_bool) {
+      if (epoll_tier_rewatch(fp,entry)<0) {
+        int tmp=errno;
+        *entry=old;
+        errno=tmp;
+        return -1;
+      }
+    } else {
+      /* Rearmed, or maybe unpinned: either way, it may need to move
+       *  sooner than the next sweep.
+       */
+      if (!old.armed_bool)
+        fp->poll.stamp[entry->slot]=fp->calls;
+      fp->pollfds[entry->slot].fd=poll_tier_fd(entry);
+      fp->pollfds[entry->slot].events=events;
+      entry->last_revents=0;
+      sweep_for(fp,entry->slot);
+      embed_reflect(fp,entry,1);
+    }
+  }
+
+  entry->priority=class_of(entry->flags);
+  urgent_update(fp,entry);
+
+  if (what & ADD_FD_DATA)
+    entry->data=data;
+  return 0;
+}
+
+int flexipoll_add_fd(Flexipoll fp, int fd, short events)
+{
+  return settled(fp,add_fd(fp,fd,events,0,0,0));
+}
+
+int flexipoll_add_fd_data(Flexipoll fp, int fd, short events, void* data)
+{
+  return settled(fp,add_fd(fp,fd,events,ADD_FD_DATA,0,data));
+}
+
+int flexipoll_add_fd_ex(Flexipoll fp, int fd, short events,
+                        unsigned flags, void* data)
+{
+  return settled(fp,add_fd(fp,fd,events,ADD_FD_DATA|ADD_FD_FLAGS,flags,
+                           data));
+}
+
+int flexipoll_rearm(Flexipoll fp, int fd)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  FlexipollEntry* entry=lookup_entry(fp,fd);
+  if (!entry || (entry->fd<0)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  if (entry->armed_bool)
+    return 0;
+
+  if (entry->in_epoll_bool) {
+    if (epoll_tier_rewatch(fp,entry)<0)
+      return -1;
+    entry->armed_bool=1;
+  } else {
+    entry->armed_bool=1;
+    entry->last_revents=0;
+    fp->pollfds[entry->slot].fd=poll_tier_fd(entry);
+    fp->poll.stamp[entry->slot]=fp->calls;
+    sweep_for(fp,entry->slot);
+    embed_reflect(fp,entry,1);
+  }
+
+  /* Its activity stood still while it was parked. */
+  entry->stamp=fp->calls;
+  return settled(fp,0);
+}
+
+int flexipoll_remove_fd(Flexipoll fp, int fd)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  FlexipollEntry* entry=lookup_entry(fp,fd);
+  if (!entry || (entry->fd<0))
+    return 0;
+
+  if (remove_entry(fp,entry)<0)
+    return -1;
+  entry->revents=0;
+  return settled(fp,0);
+}
+
+int flexipoll_wakeup(Flexipoll fp)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  /* One write per batch of posts is plenty. */
+  if (!atomic_exchange(&(fp->wake_pending_bool),1)) {
+    uint64_t one=1;
+    if (write(fp->wake_fd,&one,sizeof(one))<0) {
+      /* Only if the counter is about to overflow, in which case it's
+       *  readable already.
+       */
+    }
+  }
+  return 0;
+}
+
+static int post(Flexipoll fp, PostedType type, int fd, short events,
+                unsigned flags, void* data)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  if ((events & (~all_events)) || !valid_flags(flags)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  PostedCommand* cmd=(PostedCommand*)(malloc(sizeof(PostedCommand)));
+  if (!cmd)
+    return -1;
+
+  cmd->type=type;
+  cmd->fd=fd;
+  cmd->events=events;
+  cmd->flags=flags;
+  cmd->data=data;
+  mpscq_push(&(fp->posted),&(cmd->node));
+
+  return flexipoll_wakeup(fp);
+}
+
+int flexipoll_post_add_fd(Flexipoll fp, int fd, short events,
+                          unsigned flags, void* data)
+{
+  return post(fp,POSTED_ADD,fd,events,flags,data);
+}
+
+int flexipoll_post_rearm(Flexipoll fp, int fd)
+{
+  return post(fp,POSTED_REARM,fd,0,0,0);
+}
+
+int flexipoll_post_remove_fd(Flexipoll fp, int fd)
+{
+  return post(fp,POSTED_REMOVE,fd,0,0,0);
+}
+
+/* Carries out whatever other threads have posted, in order.  Called
+ *  by the polling thread before it blocks; anything posted later
+ *  leaves wake_fd readable.
+ */
+static void run_posted(Flexipoll fp)
+{
+  MpscNode* node;
+  while ((node=mpscq_pop(&(fp->posted)))) {
+    PostedCommand* cmd=(PostedCommand*)node;
+    const char* what=0;
+    int res=0;
+
+    switch (cmd->type) {
+    case POSTED_ADD:
+      what="flexipoll_post_add_fd";
+      res=add_fd(fp,cmd->fd,cmd->events,ADD_FD_DATA|ADD_FD_FLAGS,
+                 cmd->flags,cmd->data);
+      break;
+    case POSTED_REARM:
+      what="flexipoll_post_rearm";
+      res=flexipoll_rearm(fp,cmd->fd);
+      break;
+    case POSTED_REMOVE:
+      what="flexipoll_post_remove_fd";
+      res=flexipoll_remove_fd(fp,cmd->fd);
+      break;
+    }
+
+    /* The poster is long gone; this is the only way to tell anyone. */
+    if (res<0)
+      failed(fp,what,cmd->fd);
+    else
+      fp->stats.posted++;
+
+    free(cmd);
+  }
+}
+
+/* Records entry as ready in whichever of fds_with_events or events
+ *  the caller passed.
+ */
+static inline void report(FlexipollEntry* entry,
+                          int* fds_with_events, FlexipollEvent* events,
+                          int index)
+{
+  if (events) {
+    events[index].fd=entry->fd;
+    events[index].revents=entry->revents;
+    events[index].data=entry->data;
+  } else {
+    fds_with_events[index]=entry->fd;
+  }
+}
+
+/* Notes that entry has just been reported to the caller. */
+static inline void reported(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (entry->flags & FLEXIPOLL_ONESHOT) {
+    /* epoll has disarmed it already, if it's there. */
+    entry->armed_bool=0;
+    if (!entry->in_epoll_bool) {
+      fp->pollfds[entry->slot].fd=poll_tier_fd(entry);
+      embed_reflect(fp,entry,1);
+    }
+  }
+}
+
+/* Appends expired timers to events[index..max_fds], as fd -1 with
+ *  the timer's data.  Timers that don't fit stay expired for next
+ *  time.  Returns the new index.
+ */
+static int report_timers(Flexipoll fp, FlexipollEvent* events,
+                         int index, int max_fds)
+{
+  timerwheel_advance(&(fp->timers),timerwheel_clock());
+
+  while (index<max_fds) {
+    struct FlexipollTimer_* timer=
+      (struct FlexipollTimer_*)(timerwheel_pop_expired(&(fp->timers)));
+    if (!timer)
+      break;
+
+    events[index].fd=-1;
+    events[index].revents=0;
+    events[index].data=timer->data;
+    index++;
+  }
+
+  return index;
+}
+
+/* Queues entry to change tiers, unless it's already queued or still
+ *  settling down from its last move.
+ */
+static inline void mark_dirty(Flexipoll fp, FlexipollEntry* entry)
+{
+  if ((entry->dirty_slot>=0)
+      || (fp->calls-entry->last_migration<entry->hold)
+      || !entry->armed_bool || (entry->flags & PIN_FLAGS))
+    return;
+
+  entry->dirty_slot=fp->num_dirty;
+  fp->dirty[fp->num_dirty++]=entry;
+}
+
+/* How much it costs to leave entry in the wrong tier, in arbitrary
+ *  units: how far its activity is past the threshold it crossed.
+ *  <=0 if it has drifted back since it was queued.
+ */
+static int misclassification_cost(Flexipoll fp, FlexipollEntry* entry)
+{
+  int activity=(int)(current_activity(fp,entry));
+
+  if (entry->in_epoll_bool)
+    return activity-(int)(fp->threshold_above);
+  else
+    return (int)(fp->threshold_below)-activity;
+}
+
+/* Moves the first n entries of fp->dirty to the front, in no
+ *  particular order, such that none of the rest costs more than any
+ *  of them.  Quickselect; costs are stashed alongside in costs.
+ */
+static void select_costliest(FlexipollEntry** dirty, int* costs,
+                             int num, int n)
+{
+  int lo=0, hi=num-1;
+
+  while (lo<hi) {
+    int pivot=costs[(lo+hi)/2];
+    int i=lo, j=hi;
+
+    while (i<=j) {
+      while (costs[i]>pivot)
+        i++;
+      while (costs[j]<pivot)
+        j--;
+      if (i<=j) {
+        int cost=costs[i];
+        FlexipollEntry* entry=dirty[i];
+        costs[i]=costs[j];
+        dirty[i]=dirty[j];
+        costs[j]=cost;
+        dirty[j]=entry;
+        i++;
+        j--;
+      }
+    }
+
+    if (n-1<=j)
+      hi=j;
+    else if (n-1>=i)
+      lo=i;
+    else
+      break;
+  }
+}
+
+/* Works through the queue of entries that want to change tiers,
+ *  costliest first, doing at most fp->migration_budget of them.  The
+ *  rest wait for the next call.
+ */
+static void migrate(Flexipoll fp)
+{
+  if (!fp->num_dirty)
+    return;
+
+  /* Drop entries that have been disarmed (they stay put until
+   *  rearmed), been pinned or no longer want to move.  The
+   *  survivors' costs go in epvs, which is free again by now and at
+   *  least as long as dirty.
+   */
+  int* costs=(int*)(fp->epvs);
+  int num=0;
+  {
+    int i;
+    for (i=0; i<fp->num_dirty; i++) {
+      FlexipollEntry* entry=fp->dirty[i];
+      int cost=(!entry->armed_bool || (entry->flags & PIN_FLAGS)) ?
+        0 : misclassification_cost(fp,entry);
+      if (cost>0) {
+        fp->dirty[num]=entry;
+        costs[num]=cost;
+        num++;
+      } else {
+        entry->dirty_slot=-1;
+        /* Sweeps pass over dirty entries, so it needs its own. */
+        if (!entry->in_epoll_bool && entry->armed_bool)
+          sweep_for(fp,entry->slot);
+      }
+    }
+  }
+
+  int n=num;
+  if (fp->migration_budget && (n>fp->migration_budget)) {
+    n=fp->migration_budget;
+    select_costliest(fp->dirty,costs,num,n);
+  }
+
+  {
+    int i;
+    for (i=0; i<n; i++) {
+      fp->dirty[i]->dirty_slot=-1;
+      migrate_entry(fp,fp->dirty[i]);
+    }
+    for (i=n; i<num; i++) {
+      fp->dirty[i-n]=fp->dirty[i];
+      fp->dirty[i-n]->dirty_slot=i-n;
+    }
+  }
+  fp->num_dirty=num-n;
+}
+
+/* Appends entry to the ready queue. */
+static inline void enqueue(Flexipoll fp, FlexipollEntry* entry)
+{
+  ReadyQueue* queue=fp->ready+entry->priority;
+  QueuedEntry* queued=
+    queue->ring+((queue->head+queue->count) & (fp->capacity-1));
+  queued->entry=entry;
+  queued->gen=entry->gen;
+  queue->count++;
+  fp->ready_count++;
+  entry->queued_bool=1;
+}
+
+/* Reports entries off the front of the ready queues, highest class
+ *  first, into events[index..max_fds] (or fds_with_events).  Returns
+ *  the new index.
+ */
+static int deliver(Flexipoll fp,
+                   int* fds_with_events, FlexipollEvent* events,
+                   int index, int max_fds)
+{
+  int klass=FLEXIPOLL_CLASSES-1;
+  while (fp->ready_count && (index<max_fds)) {
+    ReadyQueue* queue=fp->ready+klass;
+    if (!queue->count) {
+      klass--;
+      continue;
+    }
+
+    QueuedEntry* queued=queue->ring+queue->head;
+    FlexipollEntry* entry=queued->entry;
+    queue->head=(queue->head+1) & (fp->capacity-1);
+    queue->count--;
+    fp->ready_count--;
+
+    if (queued->gen!=entry->gen) /* removed since */
+      continue;
+    entry->queued_bool=0;
+
+    /* It may have been re-registered for fewer events since. */
+    entry->revents&=(entry->events|POLLERR|POLLHUP|POLLNVAL);
+    if (!entry->revents)
+      continue;
+
+    report(entry,fds_with_events,events,index++);
+
+    /* Closed: say so once, then let it go, before the number is
+     *  reused.  revents stays, for flexipoll_events().
+     */
+    if (entry->revents & POLLNVAL) {
+      if (remove_entry(fp,entry)>=0)
+        fp->stats.retired++;
+      continue;
+    }
+    reported(fp,entry);
+  }
+
+  return index;
+}
+
+/* Marks entry, in the poll tier and below threshold_below, to move;
+ *  if it's still settling from its last move, has the poll tier swept
+ *  again once it may.
+ */
+static inline void poll_tier_below(Flexipoll fp, FlexipollEntry* entry)
+{
+  mark_dirty(fp,entry);
+  if ((entry->dirty_slot<0) && entry->armed_bool
+      && !(entry->flags & PIN_FLAGS))
+    sweep_by(fp,entry->last_migration+entry->hold);
+}
+
+/* Brings every armed poll-tier fd's activity up to date, marks those
+ *  below threshold_below to move, and sets the next sweep for when the
+ *  lowest of the rest could follow them.
+ */
+static void sweep_poll_tier(Flexipoll fp)
+{
+  const struct pollfd* pollfd=fp->pollfds+1;
+  unsigned* activity=fp->poll.activity+1;
+  unsigned* stamp=fp->poll.stamp+1;
+  unsigned below=fp->threshold_below, lowest=~0U;
+  unsigned missed=0, factor=ACTIVITY_ONE;
+  int i;
+
+  fp->poll.sweep_at=fp->calls+(1U<<DECAY_POWERS);
+  for (i=0; i<fp->poll.count; i++) {
+    if (pollfd[i].fd<0) /* disarmed */
+      continue;
+
+    /* Since the last sweep, most have missed the same number of
+     *  calls.
+     */
+    unsigned m=fp->calls-stamp[i];
+    if (m) {
+      if (m!=missed) {
+        missed=m;
+        factor=decay_over(fp,m);
+      }
+      activity[i]=scale_activity(activity[i],factor);
+      stamp[i]=fp->calls;
+    }
+
+    if (activity[i]<below)
+      poll_tier_below(fp,fp->poll.entries[i+1]);
+    else if (activity[i]<lowest)
+      lowest=activity[i];
+  }
+
+  if (lowest!=~0U)
+    sweep_by(fp,fp->calls+calls_above(fp,lowest)+1);
+}
+
+/* Takes the FLEXIPOLL_EDGE fd in slot, found still ready with nothing
+ *  new to report, out of poll() for the rest of this call, so that a
+ *  blocking poll() can wait for something else: its events less those
+ *  already up, or out altogether if it's up for POLLERR or POLLHUP,
+ *  which poll() reports regardless.  No bit that's up can rise again
+ *  until the caller has had a look.
+ */
+static void park_edge(Flexipoll fp, int slot)
+{
+  struct pollfd* pollfd=fp->pollfds+slot;
+  if (pollfd->revents & (POLLERR|POLLHUP))
+    pollfd->fd=-1-pollfd->fd;
+  else
+    pollfd->events&=~(pollfd->revents);
+  fp->poll.parked++;
+}
+
+/* Puts the fds park_edge() took out back into poll(), as last seen
+ *  ready by the latest one.
+ */
+static void unpark_edges(Flexipoll fp)
+{
+  if (!fp->poll.parked)
+    return;
+
+  int i;
+  for (i=1; i<=fp->poll.count; i++) {
+    FlexipollEntry* entry=fp->poll.entries[i];
+    struct pollfd* pollfd=fp->pollfds+i;
+    if ((pollfd->events!=entry->events)
+        || (pollfd->fd!=poll_tier_fd(entry))) {
+      pollfd->fd=poll_tier_fd(entry);
+      pollfd->events=entry->events;
+      entry->edge_stamp=fp->polls;
+    }
+  }
+  fp->poll.parked=0;
+}
+
+/* Queues the poll tier's ready fds, as found by the last poll(), of
+ *  which there are wanted.  scan_ready() finds them without looking at
+ *  idle fds, whose activity waits for the next sweep.
+ */
+static void harvest_poll_tier(Flexipoll fp, int wanted)
+{
+  int* ready=fp->poll.ready_slots;
+  int N=wanted ? scan_ready(fp->pollfds+1,fp->poll.count,wanted,ready) : 0;
+  unsigned decay=fp->decay, gain=ACTIVITY_ONE-decay;
+  unsigned below=fp->threshold_below;
+  int i;
+
+  for (i=0; i<N; i++) {
+    int slot=ready[i]+1;
+    const struct pollfd* pollfd=fp->pollfds+slot;
+    FlexipollEntry* entry=fp->poll.entries[slot];
+
+    /* Parked, it's still up for what it was parked for. */
+    short revents=pollfd->revents;
+    if (pollfd->events!=entry->events)
+      revents|=entry->events & ~(pollfd->events);
+
+    unsigned a=fp->poll.activity[slot], missed=fp->calls-fp->poll.stamp[slot];
+    if (missed==1)
+      a=scale_activity(a,decay);
+    else if (missed)
+      a=scale_activity(a,decay_over(fp,missed));
+    a+=gain;
+    fp->poll.activity[slot]=a;
+    fp->poll.stamp[slot]=fp->calls;
+
+    entry->revents=revents;
+    trace(fp,FLEXIPOLL_TRACE_READY,entry->fd,FLEXIPOLL_TRACE_POLL_TIER,
+          (unsigned short)(revents));
+
+    /* An edge-triggered fd is only news when a bit comes up that
+     *  wasn't up last time.  If it wasn't ready last time, nothing was
+     *  up.
+     */
+    short fresh=revents;
+    if ((entry->flags & FLEXIPOLL_EDGE) && (entry->edge_stamp==fp->polls-1))
+      fresh&=~(entry->last_revents);
+    if (fresh)
+      enqueue(fp,entry);
+    else
+      park_edge(fp,slot);
+    entry->last_revents=revents;
+    entry->edge_stamp=fp->polls;
+
+    /* Being ready only puts off its next move to epoll, which the
+     *  next sweep is already early enough for.
+     */
+    if (a<below)
+      poll_tier_below(fp,entry);
+  }
+
+  if ((int)(fp->calls-fp->poll.sweep_at)>=0)
+    sweep_poll_tier(fp);
+}
+
+/* Has wake_fd polled by fp->ring: a multishot poll, so it needs
+ *  queueing again only if the kernel gives up on it.
+ */
+static int uring_poll_wake_fd(Flexipoll fp)
+{
+  struct io_uring_sqe* sqe=uring_get_sqe(&(fp->ring));
+  if (!sqe)
+    return -1;
+
+  sqe->opcode=IORING_OP_POLL_ADD;
+  sqe->fd=fp->wake_fd;
+  sqe->poll_events=POLLIN;
+  sqe->len=IORING_POLL_ADD_MULTI;
+  sqe->user_data=URING_WAKE;
+  return 0;
+}
+
+/* wake_fd is readable: we're up, which was the point.  Whatever was
+ *  posted gets run next call.  Read before clearing the flag, so that a
+ *  wakeup which finds it clear is sure to be seen.
+ */
+static void woken(Flexipoll fp)
+{
+  uint64_t count;
+  if (read(fp->wake_fd,&count,sizeof(count))<0) {
+    /* Can't happen: the kernel just said it was readable. */
+  }
+  atomic_store(&(fp->wake_pending_bool),0);
+  fp->stats.wakeups++;
+}
+
+/* As harvest_epoll_tier(), when the epoll tier is kept by io_uring:
+ *  the ready fds are the completions sitting in fp->ring's CQ ring,
+ *  which takes no system call to read.
+ */
+static int harvest_uring_tier(Flexipoll fp)
+{
+  Uring* ring=&(fp->ring);
+
+  for (;;) {
+    struct io_uring_cqe* cqe;
+    while ((cqe=uring_peek_cqe(ring))) {
+      unsigned long long tag=cqe->user_data;
+      int res=cqe->res;
+      int more_bool=(cqe->flags & IORING_CQE_F_MORE)!=0;
+      uring_cqe_seen(ring);
+
+      if (tag==URING_IGNORE)
+        continue;
+
+      if (tag==URING_WAKE) {
+        woken(fp);
+        if (!more_bool && (uring_poll_wake_fd(fp)<0))
+          failed(fp,"io_uring_enter",fp->wake_fd);
+        continue;
+      }
+
+      /* Anything for a poll we've since cancelled is stale. */
+      FlexipollEntry* entry=lookup_entry(fp,(int)(unsigned)(tag));
+      if (!entry || (entry->fd<0) || !entry->in_epoll_bool
+          || (uring_tag(entry)!=tag))
+        continue;
+      if (!more_bool)
+        entry->uring_polling_bool=0;
+
+      short revents;
+      if (res>=0) {
+        revents=(short)(res);
+      } else {
+        /* Most likely the fd was closed before its poll went in.  Say
+         *  so the way poll() would, and don't try again.
+         */
+        errno=-res;
+        failed(fp,"io_uring poll",entry->fd);
+        revents=(res==-EBADF) ? POLLNVAL : POLLERR;
+      }
+
+      update_activity(fp,entry,1);
+      trace(fp,FLEXIPOLL_TRACE_READY,entry->fd,FLEXIPOLL_TRACE_EPOLL_TIER,
+            (unsigned short)(revents));
+      /* A multishot poll may complete more than once per harvest. */
+      if (entry->queued_bool) {
+        entry->revents|=revents;
+      } else {
+        entry->revents=revents;
+        enqueue(fp,entry);
+      }
+
+      if (entry->activity>fp->threshold_above)
+        mark_dirty(fp,entry);
+
+      if ((res>=0) && !entry->uring_polling_bool && entry->armed_bool
+          && !(entry->flags & FLEXIPOLL_ONESHOT)
+          && (uring_poll_add(fp,entry)<0))
+        failed(fp,"io_uring_enter",entry->fd);
+    }
+
+    /* The kernel holds on to completions that didn't fit. */
+    if (!uring_cq_overflowed(ring))
+      break;
+    if (uring_flush_overflow(ring)<0) {
+      failed(fp,"io_uring_enter",-1);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Queues the epoll tier's ready fds.  Returns <0 on error. */
+static int harvest_epoll_tier(Flexipoll fp)
+{
+  if (fp->uring_bool)
+    return harvest_uring_tier(fp);
+
+  if (!(fp->pollfds[0].revents & POLLIN))
+    return 0;
+
+  /* Take them all, however few the caller has room for: anything left
+   *  in the kernel would lose its turn to the poll tier next time.
+   *  +1 for wake_fd; that's still no more than fp->capacity.
+   */
+  int maxevents=fp->epoll.count+1;
+
+  fp->stats.epoll_wait_calls++;
+  unsigned long long before=fp->recalibration.interval ? now_ns() : 0;
+  int num_events=epoll_wait(fp->epoll_fd,fp->epvs,maxevents,0);
+  if (num_events<0) {
+    failed(fp,"epoll_wait",-1);
+    return -1;
+  }
+  if (fp->recalibration.interval && num_events) {
+    fp->recalibration.epoll_wait_ns+=now_ns()-before;
+    fp->recalibration.epoll_events+=num_events;
+  }
+
+  int i;
+  for (i=0; i<num_events; i++) {
+    unsigned long long tag=fp->epvs[i].data.u64;
+    if (tag==EPOLL_WAKE) {
+      woken(fp);
+      continue;
+    }
+
+    FlexipollEntry* entry=lookup_entry(fp,(int)(unsigned)(tag));
+    if (!entry || (entry->fd<0) || !entry->in_epoll_bool
+        || (epoll_tag(entry)!=tag)) {
+      fp->stats.stale_events++;
+      continue;
+    }
+    entry->revents=fp->epvs[i].events;
+    trace(fp,FLEXIPOLL_TRACE_READY,entry->fd,FLEXIPOLL_TRACE_EPOLL_TIER,
+          (unsigned short)(entry->revents));
+
+    update_activity(fp,entry,entry->revents!=0);
+    if (entry->revents)
+      enqueue(fp,entry);
+
+    if (entry->activity>fp->threshold_above)
+      mark_dirty(fp,entry);
+  }
+
+  return 0;
+}
+
+/* Whether entry's fd is still the file that was registered, as far as
+ *  the epoll tier can tell.  Re-adding it is harmless: epoll refuses
+ *  if it's still there.  With io_uring, whose polls keep the file open
+ *  anyway, all there is to tell is whether the fd is still open.
+ */
+static int epoll_tier_alive(Flexipoll fp, FlexipollEntry* entry)
+{
+  if (fp->uring_bool)
+    return (fcntl(entry->fd,F_GETFD)>=0) || (errno!=EBADF);
+
+  struct epoll_event epv;
+  memset(&epv,0,sizeof(epv));
+  fp->stats.epoll_ctl_calls++;
+  if (epoll_ctl(fp->epoll_fd,EPOLL_CTL_ADD,entry->fd,&epv)<0)
+    return (errno!=EBADF) && (errno!=EPERM); /* EPERM: not pollable, so
+                                              *  not what was registered
+                                              */
+
+  /* It's some other file now; not ours to watch. */
+  fp->stats.epoll_ctl_calls++;
+  epoll_ctl(fp->epoll_fd,EPOLL_CTL_DEL,entry->fd,0);
+  return 0;
+}
+
+/* Checks the next few epoll-tier fds, and queues those found closed
+ *  to be reported POLLNVAL, which retires them.  Ones already queued
+ *  have just been heard from.
+ */
+static void audit_epoll_tier(Flexipoll fp)
+{
+  int i;
+  for (i=0; (i<AUDIT_BATCH) && (i<fp->epoll.count); i++) {
+    FlexipollEntry* entry=fp->audit_next ? fp->audit_next : fp->epoll.entries;
+    fp->audit_next=entry->next_in_chain;
+
+    if (!entry->queued_bool && !epoll_tier_alive(fp,entry)) {
+      entry->revents=POLLNVAL;
+      enqueue(fp,entry);
+    }
+  }
+}
+
+/* Derives fresh costs from what this interval observed, and applies
+ *  them once there's something for each.
+ */
+static void recalibrate(Flexipoll fp)
+{
+  FlexipollCosts costs=fp->costs;
+
+  if (fp->recalibration.poll_ns>0)
+    costs.poll_ns=fp->recalibration.poll_ns;
+  if (fp->recalibration.epoll_events)
+    costs.epoll_event_ns=(float)(fp->recalibration.epoll_wait_ns)
+      /fp->recalibration.epoll_events;
+  if (fp->recalibration.epoll_ctl_calls)
+    costs.epoll_ctl_ns=(float)(fp->recalibration.epoll_ctl_ns)
+      /fp->recalibration.epoll_ctl_calls;
+
+  int interval=fp->recalibration.interval;
+  memset(&(fp->recalibration),0,sizeof(fp->recalibration));
+  fp->recalibration.interval=fp->recalibration.countdown=interval;
+
+  if (flexipoll_apply_costs(fp,&costs)<0)
+    fp->costs=costs; /* some still unknown */
+}
+
+/* Folds a call's wait for something to turn up into the average, and
+ *  sets how long the next call may spin from it.
+ */
+static void spun(Flexipoll fp, unsigned long long wait_ns)
+{
+  if (wait_ns>fp->spin.wait_ns)
+    fp->spin.wait_ns+=(wait_ns-fp->spin.wait_ns)>>SPIN_AVERAGE_SHIFT;
+  else
+    fp->spin.wait_ns-=(fp->spin.wait_ns-wait_ns)>>SPIN_AVERAGE_SHIFT;
+
+  /* Not worth starting a spin that will likely end in a block. */
+  if (fp->spin.wait_ns>fp->spin.max_ns)
+    fp->spin.budget_ns=0;
+  else if (fp->spin.wait_ns*SPIN_WAITS>fp->spin.max_ns)
+    fp->spin.budget_ns=fp->spin.max_ns;
+  else
+    fp->spin.budget_ns=fp->spin.wait_ns*SPIN_WAITS;
+}
+
+/* poll()s both tiers at once, the epoll tier being pollfds[0]: first
+ *  without blocking for as long as busy polling allows, then for what's
+ *  left of timeout.  Returns what the last poll() did.
+ */
+static int poll_tiers(Flexipoll fp, int timeout)
+{
+  int clock_bool=fp->timing_bool || fp->recalibration.interval
+    || fp->spin.max_ns;
+  unsigned long long start=clock_bool ? now_ns() : 0, before=start;
+  int N=0;
+
+  if (fp->spin.budget_ns && timeout) {
+    unsigned long long limit=fp->spin.budget_ns;
+    if ((timeout>0) && (limit>timeout*1000000ULL))
+      limit=timeout*1000000ULL;
+
+    fp->stats.spins++;
+    while (1) {
+      fp->stats.poll_calls++;
+      fp->stats.spin_polls++;
+      N=poll(fp->pollfds,fp->poll.count+1,0);
+      if (N)
+        break;
+      before=now_ns();
+      if (before-start>=limit)
+        break;
+    }
+
+    if (N>0)
+      fp->stats.spin_hits++;
+    else if (!N && (timeout>0)) {
+      timeout-=(int)((before-start)/1000000);
+      if (timeout<0)
+        timeout=0;
+    }
+  }
+
+  if (!N) {
+    fp->stats.poll_calls++;
+    N=poll(fp->pollfds,fp->poll.count+1,timeout);
+  }
+
+  if (clock_bool) {
+    int tmp=errno;
+    unsigned long long after=now_ns();
+    fp->blocked_ns=after-start;
+    if (fp->timing_bool)
+      fp->stats.poll_ns+=fp->blocked_ns;
+
+    /* The quickest call is the one least likely to have slept. */
+    if (fp->recalibration.interval && (N>0)
+        && (fp->poll.count>=RECALIBRATION_MIN_FDS)) {
+      float per_fd=(float)(after-before)/(fp->poll.count+1);
+      if (!fp->recalibration.poll_ns || (per_fd<fp->recalibration.poll_ns))
+        fp->recalibration.poll_ns=per_fd;
+    }
+
+    if (fp->spin.max_ns && (N>=0))
+      spun(fp,fp->blocked_ns);
+    errno=tmp;
+  }
+
+  return N;
+}
+
+/* With fds held over, has a look at the urgent set without blocking,
+ *  and queues what's ready there, so as to report it ahead of them.  A
+ *  queue with stale entries in may be too full to take any more; those
+ *  will keep.
+ */
+static void poll_urgent(Flexipoll fp)
+{
+  fp->stats.poll_calls++;
+  fp->stats.urgent_polls++;
+  int N=poll(fp->urgent.pollfds,fp->urgent.count,0);
+  int i;
+
+  for (i=0; (i<fp->urgent.count) && (N>0); i++) {
+    short revents=fp->urgent.pollfds[i].revents;
+    if (!revents)
+      continue;
+    N--;
+
+    FlexipollEntry* entry=fp->urgent.entries[i];
+    if (entry->queued_bool
+        || (fp->ready[entry->priority].count==fp->capacity))
+      continue;
+    entry->revents=revents;
+    enqueue(fp,entry);
+  }
+}
+
+static int poll_fds_untimed(Flexipoll fp,
+                            int* fds_with_events, FlexipollEvent* events,
+                            int max_fds, int timeout, int timers_bool)
+{
+  if (!(fds_with_events || events)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (max_fds<=0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  run_posted(fp);
+
+  /* Fds left over from last time go first, without a syscall; only
+   *  when they're all out do we look for more.
+   */
+  if (fp->ready_count) {
+    if (fp->urgent.count)
+      poll_urgent(fp);
+    int fds_index=deliver(fp,fds_with_events,events,0,max_fds);
+    if (fds_index) {
+      if (timers_bool)
+        fds_index=report_timers(fp,events,fds_index,max_fds);
+      return fds_index;
+    }
+  }
+
+  if (timers_bool) {
+    unsigned long long now=timerwheel_clock();
+    timerwheel_advance(&(fp->timers),now);
+
+    int next=timerwheel_next_timeout(&(fp->timers),now);
+    if ((next>=0) && ((timeout<0) || (next<timeout)))
+      timeout=next;
+  }
+
+  if (fp->uring_bool) {
+    /* Everything the epoll tier has queued since last call goes in
+     *  one system call.  Completions already waiting mean there's
+     *  no call for poll() to block.
+     */
+    if (uring_pending(&(fp->ring))) {
+      if (uring_submit(&(fp->ring))<0) {
+        failed(fp,"io_uring_enter",-1);
+        return -1;
+      }
+    }
+    if (uring_peek_cqe(&(fp->ring)))
+      timeout=0;
+  }
+
+  /* A FLEXIPOLL_EDGE fd that stays ready keeps poll() from blocking
+   *  without being news, so if that's all it found, park those and
+   *  poll() again for what's left of timeout.
+   */
+  unsigned long long start=(timeout>0) ? now_ns() : 0;
+  for (;;) {
+    fp->polls++;
+
+    int N=poll_tiers(fp,timeout);
+    if (N>=0)
+      trace(fp,FLEXIPOLL_TRACE_CALL,N,fp->poll.count,fp->epoll.count);
+    if (N<0) {
+      int tmp=errno;
+      unpark_edges(fp);
+      errno=tmp;
+      failed(fp,"poll",-1);
+      return -1;
+    }
+    if (N==0) {
+      unpark_edges(fp);
+      errno=0;
+      return timers_bool ? report_timers(fp,events,0,max_fds) : 0;
+    }
+
+    fp->calls++;
+
+    /* Take turns at the front of the queue, so that when the caller
+     *  can't take everything, neither tier starves.
+     */
+    int parked=fp->poll.parked;
+    fp->epoll_first_bool=!fp->epoll_first_bool;
+    if (fp->epoll_first_bool) {
+      if (harvest_epoll_tier(fp)<0) {
+        unpark_edges(fp);
+        return -1;
+      }
+      harvest_poll_tier(fp,N-(fp->pollfds[0].revents!=0));
+    } else {
+      harvest_poll_tier(fp,N-(fp->pollfds[0].revents!=0));
+      if (harvest_epoll_tier(fp)<0) {
+        unpark_edges(fp);
+        return -1;
+      }
+    }
+
+    if (!timeout || (fp->poll.parked-parked<N))
+      break;
+    if (timeout>0) {
+      int elapsed=(int)((now_ns()-start)/1000000);
+      if (elapsed>=timeout)
+        break;
+      timeout-=elapsed;
+      start+=elapsed*1000000ULL;
+    }
+  }
+  unpark_edges(fp);
+
+  migrate(fp);
+
+  if (fp->epoll.count && !(fp->calls & (AUDIT_INTERVAL-1)))
+    audit_epoll_tier(fp);
+
+  if (fp->recalibration.interval && !--(fp->recalibration.countdown))
+    recalibrate(fp);
+
+  int fds_index=deliver(fp,fds_with_events,events,0,max_fds);
+
+  if (timers_bool)
+    fds_index=report_timers(fp,events,fds_index,max_fds);
+
+  return fds_index;
+}
+
+/* Index into FlexipollStats.latency for a call that took ns. */
+static int latency_bucket(unsigned long long ns)
+{
+  int res=0;
+  while ((ns>>=1) && (res<FLEXIPOLL_HISTOGRAM_BUCKETS-1))
+    res++;
+  return res;
+}
+
+static int poll_fds(Flexipoll fp,
+                    int* fds_with_events, FlexipollEvent* events,
+                    int max_fds, int timeout, int timers_bool)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  fp->stats.calls++;
+
+  if (!fp->timing_bool) {
+    int res=poll_fds_untimed(fp,fds_with_events,events,max_fds,timeout,
+                             timers_bool);
+    if (res>0)
+      fp->stats.events+=res;
+    return res;
+  }
+
+  unsigned long long start=now_ns();
+  fp->blocked_ns=0;
+
+  int res=poll_fds_untimed(fp,fds_with_events,events,max_fds,timeout,
+                           timers_bool);
+  if (res>0)
+    fp->stats.events+=res;
+
+  {
+    int tmp=errno;
+    unsigned long long busy=now_ns()-start-fp->blocked_ns;
+    fp->stats.latency[latency_bucket(busy)]++;
+    errno=tmp;
+  }
+
+  return res;
+}
+
+int flexipoll_poll(Flexipoll fp, int* fds_with_events, int max_fds)
+{
+  return settled(fp,poll_fds(fp,fds_with_events,0,max_fds,-1,0));
+}
+
+int flexipoll_poll_nowait(Flexipoll fp, int* fds_with_events, int max_fds)
+{
+  return settled(fp,poll_fds(fp,fds_with_events,0,max_fds,0,0));
+}
+
+int flexipoll_poll_events(Flexipoll fp, FlexipollEvent* events,
+                          int max_events, int timeout)
+{
+  return settled(fp,poll_fds(fp,0,events,max_events,timeout,1));
+}
+
+int flexipoll_fd(Flexipoll fp)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fp->embed.fd>=0)
+    return fp->embed.fd;
+
+  int embed_fd=epoll_create1(EPOLL_CLOEXEC);
+  if (embed_fd<0)
+    return -1;
+
+  int timer_fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+  if (timer_fd<0) {
+    int tmp=errno;
+    close(embed_fd);
+    errno=tmp;
+    return -1;
+  }
+
+  /* The epoll tier, whoever keeps it, and wake_fd with it. */
+  struct epoll_event epv;
+  epv.events=EPOLLIN;
+  epv.data.u64=EPOLL_WAKE;
+  if ((epoll_ctl(embed_fd,EPOLL_CTL_ADD,fp->pollfds[0].fd,&epv)<0)
+      || (epoll_ctl(embed_fd,EPOLL_CTL_ADD,timer_fd,&epv)<0)) {
+    int tmp=errno;
+    close(timer_fd);
+    close(embed_fd);
+    errno=tmp;
+    return -1;
+  }
+
+  fp->embed.fd=embed_fd;
+  fp->embed.timer_fd=timer_fd;
+  fp->embed.due=0;
+  fp->embed.edges=0;
+
+  int slot;
+  for (slot=1; slot<=fp->poll.count; slot++)
+    embed_reflect(fp,fp->poll.entries[slot],1);
+  embed_settle(fp);
+
+  return embed_fd;
+}
+
+/* Slab space each drained fd is sure of: read_bytes, and room for a
+ *  sender ahead of it, rounded up so the next sender is aligned.
+ */
+static inline int drain_stride(Flexipoll fp)
+{
+  return (DRAIN_ADDR_BYTES+fp->drain.read_bytes+15) & ~15;
+}
+
+/* Reads what ev says entry has into chunks[0..max_chunks], from
+ *  fp->drain.slab+*used on, leaving reserved bytes at the end for the
+ *  fds after it, and advances *used.  A failed read makes a chunk too.
+ *  Returns the number of chunks.
+ */
+static int drain_entry(Flexipoll fp, FlexipollEntry* entry,
+                       const FlexipollEvent* ev, FlexipollChunk* chunks,
+                       int max_chunks, int* used, int reserved)
+{
+  char* space=fp->drain.slab+*used;
+  int stride=drain_stride(fp);
+  int N, full_bool, i;
+
+  if (entry->drain_kind==DRAIN_UNKNOWN)
+    entry->drain_kind=drain_kind(entry->fd);
+
+  fp->stats.drain_reads++;
+  if (entry->drain_kind==DRAIN_DATAGRAM) {
+    int fit=(fp->drain.slab_bytes-*used-reserved)/stride;
+    if (max_chunks>fit)
+      max_chunks=fit;
+    if (max_chunks>DRAIN_MAX_MESSAGES)
+      max_chunks=DRAIN_MAX_MESSAGES;
+
+    N=drain_datagrams(entry->fd,space,stride,fp->drain.read_bytes,
+                      chunks,max_chunks);
+    if (N>0)
+      *used+=N*stride;
+    full_bool=(N==max_chunks);
+  } else {
+    N=drain_stream(entry->fd,entry->drain_kind,space,fp->drain.read_bytes,
+                   chunks);
+    if (N>0)
+      *used+=(chunks[0].len+15) & ~15;
+    full_bool=(N>0) && (chunks[0].len==fp->drain.read_bytes);
+  }
+
+  if (N<0) {
+    chunks[0].buf=0;
+    chunks[0].len=0;
+    chunks[0].error=errno;
+    chunks[0].from=0;
+    chunks[0].fromlen=0;
+    N=1;
+  }
+
+  for (i=0; i<N; i++) {
+    chunks[i].fd=ev->fd;
+    chunks[i].revents=ev->revents;
+    chunks[i].data=ev->data;
+  }
+
+  /* There may be more.  Don't count on another edge to say so. */
+  if (full_bool && entry->armed_bool && !entry->queued_bool)
+    enqueue(fp,entry);
+
+  return N;
+}
+
+int flexipoll_poll_drain(Flexipoll fp, FlexipollChunk* chunks,
+                         int max_chunks, int timeout)
+{
+  if (!(fp && chunks)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (max_chunks<=0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  int stride=drain_stride(fp), max_fds=fp->drain.slab_bytes/stride;
+
+  if (!fp->drain.slab) {
+    char* slab=(char*)(malloc(fp->drain.slab_bytes));
+    FlexipollEvent* events=
+      (FlexipollEvent*)(malloc(sizeof(FlexipollEvent)*max_fds));
+    if (!(slab && events)) {
+      if (slab)
+        free(slab);
+      if (events)
+        free(events);
+      errno=ENOMEM;
+      return -1;
+    }
+    fp->drain.slab=slab;
+    fp->drain.events=events;
+  }
+
+  if (max_fds>max_chunks)
+    max_fds=max_chunks;
+
+  int N=poll_fds(fp,0,fp->drain.events,max_fds,timeout,1);
+  if (N<=0)
+    return settled(fp,N);
+
+  /* Every fd still to come is sure of a chunk, and a stride of slab. */
+  int used=0, num=0, i;
+  for (i=0; i<N; i++) {
+    const FlexipollEvent* ev=fp->drain.events+i;
+    int later=N-i-1;
+    FlexipollEntry* entry=(ev->fd>=0) ? lookup_entry(fp,ev->fd) : 0;
+
+    if (entry && (entry->fd>=0) && (entry->flags & FLEXIPOLL_DRAIN)
+        && (ev->revents & (POLLIN|POLLHUP|POLLERR))) {
+      num+=drain_entry(fp,entry,ev,chunks+num,max_chunks-num-later,
+                       &used,later*stride);
+    } else {
+      chunks[num].fd=ev->fd;
+      chunks[num].revents=ev->revents;
+      chunks[num].data=ev->data;
+      chunks[num].buf=0;
+      chunks[num].len=0;
+      chunks[num].error=0;
+      chunks[num].from=0;
+      chunks[num].fromlen=0;
+      num++;
+    }
+  }
+
+  return settled(fp,num);
+}
+
+int flexipoll_set_drain(Flexipoll fp, int slab_bytes, int read_bytes)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if ((read_bytes<=0) || (slab_bytes<read_bytes)
+      || (slab_bytes-read_bytes<DRAIN_ADDR_BYTES+15)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  /* Reallocated at the next flexipoll_poll_drain(). */
+  if (fp->drain.slab)
+    free(fp->drain.slab);
+  if (fp->drain.events)
+    free(fp->drain.events);
+  fp->drain.slab=0;
+  fp->drain.events=0;
+
+  fp->drain.slab_bytes=slab_bytes;
+  fp->drain.read_bytes=read_bytes;
+  return 0;
+}
+
+int flexipoll_events(Flexipoll fp, int fd)
+{
+  if (!fp) {
+    errno=EFAULT;
     return -1;
   }
 
-  if ((fd<0) || (fd>=fp->num_fds)) {
+  if (fd<0) {
     errno=EBADF;
     return -1;
   }
 
-  FlexipollEntry* entry=fp->fd_to_entry+fd;
-  if (entry->fd<0) {
+  /* A retired fd's POLLNVAL outlives it. */
+  FlexipollEntry* entry=lookup_entry(fp,fd);
+  if (!entry || ((entry->fd<0) && !(entry->revents & POLLNVAL))) {
     errno=EINVAL;
     return -1;
   }
 
   return entry->revents;
 }
+
+FlexipollTimer flexipoll_timer_new(Flexipoll fp, void* data)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return 0;
+  }
+
+  FlexipollTimer timer=(FlexipollTimer)(malloc(sizeof(struct FlexipollTimer_)));
+  if (!timer)
+    return 0;
+
+  timer->node.next=timer->node.prev=0;
+  timer->fp=fp;
+  timer->data=data;
+  return timer;
+}
+
+void flexipoll_timer_delete(FlexipollTimer timer)
+{
+  if (!timer)
+    return;
+
+  timerwheel_remove(&(timer->fp->timers),&(timer->node));
+  free(timer);
+}
+
+int flexipoll_timer_arm(FlexipollTimer timer, int timeout)
+{
+  if (!timer) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (timeout<0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  /* A tick's worth later: the clock reads the tick's start, and we may
+   *  be most of the way through it already.
+   */
+  timerwheel_add(&(timer->fp->timers),&(timer->node),
+                 timerwheel_clock()+timeout+1);
+  return settled(timer->fp,0);
+}
+
+int flexipoll_timer_cancel(FlexipollTimer timer)
+{
+  if (!timer) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  timerwheel_remove(&(timer->fp->timers),&(timer->node));
+  return 0;
+}
+
+int flexipoll_timer_armed(FlexipollTimer timer)
+{
+  if (!timer) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  return timerwheel_node_linked(&(timer->node));
+}
+
+int flexipoll_set_thresholds(Flexipoll fp, float below, float above)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (!((0<=below) && (below<=above) && (above<=1))) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  fp->threshold_below=to_activity(below);
+  fp->threshold_above=to_activity(above);
+  sweep_by(fp,fp->calls+1); /* the next was timed for the old ones */
+  return 0;
+}
+
+int flexipoll_set_half_life(Flexipoll fp, int calls)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (calls<=0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  /* decay=2^(-1/calls), found by bisection on decay**calls=1/2 so as
+   *  not to drag in libm.
+   */
+  {
+    double lo=0, hi=1;
+    int i;
+    for (i=0; i<48; i++) {
+      double mid=(lo+hi)/2, power=1, factor=mid;
+      unsigned n=calls;
+      while (n) {
+        if (n & 1)
+          power*=factor;
+        factor*=factor;
+        n>>=1;
+      }
+      if (power>0.5)
+        hi=mid;
+      else
+        lo=mid;
+    }
+    fp->decay=to_activity((float)((lo+hi)/2));
+    if (fp->decay>=ACTIVITY_ONE) /* too slow to tell from no decay */
+      fp->decay=ACTIVITY_ONE-1;
+  }
+
+  {
+    int i;
+    fp->decay_pow[0]=fp->decay;
+    for (i=1; i<DECAY_POWERS; i++)
+      fp->decay_pow[i]=scale_activity(fp->decay_pow[i-1],fp->decay_pow[i-1]);
+  }
+
+  fp->half_life=calls;
+  sweep_by(fp,fp->calls+1);
+  return 0;
+}
+
+int flexipoll_set_migration_budget(Flexipoll fp, int max_per_call)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (max_per_call<0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  fp->migration_budget=max_per_call;
+  return 0;
+}
+
+int flexipoll_set_busy_poll(Flexipoll fp, int max_spin_us)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (max_spin_us<0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  /* Start off spinning, half the limit being a fair guess. */
+  fp->spin.max_ns=((unsigned long long)(max_spin_us))*1000;
+  fp->spin.wait_ns=fp->spin.max_ns/2;
+  fp->spin.budget_ns=fp->spin.max_ns;
+  return 0;
+}
+
+int flexipoll_apply_costs(Flexipoll fp, const FlexipollCosts* costs)
+{
+  if (!(fp && costs)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (!((costs->poll_ns>0) && (costs->epoll_event_ns>0)
+        && (costs->epoll_ctl_ns>0))) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  /* An fd with activity a costs poll_ns a call in the poll tier, and
+   *  a*epoll_event_ns in the epoll tier.
+   */
+  float breakeven=costs->poll_ns/costs->epoll_event_ns;
+  if (breakeven<MIN_BREAKEVEN)
+    breakeven=MIN_BREAKEVEN;
+  if (breakeven>MAX_BREAKEVEN)
+    breakeven=MAX_BREAKEVEN;
+
+  /* An fd a gap past break-even wastes gap*epoll_event_ns a call,
+   *  which over a half-life should pay for a round trip.
+   */
+  float gap=2*costs->epoll_ctl_ns/(costs->epoll_event_ns*fp->half_life);
+  if (gap<MIN_GAP)
+    gap=MIN_GAP;
+  if (gap>MAX_GAP)
+    gap=MAX_GAP;
+
+  /* No more than half way to 0 or 1: either threshold at the end
+   *  would leave fds stuck in one tier.
+   */
+  if (gap>breakeven/2)
+    gap=breakeven/2;
+  if (gap>(1-breakeven)/2)
+    gap=(1-breakeven)/2;
+
+  float below=breakeven-gap, above=breakeven+gap;
+  fp->threshold_below=to_activity(below);
+  fp->threshold_above=to_activity(above);
+  sweep_by(fp,fp->calls+1);
+
+  float budget=MIGRATION_NS_PER_CALL/costs->epoll_ctl_ns;
+  if (budget<MIN_MIGRATION_BUDGET)
+    budget=MIN_MIGRATION_BUDGET;
+  if (budget>MAX_MIGRATION_BUDGET)
+    budget=MAX_MIGRATION_BUDGET;
+  fp->migration_budget=(int)(budget);
+
+  fp->costs=*costs;
+  return 0;
+}
+
+int flexipoll_get_costs(Flexipoll fp, FlexipollCosts* costs)
+{
+  if (!(fp && costs)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  *costs=fp->costs;
+  return 0;
+}
+
+int flexipoll_set_recalibration(Flexipoll fp, int calls)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (calls<0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  memset(&(fp->recalibration),0,sizeof(fp->recalibration));
+  fp->recalibration.interval=fp->recalibration.countdown=calls;
+  return 0;
+}
+
+int flexipoll_use_io_uring(Flexipoll fp)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fp->uring_bool)
+    return 0;
+
+  if (fp->all.count) {
+    errno=EBUSY;
+    return -1;
+  }
+
+  if (uring_init(&(fp->ring),URING_ENTRIES)<0)
+    return -1;
+
+  /* The ring takes the epoll set's place in fp->embed.fd, which the
+   *  set leaves as it's closed.  Anything that can fail comes first, so
+   *  that fp carries on with epoll if it does.
+   */
+  int res=uring_poll_wake_fd(fp);
+  if ((res>=0) && (fp->embed.fd>=0)) {
+    struct epoll_event epv;
+    epv.events=EPOLLIN;
+    epv.data.u64=EPOLL_WAKE;
+    res=epoll_ctl(fp->embed.fd,EPOLL_CTL_ADD,fp->ring.fd,&epv);
+  }
+  if (res<0) {
+    int tmp=errno;
+    uring_destroy(&(fp->ring));
+    errno=tmp;
+    return -1;
+  }
+
+  /* wake_fd goes with it. */
+  close(fp->epoll_fd);
+  fp->epoll_fd=-1;
+
+  fp->uring_bool=1;
+  fp->pollfds[0].fd=fp->ring.fd;
+  return 0;
+}
+
+int flexipoll_get_stats(Flexipoll fp, FlexipollStats* stats)
+{
+  if (!(fp && stats)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  *stats=fp->stats;
+  stats->poll_tier_fds=fp->poll.count;
+  stats->epoll_tier_fds=fp->epoll.count;
+  stats->migrations_pending=fp->num_dirty;
+  stats->spin_budget_ns=fp->spin.budget_ns;
+  if (fp->uring_bool)
+    stats->io_uring_enter_calls=fp->ring.enter_calls;
+  return 0;
+}
+
+int flexipoll_reset_stats(Flexipoll fp)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  memset(&(fp->stats),0,sizeof(fp->stats));
+  if (fp->uring_bool)
+    fp->ring.enter_calls=0;
+  return 0;
+}
+
+int flexipoll_set_timing(Flexipoll fp, int on_bool)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  fp->timing_bool=(on_bool!=0);
+  return 0;
+}
+
+int flexipoll_fd_stats(Flexipoll fp, int fd, FlexipollFdStats* stats)
+{
+  if (!(fp && stats)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  FlexipollEntry* entry=lookup_entry(fp,fd);
+  if (!entry || (entry->fd<0)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  stats->activity=(float)(current_activity(fp,entry))/ACTIVITY_ONE;
+  stats->in_epoll_bool=entry->in_epoll_bool;
+  stats->migrations=entry->migrations;
+  return 0;
+}
+
+int flexipoll_set_error_handler(Flexipoll fp,
+                                FlexipollErrorHandler handler, void* ctx)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  fp->error_handler=handler;
+  fp->error_ctx=ctx;
+  return 0;
+}
+
+int flexipoll_set_trace(Flexipoll fp, int records)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (records<0) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  FlexipollTraceRecord* ring=0;
+  unsigned length=1;
+  if (records) {
+    while (length<(unsigned)(records))
+      length*=2;
+    ring=(FlexipollTraceRecord*)(malloc(sizeof(FlexipollTraceRecord)
+                                        *length));
+    if (!ring)
+      return -1;
+  }
+
+  if (fp->trace.ring)
+    free(fp->trace.ring);
+  fp->trace.ring=ring;
+  fp->trace.mask=length-1;
+  fp->trace.next=fp->trace.unwritten=0;
+  return 0;
+}
+
+/* write()s all of buf, however many calls that takes. */
+static int write_all(int fd, const void* buf, size_t len)
+{
+  const char* p=(const char*)(buf);
+  while (len) {
+    ssize_t N=write(fd,p,len);
+    if (N<0) {
+      if (errno==EINTR)
+        continue;
+      return -1;
+    }
+    p+=N;
+    len-=N;
+  }
+  return 0;
+}
+
+int flexipoll_write_trace(Flexipoll fp, int fd)
+{
+  if (!fp) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  if (!fp->trace.ring) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  unsigned long long length=fp->trace.mask+1ULL;
+  unsigned long long first=fp->trace.unwritten, next=fp->trace.next;
+  if (next-first>length)
+    first=next-length;
+
+  FlexipollTraceHeader header;
+  memset(&header,0,sizeof(header));
+  header.magic=FLEXIPOLL_TRACE_MAGIC;
+  header.version=FLEXIPOLL_TRACE_VERSION;
+  header.record_bytes=sizeof(FlexipollTraceRecord);
+  header.half_life=fp->half_life;
+  header.threshold_below=(float)(fp->threshold_below)/ACTIVITY_ONE;
+  header.threshold_above=(float)(fp->threshold_above)/ACTIVITY_ONE;
+  header.costs=fp->costs;
+  header.migration_budget=fp->migration_budget;
+  header.records=next-first;
+  header.dropped=first-fp->trace.unwritten;
+  fp->trace.unwritten=next;
+  if (write_all(fd,&header,sizeof(header))<0)
+    return -1;
+
+  /* The ring may wrap around once. */
+  unsigned start=(unsigned)(first & fp->trace.mask);
+  unsigned long long tail=length-start;
+  if (tail>header.records)
+    tail=header.records;
+  if (write_all(fd,fp->trace.ring+start,
+                sizeof(FlexipollTraceRecord)*tail)<0)
+    return -1;
+  return write_all(fd,fp->trace.ring,
+                   sizeof(FlexipollTraceRecord)*(header.records-tail));
+}
@@ -0,0 +1,50 @@
+#include "mpscq.h"
+
+void mpscq_init(MpscQueue* q)
+{
+  atomic_init(&(q->stub.next),0);
+  atomic_init(&(q->head),&(q->stub));
+  q->tail=&(q->stub);
+}
+
+void mpscq_push(MpscQueue* q, MpscNode* node)
+{
+  atomic_store_explicit(&(node->next),0,memory_order_relaxed);
+  MpscNode* prev=atomic_exchange_explicit(&(q->head),node,
+                                          memory_order_acq_rel);
+  atomic_store_explicit(&(prev->next),node,memory_order_release);
+}
+
+MpscNode* mpscq_pop(MpscQueue* q)
+{
+  MpscNode* tail=q->tail;
+  MpscNode* next=atomic_load_explicit(&(tail->next),memory_order_acquire);
+
+  if (tail==&(q->stub)) {
+    if (!next)
+      return 0;
+    q->tail=next;
+    tail=next;
+    next=atomic_load_explicit(&(next->next),memory_order_acquire);
+  }
+
+  if (next) {
+    q->tail=next;
+    return tail;
+  }
+
+  /* tail is the last node we can see.  Unless a push is half done,
+   *  it's the last node, full stop; put the stub behind it so it can
+   *  be handed out.
+   */
+  if (tail!=atomic_load_explicit(&(q->head),memory_order_acquire))
+    return 0;
+
+  mpscq_push(q,&(q->stub));
+  next=atomic_load_explicit(&(tail->next),memory_order_acquire);
+  if (next) {
+    q->tail=next;
+    return tail;
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _MPSCQ_H_
+#define _MPSCQ_H_
+
+/* Intrusive multi-producer, single-consumer queue, after Dmitry
+ *  Vyukov's: pushing is one atomic exchange and never blocks; popping
+ *  is done by one thread only.  A pop racing with a push may briefly
+ *  see the queue as empty; the pusher is expected to wake the consumer
+ *  afterwards.
+ */
+
+#include <stdatomic.h>
+
+typedef struct MpscNode {
+  struct MpscNode* _Atomic next;
+} MpscNode;
+
+typedef struct MpscQueue {
+  MpscNode* _Atomic head; /* producers push here */
+  MpscNode* tail; /* the consumer pops here */
+  MpscNode stub;
+} MpscQueue;
+
+void mpscq_init(MpscQueue* q);
+
+/* Any thread. */
+void mpscq_push(MpscQueue* q, MpscNode* node);
+
+/* Consumer only.  Returns 0 if the queue is empty (or looks it). */
+MpscNode* mpscq_pop(MpscQueue* q);
+
+#endif /*_MPSCQ_H_*/
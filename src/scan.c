@@ -0,0 +1,88 @@
+#include "scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#include <stdatomic.h>
+#define SCAN_X86 1
+#endif
+
+/* Scalar, for the tail end and for other CPUs. */
+static int scan_from(const struct pollfd* pollfds, int i, int count,
+                     int found, int wanted, int* ready)
+{
+  for (; (i<count) && (found<wanted); i++)
+    if (pollfds[i].revents)
+      ready[found++]=i;
+  return found;
+}
+
+#ifdef SCAN_X86
+
+/* Four pollfds are two 16-byte vectors; revents is the top 16 bits of
+ *  each 8-byte pollfd.
+ */
+static int scan_sse2(const struct pollfd* pollfds, int count, int wanted,
+                     int* ready)
+{
+  const __m128i mask=_mm_set1_epi64x((long long)(0xffffULL<<48));
+  int found=0, i=0;
+
+  while ((i+4<=count) && (found<wanted)) {
+    __m128i a=_mm_and_si128(_mm_loadu_si128((const __m128i*)(pollfds+i)),
+                            mask);
+    __m128i b=_mm_and_si128(_mm_loadu_si128((const __m128i*)(pollfds+i+2)),
+                            mask);
+    __m128i zero=_mm_cmpeq_epi32(_mm_or_si128(a,b),_mm_setzero_si128());
+    if (_mm_movemask_epi8(zero)!=0xffff)
+      found=scan_from(pollfds,i,i+4,found,wanted,ready);
+    i+=4;
+  }
+  return scan_from(pollfds,i,count,found,wanted,ready);
+}
+
+/* Eight pollfds are two 32-byte vectors. */
+__attribute__((target("avx2")))
+static int scan_avx2(const struct pollfd* pollfds, int count, int wanted,
+                     int* ready)
+{
+  const __m256i mask=_mm256_set1_epi64x((long long)(0xffffULL<<48));
+  int found=0, i=0;
+
+  while ((i+8<=count) && (found<wanted)) {
+    __m256i a=_mm256_loadu_si256((const __m256i*)(pollfds+i));
+    __m256i b=_mm256_loadu_si256((const __m256i*)(pollfds+i+4));
+    if (!_mm256_testz_si256(_mm256_or_si256(a,b),mask))
+      found=scan_from(pollfds,i,i+8,found,wanted,ready);
+    i+=8;
+  }
+  return scan_from(pollfds,i,count,found,wanted,ready);
+}
+
+typedef int (*ScanFn)(const struct pollfd*, int, int, int*);
+
+/* Picked on first use.  Flexipolls on other threads may race to pick
+ *  it, but they pick the same, so relaxed atomics will do.
+ */
+static _Atomic(ScanFn) scan_fn;
+
+int scan_ready(const struct pollfd* pollfds, int count, int wanted,
+               int* ready)
+{
+  ScanFn fn=atomic_load_explicit(&scan_fn,memory_order_relaxed);
+  if (!fn) {
+    __builtin_cpu_init();
+    fn=__builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+    atomic_store_explicit(&scan_fn,fn,memory_order_relaxed);
+  }
+  return fn(pollfds,count,wanted,ready);
+}
+
+#else
+
+int scan_ready(const struct pollfd* pollfds, int count, int wanted,
+               int* ready)
+{
+  return scan_from(pollfds,0,count,0,wanted,ready);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+/* Finding the ready entries of a pollfd array after poll(), without
+ *  looking at every one: whole vectors of revents are tested at once,
+ *  with AVX2 where the CPU has it, SSE2 where it doesn't, and plain C
+ *  elsewhere.
+ */
+
+#include <poll.h>
+
+/* Stores in ready[] the indices of the first wanted entries of
+ *  pollfds[0..count] with revents set, in order, and stops there.
+ *  Returns how many it found: fewer than wanted only if poll() said
+ *  more were ready than are.
+ */
+int scan_ready(const struct pollfd* pollfds, int count, int wanted,
+               int* ready);
+
+#endif /*_SCAN_H_*/
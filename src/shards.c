@@ -0,0 +1,872 @@
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+
+#include <flexipoll_shards.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+/* Events pulled out of a Flexipoll per call. */
+#define BATCH 64
+
+/* Every REBALANCE_INTERVAL ms, if the busiest shard handled more than
+ *  REBALANCE_RATIO times as many events as the quietest (and at least
+ *  REBALANCE_MIN), its hottest fd that would narrow the gap moves to
+ *  the quietest.
+ */
+#define REBALANCE_INTERVAL 100
+#define REBALANCE_RATIO 2
+#define REBALANCE_MIN 64
+
+/* One registered fd.  Owned by the registry while registered, and by
+ *  each queued event or command that points at it.
+ */
+typedef struct ShardFd {
+  int fd;
+  short events;
+  void* data;
+
+  atomic_int shard; /* owner; changes only on the owner's thread */
+  atomic_int removed_bool;
+  atomic_int move_to; /* -1, or the shard it should move to once idle */
+  atomic_uint hits; /* events handled this rebalance interval */
+  atomic_int refs;
+
+  /* The rest are only touched on the owner's thread. */
+  int registered_bool; /* in the owner's Flexipoll */
+  int inflight_bool; /* reported, not yet rearmed */
+} ShardFd;
+
+typedef enum {
+  CMD_ADD, /* register with the shard's Flexipoll */
+  CMD_REMOVE, /* unregister */
+  CMD_REARM, /* the handler is done with it */
+  CMD_MOVE /* hand it to shard move_to */
+} CommandType;
+
+typedef struct Command {
+  CommandType type;
+  ShardFd* rec;
+} Command;
+
+typedef struct ReadyItem {
+  ShardFd* rec;
+  short revents;
+} ReadyItem;
+
+typedef struct Shard {
+  FlexipollShards shards;
+  int index;
+  pthread_t thread;
+  Flexipoll fp;
+
+  atomic_int idle_bool; /* blocked, or about to block, in poll */
+
+  pthread_mutex_t lock; /* for cmds and ready */
+  Command* cmds;
+  int num_cmds, max_cmds;
+
+  /* Ring of events pulled from fp but not handled yet.  The owner
+   *  takes from the head; thieves take from the tail.
+   */
+  ReadyItem* ready;
+  int ready_head, ready_count, ready_max;
+
+  atomic_int num_fds; /* records with shard==index, not yet removed
+                      *  here
+                      */
+  atomic_uint load; /* events handled this rebalance interval */
+} Shard;
+
+struct FlexipollShards_ {
+  int num_shards;
+  Shard* shards;
+  unsigned flags;
+
+  FlexipollHandler handler;
+  void* handler_ctx;
+  FlexipollShardPolicy policy;
+  void* policy_ctx;
+
+  pthread_mutex_t registry_lock;
+  ShardFd** registry; /* indexed by fd */
+  int registry_size;
+
+  atomic_int stopping_bool;
+  int started_bool;
+  atomic_ullong next_rebalance; /* ms, on CLOCK_MONOTONIC */
+};
+
+static unsigned long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000+ts.tv_nsec/1000000;
+}
+
+static void rec_ref(ShardFd* rec)
+{
+  atomic_fetch_add(&(rec->refs),1);
+}
+
+static void rec_unref(ShardFd* rec)
+{
+  if (atomic_fetch_sub(&(rec->refs),1)==1)
+    free(rec);
+}
+
+static void wake(Shard* shard)
+{
+  flexipoll_wakeup(shard->fp);
+}
+
+/* Queues a command for shard's worker, taking a reference to rec for
+ *  it.  Returns <0 on error.
+ */
+static int post(Shard* shard, CommandType type, ShardFd* rec)
+{
+  pthread_mutex_lock(&(shard->lock));
+
+  if (shard->num_cmds==shard->max_cmds) {
+    int max_cmds=shard->max_cmds ? shard->max_cmds*2 : 16;
+    Command* cmds=(Command*)(realloc(shard->cmds,sizeof(Command)*max_cmds));
+    if (!cmds) {
+      int tmp=errno;
+      pthread_mutex_unlock(&(shard->lock));
+      errno=tmp;
+      return -1;
+    }
+    shard->cmds=cmds;
+    shard->max_cmds=max_cmds;
+  }
+
+  rec_ref(rec);
+  shard->cmds[shard->num_cmds].type=type;
+  shard->cmds[shard->num_cmds].rec=rec;
+  shard->num_cmds++;
+
+  pthread_mutex_unlock(&(shard->lock));
+
+  wake(shard);
+  return 0;
+}
+
+/* Appends to shard's ready ring.  Caller holds shard->lock. */
+static int push_ready(Shard* shard, ShardFd* rec, short revents)
+{
+  if (shard->ready_count==shard->ready_max) {
+    int ready_max=shard->ready_max ? shard->ready_max*2 : BATCH;
+    ReadyItem* ready=(ReadyItem*)(malloc(sizeof(ReadyItem)*ready_max));
+    if (!ready)
+      return -1;
+
+    int i;
+    for (i=0; i<shard->ready_count; i++)
+      ready[i]=shard->ready[(shard->ready_head+i)%shard->ready_max];
+    free(shard->ready);
+    shard->ready=ready;
+    shard->ready_head=0;
+    shard->ready_max=ready_max;
+  }
+
+  ReadyItem* item=
+    shard->ready+((shard->ready_head+shard->ready_count)%shard->ready_max);
+  item->rec=rec;
+  item->revents=revents;
+  shard->ready_count++;
+  return 0;
+}
+
+/* Takes the next event off the head of shard's ready ring.  Returns
+ *  0 if it's empty.
+ */
+static int pop_ready(Shard* shard, ReadyItem* item)
+{
+  int res=0;
+
+  pthread_mutex_lock(&(shard->lock));
+  if (shard->ready_count) {
+    *item=shard->ready[shard->ready_head];
+    shard->ready_head=(shard->ready_head+1)%shard->ready_max;
+    shard->ready_count--;
+    res=1;
+  }
+  pthread_mutex_unlock(&(shard->lock));
+
+  return res;
+}
+
+/* Moves half (rounding up) of victim's queued events onto thief's
+ *  queue, from the tail.  Returns how many.
+ */
+static int steal(Shard* thief, Shard* victim)
+{
+  ReadyItem items[BATCH];
+  int n=0;
+
+  pthread_mutex_lock(&(victim->lock));
+  n=(victim->ready_count+1)/2;
+  if (n>BATCH)
+    n=BATCH;
+  {
+    int i;
+    for (i=0; i<n; i++) {
+      victim->ready_count--;
+      items[i]=victim->ready[(victim->ready_head+victim->ready_count)
+                            %victim->ready_max];
+    }
+  }
+  pthread_mutex_unlock(&(victim->lock));
+
+  if (!n)
+    return 0;
+
+  pthread_mutex_lock(&(thief->lock));
+  {
+    int i;
+    for (i=0; i<n; i++) {
+      if (push_ready(thief,items[i].rec,items[i].revents)<0) {
+        /* Give back what we couldn't take. */
+        pthread_mutex_unlock(&(thief->lock));
+        pthread_mutex_lock(&(victim->lock));
+        for (; i<n; i++)
+          push_ready(victim,items[i].rec,items[i].revents);
+        pthread_mutex_unlock(&(victim->lock));
+        return n;
+      }
+    }
+  }
+  pthread_mutex_unlock(&(thief->lock));
+
+  return n;
+}
+
+static int try_steal(Shard* thief)
+{
+  FlexipollShards shards=thief->shards;
+  int i;
+
+  if (shards->flags & FLEXIPOLL_SHARDS_NO_STEAL)
+    return 0;
+
+  for (i=1; i<shards->num_shards; i++) {
+    Shard* victim=shards->shards+((thief->index+i)%shards->num_shards);
+    if (steal(thief,victim))
+      return 1;
+  }
+  return 0;
+}
+
+/* Owner's side of moving rec to shard move_to; rec is idle. */
+static void do_move(Shard* shard, ShardFd* rec)
+{
+  int target=atomic_exchange(&(rec->move_to),-1);
+  if ((target<0) || (target==shard->index))
+    return;
+
+  flexipoll_remove_fd(shard->fp,rec->fd);
+  rec->registered_bool=0;
+  atomic_fetch_sub(&(shard->num_fds),1);
+
+  Shard* to=shard->shards->shards+target;
+  atomic_store(&(rec->shard),target);
+  atomic_fetch_add(&(to->num_fds),1);
+  post(to,CMD_ADD,rec);
+}
+
+/* Owner's side of the handler finishing with rec. */
+static void finish(Shard* shard, ShardFd* rec)
+{
+  rec->inflight_bool=0;
+
+  if (atomic_load(&(rec->removed_bool)))
+    return;
+
+  if (atomic_load(&(rec->move_to))>=0) {
+    do_move(shard,rec);
+    return;
+  }
+
+  flexipoll_rearm(shard->fp,rec->fd);
+}
+
+static void run_commands(Shard* shard)
+{
+  Command* cmds;
+  int num_cmds;
+
+  pthread_mutex_lock(&(shard->lock));
+  cmds=shard->cmds;
+  num_cmds=shard->num_cmds;
+  shard->cmds=0;
+  shard->num_cmds=shard->max_cmds=0;
+  pthread_mutex_unlock(&(shard->lock));
+
+  int i;
+  for (i=0; i<num_cmds; i++) {
+    ShardFd* rec=cmds[i].rec;
+
+    switch (cmds[i].type) {
+    case CMD_ADD:
+      if (atomic_load(&(rec->removed_bool))
+          || (flexipoll_add_fd_ex(shard->fp,rec->fd,rec->events,
+                                  FLEXIPOLL_ONESHOT,rec)<0)) {
+        atomic_store(&(rec->removed_bool),1);
+        atomic_fetch_sub(&(shard->num_fds),1);
+      } else {
+        rec->registered_bool=1;
+        rec->inflight_bool=0;
+      }
+      break;
+
+    case CMD_REMOVE:
+      if (atomic_load(&(rec->shard))!=shard->index) {
+        /* It moved on since the command was posted; chase it.  Its
+         *  pending CMD_ADD there will see it's been removed, if it
+         *  hasn't run yet.
+         */
+        post(shard->shards->shards+atomic_load(&(rec->shard)),
+             CMD_REMOVE,rec);
+      } else if (rec->registered_bool) {
+        flexipoll_remove_fd(shard->fp,rec->fd);
+        rec->registered_bool=0;
+        atomic_fetch_sub(&(shard->num_fds),1);
+      }
+      break;
+
+    case CMD_REARM:
+      if (atomic_load(&(rec->shard))==shard->index)
+        finish(shard,rec);
+      break;
+
+    case CMD_MOVE:
+      if ((atomic_load(&(rec->shard))==shard->index)
+          && !rec->inflight_bool && !atomic_load(&(rec->removed_bool)))
+        do_move(shard,rec);
+      break;
+    }
+
+    rec_unref(rec);
+  }
+
+  free(cmds);
+}
+
+/* Calls the handler for item, then hands the fd back to its owner. */
+static void handle(Shard* shard, ReadyItem* item)
+{
+  FlexipollShards shards=shard->shards;
+  ShardFd* rec=item->rec;
+
+  if (!atomic_load(&(rec->removed_bool))) {
+    FlexipollEvent ev;
+    ev.fd=rec->fd;
+    ev.revents=item->revents;
+    ev.data=rec->data;
+    shards->handler(&ev,shards->handler_ctx);
+
+    atomic_fetch_add(&(rec->hits),1);
+    atomic_fetch_add(&(shard->load),1);
+  }
+
+  int owner=atomic_load(&(rec->shard));
+  if (owner==shard->index)
+    finish(shard,rec);
+  else
+    post(shards->shards+owner,CMD_REARM,rec);
+
+  rec_unref(rec);
+}
+
+/* Moves one hot fd off the busiest shard, if the load is lopsided
+ *  enough.  Any worker may call this; the first one past the interval
+ *  gets to do it.
+ */
+static void maybe_rebalance(FlexipollShards shards)
+{
+  unsigned long long now=now_ms();
+  unsigned long long due=atomic_load(&(shards->next_rebalance));
+  if ((now<due)
+      || !atomic_compare_exchange_strong(&(shards->next_rebalance),&due,
+                                         now+REBALANCE_INTERVAL))
+    return;
+
+  int busiest=0, quietest=0;
+  unsigned busiest_load=0, quietest_load=~0U;
+  int i;
+  for (i=0; i<shards->num_shards; i++) {
+    unsigned load=atomic_exchange(&(shards->shards[i].load),0);
+    if (load>=busiest_load) {
+      busiest=i;
+      busiest_load=load;
+    }
+    if (load<quietest_load) {
+      quietest=i;
+      quietest_load=load;
+    }
+  }
+
+  int lopsided_bool=(busiest!=quietest)
+    && (busiest_load>=REBALANCE_MIN)
+    && (busiest_load>REBALANCE_RATIO*quietest_load);
+  unsigned gap=busiest_load-quietest_load;
+
+  ShardFd* best=0;
+  unsigned best_hits=0;
+
+  pthread_mutex_lock(&(shards->registry_lock));
+  for (i=0; i<shards->registry_size; i++) {
+    ShardFd* rec=shards->registry[i];
+    if (!rec)
+      continue;
+
+    unsigned hits=atomic_exchange(&(rec->hits),0);
+    if (lopsided_bool && (atomic_load(&(rec->shard))==busiest)
+        && (hits<gap) && (hits>best_hits)) {
+      best=rec;
+      best_hits=hits;
+    }
+  }
+  if (best) {
+    atomic_store(&(best->move_to),quietest);
+    post(shards->shards+busiest,CMD_MOVE,best);
+  }
+  pthread_mutex_unlock(&(shards->registry_lock));
+}
+
+static void* worker(void* arg)
+{
+  Shard* shard=(Shard*)arg;
+  FlexipollShards shards=shard->shards;
+  FlexipollEvent evs[BATCH];
+
+  while (!atomic_load(&(shards->stopping_bool))) {
+    run_commands(shard);
+
+    pthread_mutex_lock(&(shard->lock));
+    int backlog=shard->ready_count;
+    pthread_mutex_unlock(&(shard->lock));
+
+    int timeout=0;
+    if (!backlog && !try_steal(shard)) {
+      atomic_store(&(shard->idle_bool),1);
+      timeout=(shards->flags & FLEXIPOLL_SHARDS_NO_REBALANCE) ?
+        -1 : REBALANCE_INTERVAL;
+    }
+
+    int N=flexipoll_poll_events(shard->fp,evs,BATCH,timeout);
+    atomic_store(&(shard->idle_bool),0);
+
+    if (N>0) {
+      int i;
+      pthread_mutex_lock(&(shard->lock));
+      for (i=0; i<N; i++) {
+        ShardFd* rec=(ShardFd*)(evs[i].data);
+        rec->inflight_bool=1;
+        rec_ref(rec);
+        if (push_ready(shard,rec,evs[i].revents)<0) {
+          /* No room to queue it; treat it as handled, so it gets
+           *  rearmed and reported again.
+           */
+          pthread_mutex_unlock(&(shard->lock));
+          finish(shard,rec);
+          rec_unref(rec);
+          pthread_mutex_lock(&(shard->lock));
+        }
+      }
+      backlog=shard->ready_count;
+      pthread_mutex_unlock(&(shard->lock));
+
+      /* More than we can get through at once: get an idle worker to
+       *  help.
+       */
+      if ((backlog>1) && !(shards->flags & FLEXIPOLL_SHARDS_NO_STEAL)) {
+        for (i=1; i<shards->num_shards; i++) {
+          Shard* other=shards->shards+((shard->index+i)%shards->num_shards);
+          if (atomic_load(&(other->idle_bool))) {
+            wake(other);
+            break;
+          }
+        }
+      }
+    }
+
+    {
+      ReadyItem item;
+      while (pop_ready(shard,&item)) {
+        handle(shard,&item);
+        if (atomic_load(&(shards->stopping_bool)))
+          break;
+      }
+    }
+
+    if (!(shards->flags & FLEXIPOLL_SHARDS_NO_REBALANCE))
+      maybe_rebalance(shards);
+  }
+
+  return 0;
+}
+
+static int num_cpus(cpu_set_t* cpus)
+{
+  if (sched_getaffinity(0,sizeof(*cpus),cpus)<0)
+    return -1;
+  return CPU_COUNT(cpus);
+}
+
+static void delete_shard(Shard* shard)
+{
+  if (shard->fp)
+    flexipoll_delete(shard->fp);
+  pthread_mutex_destroy(&(shard->lock));
+  free(shard->cmds);
+  free(shard->ready);
+}
+
+FlexipollShards flexipoll_shards_new(int num_shards,
+                                     FlexipollHandler handler, void* ctx,
+                                     unsigned flags)
+{
+  if (!handler) {
+    errno=EFAULT;
+    return 0;
+  }
+
+  if (flags & ~(FLEXIPOLL_SHARDS_PIN
+                |FLEXIPOLL_SHARDS_NO_STEAL
+                |FLEXIPOLL_SHARDS_NO_REBALANCE)) {
+    errno=EINVAL;
+    return 0;
+  }
+
+  if (num_shards<=0) {
+    cpu_set_t cpus;
+    num_shards=num_cpus(&cpus);
+    if (num_shards<=0)
+      num_shards=1;
+  }
+
+  FlexipollShards res=
+    (FlexipollShards)(calloc(1,sizeof(struct FlexipollShards_)));
+  if (!res)
+    return 0;
+
+  res->shards=(Shard*)(calloc(num_shards,sizeof(Shard)));
+  if (!res->shards) {
+    int tmp=errno;
+    free(res);
+    errno=tmp;
+    return 0;
+  }
+
+  res->num_shards=num_shards;
+  res->flags=flags;
+  res->handler=handler;
+  res->handler_ctx=ctx;
+  res->policy=flexipoll_shard_least_loaded;
+  res->policy_ctx=0;
+  pthread_mutex_init(&(res->registry_lock),0);
+  atomic_init(&(res->stopping_bool),0);
+  atomic_init(&(res->next_rebalance),now_ms()+REBALANCE_INTERVAL);
+
+  int i;
+  for (i=0; i<num_shards; i++) {
+    Shard* shard=res->shards+i;
+    shard->shards=res;
+    shard->index=i;
+    pthread_mutex_init(&(shard->lock),0);
+    atomic_init(&(shard->idle_bool),0);
+    atomic_init(&(shard->num_fds),0);
+    atomic_init(&(shard->load),0);
+
+    shard->fp=flexipoll_new();
+    if (!shard->fp) {
+      int tmp=errno;
+      int j;
+      for (j=0; j<=i; j++)
+        delete_shard(res->shards+j);
+      pthread_mutex_destroy(&(res->registry_lock));
+      free(res->shards);
+      free(res);
+      errno=tmp;
+      return 0;
+    }
+  }
+
+  return res;
+}
+
+void flexipoll_shards_delete(FlexipollShards shards)
+{
+  if (!shards)
+    return;
+
+  atomic_store(&(shards->stopping_bool),1);
+  if (shards->started_bool) {
+    int i;
+    for (i=0; i<shards->num_shards; i++)
+      wake(shards->shards+i);
+    for (i=0; i<shards->num_shards; i++)
+      pthread_join(shards->shards[i].thread,0);
+  }
+
+  int i;
+  for (i=0; i<shards->num_shards; i++) {
+    Shard* shard=shards->shards+i;
+    int j;
+    for (j=0; j<shard->num_cmds; j++)
+      rec_unref(shard->cmds[j].rec);
+    for (j=0; j<shard->ready_count; j++)
+      rec_unref(shard->ready[(shard->ready_head+j)%shard->ready_max].rec);
+    delete_shard(shard);
+  }
+
+  for (i=0; i<shards->registry_size; i++)
+    if (shards->registry[i])
+      rec_unref(shards->registry[i]);
+  free(shards->registry);
+  pthread_mutex_destroy(&(shards->registry_lock));
+
+  free(shards->shards);
+  free(shards);
+}
+
+int flexipoll_shards_set_policy(FlexipollShards shards,
+                                FlexipollShardPolicy policy, void* ctx)
+{
+  if (!(shards && policy)) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  shards->policy=policy;
+  shards->policy_ctx=ctx;
+  return 0;
+}
+
+int flexipoll_shard_by_fd(FlexipollShards shards, int fd,
+                          void* data, void* ctx)
+{
+  (void)data;
+  (void)ctx;
+  return fd%shards->num_shards;
+}
+
+int flexipoll_shard_least_loaded(FlexipollShards shards, int fd,
+                                 void* data, void* ctx)
+{
+  (void)fd;
+  (void)data;
+  (void)ctx;
+  int best=0, i;
+  for (i=1; i<shards->num_shards; i++)
+    if (atomic_load(&(shards->shards[i].num_fds))
+        <atomic_load(&(shards->shards[best].num_fds)))
+      best=i;
+  return best;
+}
+
+int flexipoll_shards_start(FlexipollShards shards)
+{
+  if (!shards) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (shards->started_bool) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  cpu_set_t cpus;
+  int ncpus=(shards->flags & FLEXIPOLL_SHARDS_PIN) ? num_cpus(&cpus) : 0;
+
+  int i;
+  for (i=0; i<shards->num_shards; i++) {
+    Shard* shard=shards->shards+i;
+    int err=pthread_create(&(shard->thread),0,worker,shard);
+    if (err) {
+      atomic_store(&(shards->stopping_bool),1);
+      int j;
+      for (j=0; j<i; j++) {
+        wake(shards->shards+j);
+        pthread_join(shards->shards[j].thread,0);
+      }
+      atomic_store(&(shards->stopping_bool),0);
+      errno=err;
+      return -1;
+    }
+
+    if (ncpus>0) {
+      /* The (i mod ncpus)'th CPU in our affinity mask. */
+      int n=i%ncpus, cpu;
+      for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu,&cpus) && !(n--))
+          break;
+
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu,&one);
+      pthread_setaffinity_np(shard->thread,sizeof(one),&one);
+    }
+  }
+
+  shards->started_bool=1;
+  return 0;
+}
+
+int flexipoll_shards_count(FlexipollShards shards)
+{
+  if (!shards) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  return shards->num_shards;
+}
+
+int flexipoll_shards_num_fds(FlexipollShards shards, int shard)
+{
+  if (!shards) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if ((shard<0) || (shard>=shards->num_shards)) {
+    errno=EINVAL;
+    return -1;
+  }
+
+  return atomic_load(&(shards->shards[shard].num_fds));
+}
+
+int flexipoll_shards_add_fd(FlexipollShards shards, int fd, short events,
+                            void* data)
+{
+  if (!shards) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  pthread_mutex_lock(&(shards->registry_lock));
+
+  if (fd>=shards->registry_size) {
+    /* No open fd is that big: don't grow the registry to fit it. */
+    struct rlimit limit;
+    if ((getrlimit(RLIMIT_NOFILE,&limit)==0)
+        && (limit.rlim_cur!=RLIM_INFINITY)
+        && ((rlim_t)(fd)>=limit.rlim_cur)) {
+      pthread_mutex_unlock(&(shards->registry_lock));
+      errno=EBADF;
+      return -1;
+    }
+
+    int size=shards->registry_size ? shards->registry_size : 64;
+    while (size<=fd)
+      size*=2;
+
+    ShardFd** registry=
+      (ShardFd**)(realloc(shards->registry,sizeof(ShardFd*)*size));
+    if (!registry) {
+      int tmp=errno;
+      pthread_mutex_unlock(&(shards->registry_lock));
+      errno=tmp;
+      return -1;
+    }
+
+    int i;
+    for (i=shards->registry_size; i<size; i++)
+      registry[i]=0;
+    shards->registry=registry;
+    shards->registry_size=size;
+  }
+
+  /* Re-registering: retire the old record and start afresh, so the
+   *  new events take effect wherever the fd is now.
+   */
+  ShardFd* old=shards->registry[fd];
+  int shard;
+  if (old) {
+    shard=atomic_load(&(old->shard));
+    atomic_store(&(old->removed_bool),1);
+    post(shards->shards+shard,CMD_REMOVE,old);
+    shards->registry[fd]=0;
+    rec_unref(old);
+  } else {
+    shard=shards->policy(shards,fd,data,shards->policy_ctx);
+    if ((shard<0) || (shard>=shards->num_shards))
+      shard=fd%shards->num_shards;
+  }
+
+  ShardFd* rec=(ShardFd*)(malloc(sizeof(ShardFd)));
+  if (!rec) {
+    int tmp=errno;
+    pthread_mutex_unlock(&(shards->registry_lock));
+    errno=tmp;
+    return -1;
+  }
+
+  rec->fd=fd;
+  rec->events=events;
+  rec->data=data;
+  atomic_init(&(rec->shard),shard);
+  atomic_init(&(rec->removed_bool),0);
+  atomic_init(&(rec->move_to),-1);
+  atomic_init(&(rec->hits),0);
+  atomic_init(&(rec->refs),1);
+  rec->registered_bool=0;
+  rec->inflight_bool=1; /* until CMD_ADD */
+
+  atomic_fetch_add(&(shards->shards[shard].num_fds),1);
+  if (post(shards->shards+shard,CMD_ADD,rec)<0) {
+    int tmp=errno;
+    atomic_fetch_sub(&(shards->shards[shard].num_fds),1);
+    pthread_mutex_unlock(&(shards->registry_lock));
+    rec_unref(rec);
+    errno=tmp;
+    return -1;
+  }
+  shards->registry[fd]=rec;
+
+  pthread_mutex_unlock(&(shards->registry_lock));
+  return 0;
+}
+
+int flexipoll_shards_remove_fd(FlexipollShards shards, int fd)
+{
+  if (!shards) {
+    errno=EFAULT;
+    return -1;
+  }
+
+  if (fd<0) {
+    errno=EBADF;
+    return -1;
+  }
+
+  pthread_mutex_lock(&(shards->registry_lock));
+
+  ShardFd* rec=(fd<shards->registry_size) ? shards->registry[fd] : 0;
+  if (!rec) {
+    pthread_mutex_unlock(&(shards->registry_lock));
+    return 0;
+  }
+
+  shards->registry[fd]=0;
+  atomic_store(&(rec->removed_bool),1);
+  int res=post(shards->shards+atomic_load(&(rec->shard)),CMD_REMOVE,rec);
+
+  pthread_mutex_unlock(&(shards->registry_lock));
+
+  rec_unref(rec);
+  return res;
+}
@@ -0,0 +1,231 @@
+#include "timerwheel.h"
+
+#include <time.h>
+
+unsigned long long timerwheel_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000+ts.tv_nsec/1000000;
+}
+
+static void list_init(TimerWheelList* list)
+{
+  list->head.next=list->head.prev=&(list->head);
+}
+
+static void list_append(TimerWheelList* list, TimerWheelNode* node)
+{
+  node->prev=list->head.prev;
+  node->next=&(list->head);
+  list->head.prev->next=node;
+  list->head.prev=node;
+}
+
+static int list_empty(const TimerWheelList* list)
+{
+  return list->head.next==&(list->head);
+}
+
+void timerwheel_init(TimerWheel* tw, unsigned long long now)
+{
+  int level,slot;
+
+  tw->now=now;
+  for (level=0; level<TIMERWHEEL_LEVELS; level++) {
+    tw->occupied[level]=0;
+    for (slot=0; slot<TIMERWHEEL_SLOTS; slot++)
+      list_init(&(tw->slots[level][slot]));
+  }
+  list_init(&(tw->expired));
+  tw->count=0;
+}
+
+/* Links an unlinked node into the slot its expiry calls for, relative
+ *  to tw->now.
+ */
+static void place(TimerWheel* tw, TimerWheelNode* node)
+{
+  unsigned long long diff;
+  int level;
+
+  if (node->expires<tw->now)
+    diff=0;
+  else
+    diff=node->expires-tw->now;
+
+  for (level=0; level<TIMERWHEEL_LEVELS-1; level++)
+    if (diff<(1ULL<<(TIMERWHEEL_BITS*(level+1))))
+      break;
+
+  {
+    const unsigned long long range=1ULL<<(TIMERWHEEL_BITS*TIMERWHEEL_LEVELS);
+    if (diff>=range)
+      diff=range-1;
+  }
+
+  int slot=(int)(((tw->now+diff)>>(TIMERWHEEL_BITS*level))
+                 & TIMERWHEEL_MASK);
+  list_append(&(tw->slots[level][slot]),node);
+  tw->occupied[level]|=(1ULL<<slot);
+}
+
+void timerwheel_add(TimerWheel* tw, TimerWheelNode* node,
+                    unsigned long long expires)
+{
+  timerwheel_remove(tw,node);
+  node->expires=expires;
+  place(tw,node);
+  tw->count++;
+}
+
+void timerwheel_remove(TimerWheel* tw, TimerWheelNode* node)
+{
+  if (!timerwheel_node_linked(node))
+    return;
+
+  TimerWheelNode *prev=node->prev, *next=node->next;
+  prev->next=next;
+  next->prev=prev;
+  node->next=node->prev=0;
+  tw->count--;
+
+  /* If that emptied a slot, its occupied bit has to go too.  A node
+   *  whose neighbours are the same sentinel was the last one in its
+   *  list; the sentinel's address tells us which slot that was.
+   */
+  if (prev==next) {
+    const TimerWheelList* first=&(tw->slots[0][0]);
+    const TimerWheelList* list=(const TimerWheelList*)prev;
+    if ((list>=first) && (list<first+TIMERWHEEL_LEVELS*TIMERWHEEL_SLOTS)) {
+      int index=(int)(list-first);
+      tw->occupied[index/TIMERWHEEL_SLOTS]&=
+        ~(1ULL<<(index%TIMERWHEEL_SLOTS));
+    }
+  }
+}
+
+/* Re-places everything in slot of level, which has come due to be
+ *  spread out into the levels below it.
+ */
+static void cascade(TimerWheel* tw, int level, int slot)
+{
+  TimerWheelList* list=&(tw->slots[level][slot]);
+  TimerWheelNode* node=list->head.next;
+
+  list_init(list);
+  tw->occupied[level]&=~(1ULL<<slot);
+
+  while (node!=&(list->head)) {
+    TimerWheelNode* next=node->next;
+    place(tw,node);
+    node=next;
+  }
+}
+
+void timerwheel_advance(TimerWheel* tw, unsigned long long tick)
+{
+  while (tw->now<=tick) {
+    int index=(int)(tw->now & TIMERWHEEL_MASK);
+
+    if (!index) {
+      int level;
+      for (level=1; level<TIMERWHEEL_LEVELS; level++) {
+        int slot=(int)((tw->now>>(TIMERWHEEL_BITS*level)) & TIMERWHEEL_MASK);
+        cascade(tw,level,slot);
+        if (slot)
+          break;
+      }
+    }
+
+    unsigned long long pending=tw->occupied[0] & (~0ULL<<index);
+    if (!pending) {
+      tw->now=(tw->now|TIMERWHEEL_MASK)+1;
+      continue;
+    }
+
+    int slot=__builtin_ctzll(pending);
+    unsigned long long due=(tw->now & ~(unsigned long long)TIMERWHEEL_MASK)
+      +slot;
+    if (due>tick) {
+      tw->now=tick+1;
+      break;
+    }
+
+    {
+      TimerWheelList* list=&(tw->slots[0][slot]);
+      TimerWheelNode* node=list->head.next;
+      while (node!=&(list->head)) {
+        TimerWheelNode* next=node->next;
+        list_append(&(tw->expired),node);
+        node=next;
+      }
+      list_init(list);
+      tw->occupied[0]&=~(1ULL<<slot);
+    }
+
+    tw->now=due+1;
+  }
+}
+
+TimerWheelNode* timerwheel_pop_expired(TimerWheel* tw)
+{
+  if (list_empty(&(tw->expired)))
+    return 0;
+
+  TimerWheelNode* node=tw->expired.head.next;
+  timerwheel_remove(tw,node);
+  return node;
+}
+
+int timerwheel_next_timeout(const TimerWheel* tw, unsigned long long tick)
+{
+  if (!tw->count)
+    return -1;
+  if (!list_empty(&(tw->expired)))
+    return 0;
+
+  /* The earliest tick at which any nonempty slot is either due (level
+   *  0) or cascades (higher levels).
+   */
+  unsigned long long best=~0ULL;
+  int level;
+  for (level=0; level<TIMERWHEEL_LEVELS; level++) {
+    unsigned long long bits=tw->occupied[level];
+    if (!bits)
+      continue;
+
+    const int shift=TIMERWHEEL_BITS*level;
+    const unsigned long long base=(tw->now>>shift);
+    const int index=(int)(base & TIMERWHEEL_MASK);
+
+    /* Slots at or after index come up in this revolution, the rest in
+     *  the next one.  A higher-level slot equal to index was already
+     *  cascaded, so it is next due a full revolution later.
+     */
+    unsigned long long later=bits & (~0ULL<<index);
+    if (level && (later & (1ULL<<index))) {
+      if ((base<<shift)<tw->now)
+        later&=~(1ULL<<index);
+    }
+
+    unsigned long long when;
+    if (later) {
+      when=((base & ~(unsigned long long)TIMERWHEEL_MASK)
+            +__builtin_ctzll(later))<<shift;
+    } else {
+      when=((base & ~(unsigned long long)TIMERWHEEL_MASK)
+            +TIMERWHEEL_SLOTS+__builtin_ctzll(bits))<<shift;
+    }
+    if (when<tw->now)
+      when=tw->now;
+    if (when<best)
+      best=when;
+  }
+
+  if (best<=tick)
+    return 0;
+  if (best-tick>0x7fffffffULL)
+    return 0x7fffffff;
+  return (int)(best-tick);
+}
@@ -0,0 +1,70 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+/* Hierarchical timer wheel, in the style of the classic Linux
+ *  timer_list: TIMERWHEEL_LEVELS levels of TIMERWHEEL_SLOTS slots
+ *  each, one tick per millisecond.  Arming and cancelling are O(1);
+ *  timers further out than the wheel's range sit in the top level
+ *  and are re-cascaded until they come within range.
+ *
+ * Nodes are owned by the caller; the wheel only links them together.
+ */
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1<<TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS-1)
+#define TIMERWHEEL_LEVELS 5
+
+typedef struct TimerWheelNode {
+  struct TimerWheelNode *next, *prev; /* both 0 if not linked anywhere */
+  unsigned long long expires; /* absolute tick */
+} TimerWheelNode;
+
+typedef struct TimerWheelList {
+  TimerWheelNode head; /* circular, with head as sentinel */
+} TimerWheelList;
+
+typedef struct TimerWheel {
+  unsigned long long now; /* next tick to process; everything due
+                           *  before it has been moved to expired.
+                           */
+  unsigned long long occupied[TIMERWHEEL_LEVELS]; /* bit per nonempty slot */
+  TimerWheelList slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+  TimerWheelList expired; /* due, but not yet collected */
+  int count; /* linked nodes, including expired ones */
+} TimerWheel;
+
+/* Current time, in ticks, on the clock the wheel runs on. */
+unsigned long long timerwheel_clock(void);
+
+void timerwheel_init(TimerWheel* tw, unsigned long long now);
+
+static inline int timerwheel_node_linked(const TimerWheelNode* node)
+{
+  return node->next!=0;
+}
+
+/* Links node to expire at tick expires; unlinks it first if need be. */
+void timerwheel_add(TimerWheel* tw, TimerWheelNode* node,
+                    unsigned long long expires);
+/* Unlinks node, wherever it is.  Harmless if it is not linked. */
+void timerwheel_remove(TimerWheel* tw, TimerWheelNode* node);
+
+/* Moves every node due at or before tick to the expired list. */
+void timerwheel_advance(TimerWheel* tw, unsigned long long tick);
+
+/* Unlinks and returns the first expired node, or 0 if none. */
+TimerWheelNode* timerwheel_pop_expired(TimerWheel* tw);
+
+static inline int timerwheel_have_expired(const TimerWheel* tw)
+{
+  return tw->expired.head.next!=&(tw->expired.head);
+}
+
+/* Milliseconds from tick until the wheel next needs attention (a
+ *  timer expiring or a slot cascading), or -1 if it holds no timers.
+ *  Never later than the next expiry; may be earlier.
+ */
+int timerwheel_next_timeout(const TimerWheel* tw, unsigned long long tick);
+
+#endif /*_TIMERWHEEL_H_*/
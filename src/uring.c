@@ -0,0 +1,225 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+  return (int)(syscall(__NR_io_uring_setup,entries,params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit,
+                          unsigned min_complete, unsigned flags)
+{
+  return (int)(syscall(__NR_io_uring_enter,fd,to_submit,min_complete,
+                       flags,0,0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg,
+                             unsigned nr_args)
+{
+  return (int)(syscall(__NR_io_uring_register,fd,opcode,arg,nr_args));
+}
+
+/* Returns nonzero if the probed kernel knows op. */
+static int supports(const struct io_uring_probe* probe, int op)
+{
+  return (op<=probe->last_op)
+    && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+int uring_init(Uring* ring, unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params,0,sizeof(params));
+  memset(ring,0,sizeof(*ring));
+  ring->sq_ring=ring->cq_ring=MAP_FAILED;
+  ring->sqes=(struct io_uring_sqe*)MAP_FAILED;
+
+  ring->fd=io_uring_setup(entries,&params);
+  if (ring->fd<0)
+    return -1;
+
+  /* Probing is 5.6+; multishot poll is later still, but older kernels
+   *  just ignore the flag and deliver one completion, which the
+   *  caller has to cope with anyway.
+   */
+  {
+    size_t size=sizeof(struct io_uring_probe)
+      +256*sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe=(struct io_uring_probe*)(calloc(1,size));
+    if (!probe) {
+      int tmp=errno;
+      uring_destroy(ring);
+      errno=tmp;
+      return -1;
+    }
+    if ((io_uring_register(ring->fd,IORING_REGISTER_PROBE,probe,256)<0)
+        || !supports(probe,IORING_OP_POLL_ADD)
+        || !supports(probe,IORING_OP_POLL_REMOVE)) {
+      free(probe);
+      uring_destroy(ring);
+      errno=ENOSYS;
+      return -1;
+    }
+    free(probe);
+  }
+
+  ring->sq_ring_size=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+  ring->cq_ring_size=params.cq_off.cqes
+    +params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size>ring->sq_ring_size)
+      ring->sq_ring_size=ring->cq_ring_size;
+    ring->cq_ring_size=ring->sq_ring_size;
+  }
+
+  ring->sq_ring=mmap(0,ring->sq_ring_size,PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+  if (ring->sq_ring==MAP_FAILED) {
+    int tmp=errno;
+    uring_destroy(ring);
+    errno=tmp;
+    return -1;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring=ring->sq_ring;
+  } else {
+    ring->cq_ring=mmap(0,ring->cq_ring_size,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+    if (ring->cq_ring==MAP_FAILED) {
+      int tmp=errno;
+      uring_destroy(ring);
+      errno=tmp;
+      return -1;
+    }
+  }
+
+  ring->sqes_size=params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqes=(struct io_uring_sqe*)
+    (mmap(0,ring->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+          ring->fd,IORING_OFF_SQES));
+  if (ring->sqes==MAP_FAILED) {
+    int tmp=errno;
+    uring_destroy(ring);
+    errno=tmp;
+    return -1;
+  }
+
+  {
+    char* sq=(char*)(ring->sq_ring);
+    char* cq=(char*)(ring->cq_ring);
+
+    ring->sq_head=(unsigned*)(sq+params.sq_off.head);
+    ring->sq_tail=(unsigned*)(sq+params.sq_off.tail);
+    ring->sq_mask=(unsigned*)(sq+params.sq_off.ring_mask);
+    ring->sq_flags=(unsigned*)(sq+params.sq_off.flags);
+    ring->sq_entries=params.sq_entries;
+    ring->sqe_tail=*(ring->sq_tail);
+
+    /* SQE i always goes in slot i, so the index array is set once. */
+    {
+      unsigned* array=(unsigned*)(sq+params.sq_off.array);
+      unsigned i;
+      for (i=0; i<params.sq_entries; i++)
+        array[i]=i;
+    }
+
+    ring->cq_head=(unsigned*)(cq+params.cq_off.head);
+    ring->cq_tail=(unsigned*)(cq+params.cq_off.tail);
+    ring->cq_mask=(unsigned*)(cq+params.cq_off.ring_mask);
+    ring->cqes=(struct io_uring_cqe*)(cq+params.cq_off.cqes);
+  }
+
+  return 0;
+}
+
+void uring_destroy(Uring* ring)
+{
+  if (ring->sqes!=MAP_FAILED)
+    munmap(ring->sqes,ring->sqes_size);
+  if ((ring->cq_ring!=MAP_FAILED) && (ring->cq_ring!=ring->sq_ring))
+    munmap(ring->cq_ring,ring->cq_ring_size);
+  if (ring->sq_ring!=MAP_FAILED)
+    munmap(ring->sq_ring,ring->sq_ring_size);
+  if (ring->fd>=0)
+    close(ring->fd);
+  ring->fd=-1;
+  ring->sq_ring=ring->cq_ring=MAP_FAILED;
+  ring->sqes=(struct io_uring_sqe*)MAP_FAILED;
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring)
+{
+  unsigned head=__atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+  if (ring->sqe_tail-head>=ring->sq_entries) {
+    if (uring_submit(ring)<0)
+      return 0;
+    head=__atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+    if (ring->sqe_tail-head>=ring->sq_entries) {
+      errno=EBUSY;
+      return 0;
+    }
+  }
+
+  struct io_uring_sqe* sqe=ring->sqes+(ring->sqe_tail & *(ring->sq_mask));
+  ring->sqe_tail++;
+  memset(sqe,0,sizeof(*sqe));
+  return sqe;
+}
+
+unsigned uring_pending(const Uring* ring)
+{
+  return ring->sqe_tail-__atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+}
+
+int uring_submit(Uring* ring)
+{
+  __atomic_store_n(ring->sq_tail,ring->sqe_tail,__ATOMIC_RELEASE);
+
+  unsigned to_submit;
+  while ((to_submit=uring_pending(ring))) {
+    ring->enter_calls++;
+    if (io_uring_enter(ring->fd,to_submit,0,0)<0) {
+      if (errno==EINTR)
+        continue;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring* ring)
+{
+  unsigned head=*(ring->cq_head);
+  if (head==__atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE))
+    return 0;
+  return ring->cqes+(head & *(ring->cq_mask));
+}
+
+void uring_cqe_seen(Uring* ring)
+{
+  __atomic_store_n(ring->cq_head,*(ring->cq_head)+1,__ATOMIC_RELEASE);
+}
+
+int uring_cq_overflowed(const Uring* ring)
+{
+  return (__atomic_load_n(ring->sq_flags,__ATOMIC_RELAXED)
+          & IORING_SQ_CQ_OVERFLOW)!=0;
+}
+
+int uring_flush_overflow(Uring* ring)
+{
+  for (;;) {
+    ring->enter_calls++;
+    if (io_uring_enter(ring->fd,0,0,IORING_ENTER_GETEVENTS)>=0)
+      return 0;
+    if (errno!=EINTR)
+      return -1;
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+/* The least of io_uring that flexipoll needs, on raw system calls, so
+ *  there's no dependency on liburing: set up a ring, queue SQEs, submit
+ *  them in one io_uring_enter(), and read completions straight out of
+ *  the shared CQ ring.  Single-threaded.
+ */
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+typedef struct Uring {
+  int fd;
+
+  /* SQ ring, shared with the kernel. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned sqe_tail; /* ours: SQEs handed out, published or not */
+
+  /* CQ ring. */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring; /* may be sq_ring */
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  unsigned long long enter_calls; /* io_uring_enter()s, for stats */
+} Uring;
+
+/* Sets up a ring with room for entries SQEs, having checked that the
+ *  kernel supports IORING_OP_POLL_ADD and IORING_OP_POLL_REMOVE.
+ *  Returns <0, with errno set, if it doesn't or io_uring is not
+ *  available at all (ENOSYS, or EPERM under some sandboxes).
+ */
+int uring_init(Uring* ring, unsigned entries);
+void uring_destroy(Uring* ring);
+
+/* Returns a zeroed SQE to fill in.  If the SQ ring is full, submits
+ *  what's in it first.  Returns 0, with errno set, if that fails.
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+
+/* Number of SQEs handed out but not yet submitted. */
+unsigned uring_pending(const Uring* ring);
+
+/* Submits every SQE handed out so far, in one io_uring_enter() (if
+ *  there are any).  Returns <0 on error.
+ */
+int uring_submit(Uring* ring);
+
+/* Returns the oldest unseen completion, or 0 if there are none. */
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);
+/* Marks the completion from uring_peek_cqe() as seen. */
+void uring_cqe_seen(Uring* ring);
+
+/* Returns nonzero if completions were held back for lack of room in
+ *  the CQ ring; uring_flush_overflow() fetches them.
+ */
+int uring_cq_overflowed(const Uring* ring);
+int uring_flush_overflow(Uring* ring);
+
+#endif /*_URING_H_*/
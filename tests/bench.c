@@ -0,0 +1,615 @@
+/* bench.c
+ *	Scenario-driven benchmark: poll() vs epoll vs flexipoll over pipes,
+ *	with traffic patterns meant to look like real servers.
+ *
+ * Each round, the driver writes a byte to some of the pipes, then waits
+ *  until every pipe written to has been reported and drained.  An
+ *  event's latency is from the first write to that pipe in the round
+ *  to the moment it's handled.  Everything runs on one thread, so
+ *  what's measured is the cost of finding the ready fds.
+ *
+ * Scenarios:
+ *   zipf	writes go to pipes drawn from a Zipf distribution (s=1)
+ *   phase	90% of writes go to a hot tenth of the pipes; which tenth
+ *		changes every quarter of the run
+ *   churn	uniform writes, while a few pipes per round are closed
+ *		and replaced with new ones
+ *   idle	a big pool of pipes, nearly all idle; writes go to a
+ *		handful
+ *   bursty	mostly one write per round, with a burst of many every
+ *		so often
+ *
+ * Output is one line per scenario and backend, as CSV or JSON.
+ */
+#define _GNU_SOURCE /* for pipe2() */
+
+#include <flexipoll.h>
+#include <flexipoll_trace.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAX_FDS (64*1024)
+
+/* Writes per round, in the scenarios that don't say otherwise. */
+#define WRITES_PER_ROUND 32
+
+static void pexit(const char* msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000000000+ts.tv_nsec;
+}
+
+/* xorshift64*, so runs are repeatable and backends see the same
+ *  traffic.
+ */
+static unsigned long long rng_state;
+
+static unsigned long long rng(void)
+{
+  rng_state^=rng_state>>12;
+  rng_state^=rng_state<<25;
+  rng_state^=rng_state>>27;
+  return rng_state*2685821657736338717ULL;
+}
+
+static double rng_unit(void)
+{
+  return (rng()>>11)*(1.0/9007199254740992.0);
+}
+
+/*** Backends ***/
+
+typedef struct Backend {
+  const char* name;
+  void (*setup)(int num_fds);
+  void (*teardown)(void);
+  void (*add)(int fd);
+  void (*remove)(int fd);
+  /* Blocks for ready fds; puts up to max of them in fds.  Returns how
+   *  many.
+   */
+  int (*wait)(int* fds, int max);
+} Backend;
+
+/* poll(): one big pollfd array, scanned in full after every call. */
+static struct pollfd* pollfds;
+static int num_pollfds;
+static int* pollfd_slot; /* indexed by fd */
+
+static void poll_setup(int num_fds)
+{
+  pollfds=(struct pollfd*)(malloc(sizeof(struct pollfd)*MAX_FDS));
+  pollfd_slot=(int*)(malloc(sizeof(int)*MAX_FDS));
+  if (!(pollfds && pollfd_slot))
+    pexit("malloc");
+  num_pollfds=0;
+}
+
+static void poll_teardown(void)
+{
+  free(pollfds);
+  free(pollfd_slot);
+}
+
+static void poll_add(int fd)
+{
+  pollfds[num_pollfds].fd=fd;
+  pollfds[num_pollfds].events=POLLIN;
+  pollfds[num_pollfds].revents=0;
+  pollfd_slot[fd]=num_pollfds++;
+}
+
+static void poll_remove(int fd)
+{
+  int slot=pollfd_slot[fd];
+  pollfds[slot]=pollfds[--num_pollfds];
+  pollfd_slot[pollfds[slot].fd]=slot;
+}
+
+static int poll_wait(int* fds, int max)
+{
+  int N=poll(pollfds,num_pollfds,-1);
+  if (N<0)
+    pexit("poll");
+
+  int res=0, i;
+  for (i=0; (i<num_pollfds) && (res<N) && (res<max); i++)
+    if (pollfds[i].revents)
+      fds[res++]=pollfds[i].fd;
+  return res;
+}
+
+/* epoll, level-triggered. */
+static int epoll_fd=-1;
+static struct epoll_event* epvs;
+
+static void epoll_setup(int num_fds)
+{
+  epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd<0)
+    pexit("epoll_create1");
+  epvs=(struct epoll_event*)(malloc(sizeof(struct epoll_event)*MAX_FDS));
+  if (!epvs)
+    pexit("malloc");
+}
+
+static void epoll_teardown(void)
+{
+  close(epoll_fd);
+  free(epvs);
+}
+
+static void epoll_add(int fd)
+{
+  struct epoll_event epv;
+  epv.events=EPOLLIN;
+  epv.data.fd=fd;
+  if (epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&epv)<0)
+    pexit("epoll_ctl");
+}
+
+static void epoll_remove(int fd)
+{
+  if (epoll_ctl(epoll_fd,EPOLL_CTL_DEL,fd,0)<0)
+    pexit("epoll_ctl");
+}
+
+static int epoll_wait_fds(int* fds, int max)
+{
+  int N=epoll_wait(epoll_fd,epvs,max,-1);
+  if (N<0)
+    pexit("epoll_wait");
+
+  int i;
+  for (i=0; i<N; i++)
+    fds[i]=epvs[i].data.fd;
+  return N;
+}
+
+/* flexipoll, with the defaults.  With --trace, its runs are traced
+ *  to trace_fd, a ring's worth at a time.
+ */
+static Flexipoll fp;
+static FlexipollEvent* fevs;
+static int trace_fd=-1;
+static int waits;
+
+#define TRACE_RECORDS (1<<20)
+#define WAITS_PER_TRACE 4096
+
+static void flexipoll_setup(int num_fds)
+{
+  fp=flexipoll_new();
+  if (!fp)
+    pexit("flexipoll_new");
+  fevs=(FlexipollEvent*)(malloc(sizeof(FlexipollEvent)*MAX_FDS));
+  if (!fevs)
+    pexit("malloc");
+  if ((trace_fd>=0) && (flexipoll_set_trace(fp,TRACE_RECORDS)<0))
+    pexit("flexipoll_set_trace");
+}
+
+static void flexipoll_teardown(void)
+{
+  if ((trace_fd>=0) && (flexipoll_write_trace(fp,trace_fd)<0))
+    pexit("flexipoll_write_trace");
+  flexipoll_delete(fp);
+  free(fevs);
+}
+
+static void flexipoll_add(int fd)
+{
+  if (flexipoll_add_fd(fp,fd,POLLIN)<0)
+    pexit("flexipoll_add_fd");
+}
+
+static void flexipoll_remove(int fd)
+{
+  if (flexipoll_remove_fd(fp,fd)<0)
+    pexit("flexipoll_remove_fd");
+}
+
+static int flexipoll_wait(int* fds, int max)
+{
+  int N=flexipoll_poll_events(fp,fevs,max,-1);
+  if (N<0)
+    pexit("flexipoll_poll_events");
+
+  if ((trace_fd>=0) && !(++waits % WAITS_PER_TRACE)
+      && (flexipoll_write_trace(fp,trace_fd)<0))
+    pexit("flexipoll_write_trace");
+
+  int i;
+  for (i=0; i<N; i++)
+    fds[i]=fevs[i].fd;
+  return N;
+}
+
+static const Backend backends[]={
+  {"poll",poll_setup,poll_teardown,poll_add,poll_remove,poll_wait},
+  {"epoll",epoll_setup,epoll_teardown,epoll_add,epoll_remove,epoll_wait_fds},
+  {"flexipoll",flexipoll_setup,flexipoll_teardown,flexipoll_add,
+   flexipoll_remove,flexipoll_wait},
+};
+#define NUM_BACKENDS ((int)(sizeof(backends)/sizeof(backends[0])))
+
+/*** Pipes ***/
+
+typedef struct Pipe {
+  int fds[2];
+  unsigned long long written_ns; /* 0 unless written this round */
+} Pipe;
+
+static const Backend* backend;
+static Pipe* pipes;
+static int num_pipes;
+static int pipe_of_fd[MAX_FDS]; /* read end's fd to index into pipes */
+
+static int num_pending; /* pipes written to and not yet drained */
+static unsigned long long* latencies;
+static long num_latencies, max_latencies;
+
+static void open_pipe(int i)
+{
+  if (pipe2(pipes[i].fds,O_NONBLOCK|O_CLOEXEC)<0)
+    pexit("pipe2");
+  if (pipes[i].fds[1]>=MAX_FDS) {
+    fprintf(stderr,"too many fds\n");
+    exit(1);
+  }
+  pipes[i].written_ns=0;
+  pipe_of_fd[pipes[i].fds[0]]=i;
+  backend->add(pipes[i].fds[0]);
+}
+
+static void close_pipe(int i)
+{
+  backend->remove(pipes[i].fds[0]);
+  close(pipes[i].fds[0]);
+  close(pipes[i].fds[1]);
+}
+
+static void write_pipe(int i)
+{
+  if (!pipes[i].written_ns) {
+    pipes[i].written_ns=now_ns();
+    num_pending++;
+  }
+  if (write(pipes[i].fds[1],"x",1)<0)
+    pexit("write");
+}
+
+/* Waits until everything written this round has been handled. */
+static void drain_round(void)
+{
+  static int fds[MAX_FDS];
+
+  while (num_pending) {
+    int N=backend->wait(fds,MAX_FDS);
+    int i;
+    for (i=0; i<N; i++) {
+      char buff[256];
+      Pipe* p=pipes+pipe_of_fd[fds[i]];
+      while (read(fds[i],buff,sizeof(buff))>0)
+        ;
+
+      if (p->written_ns) {
+        if (num_latencies==max_latencies) {
+          max_latencies=max_latencies ? max_latencies*2 : 65536;
+          latencies=(unsigned long long*)
+            (realloc(latencies,sizeof(unsigned long long)*max_latencies));
+          if (!latencies)
+            pexit("realloc");
+        }
+        latencies[num_latencies++]=now_ns()-p->written_ns;
+        p->written_ns=0;
+        num_pending--;
+      }
+    }
+  }
+}
+
+/*** Scenarios ***/
+
+/* Zipf(s=1) over the pipes, by rank; ranks map to pipes through a
+ *  shuffle, so the hot pipes aren't just the lowest fds.
+ */
+static double* zipf_cdf;
+static int* zipf_pipe;
+
+static void zipf_setup(void)
+{
+  zipf_cdf=(double*)(malloc(sizeof(double)*num_pipes));
+  zipf_pipe=(int*)(malloc(sizeof(int)*num_pipes));
+  if (!(zipf_cdf && zipf_pipe))
+    pexit("malloc");
+
+  double total=0;
+  int i;
+  for (i=0; i<num_pipes; i++) {
+    total+=1.0/(i+1);
+    zipf_cdf[i]=total;
+    zipf_pipe[i]=i;
+  }
+  for (i=0; i<num_pipes; i++)
+    zipf_cdf[i]/=total;
+  for (i=num_pipes-1; i>0; i--) {
+    int j=rng()%(i+1), tmp=zipf_pipe[i];
+    zipf_pipe[i]=zipf_pipe[j];
+    zipf_pipe[j]=tmp;
+  }
+}
+
+static int zipf_pick(void)
+{
+  double u=rng_unit();
+  int lo=0, hi=num_pipes-1;
+  while (lo<hi) {
+    int mid=(lo+hi)/2;
+    if (zipf_cdf[mid]<u)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return zipf_pipe[lo];
+}
+
+static void zipf_round(int round, int num_rounds)
+{
+  int i;
+  for (i=0; i<WRITES_PER_ROUND; i++)
+    write_pipe(zipf_pick());
+}
+
+static void phase_round(int round, int num_rounds)
+{
+  int hot=num_pipes/10 ? num_pipes/10 : 1;
+  int phase=(int)((4LL*round)/num_rounds);
+  int first=(phase*hot*3)%num_pipes; /* a different tenth each phase */
+
+  int i;
+  for (i=0; i<WRITES_PER_ROUND; i++) {
+    if (rng()%10)
+      write_pipe((first+rng()%hot)%num_pipes);
+    else
+      write_pipe(rng()%num_pipes);
+  }
+}
+
+static void churn_round(int round, int num_rounds)
+{
+  int i;
+  for (i=0; i<WRITES_PER_ROUND; i++)
+    write_pipe(rng()%num_pipes);
+  drain_round();
+
+  /* Replace a few pipes per round: about 1% of them. */
+  int n=num_pipes/100 ? num_pipes/100 : 1;
+  for (i=0; i<n; i++) {
+    int j=rng()%num_pipes;
+    close_pipe(j);
+    open_pipe(j);
+  }
+}
+
+static void idle_round(int round, int num_rounds)
+{
+  int active=num_pipes<16 ? num_pipes : 16;
+  int i;
+  for (i=0; i<4; i++)
+    write_pipe(rng()%active);
+}
+
+static void bursty_round(int round, int num_rounds)
+{
+  int burst_bool=(round%64)<4;
+  int n=burst_bool ? WRITES_PER_ROUND*8 : 1;
+  int i;
+  for (i=0; i<n; i++)
+    write_pipe(rng()%num_pipes);
+}
+
+typedef struct Scenario {
+  const char* name;
+  int fds_factor; /* pipes, as a multiple of --fds */
+  void (*setup)(void);
+  void (*round)(int round, int num_rounds);
+} Scenario;
+
+static const Scenario scenarios[]={
+  {"zipf",1,zipf_setup,zipf_round},
+  {"phase",1,0,phase_round},
+  {"churn",1,0,churn_round},
+  {"idle",4,0,idle_round},
+  {"bursty",1,0,bursty_round},
+};
+#define NUM_SCENARIOS ((int)(sizeof(scenarios)/sizeof(scenarios[0])))
+
+/*** Driver ***/
+
+static int compare_ull(const void* a, const void* b)
+{
+  unsigned long long x=*(const unsigned long long*)a,
+    y=*(const unsigned long long*)b;
+  return (x>y)-(x<y);
+}
+
+static unsigned long long percentile(double p)
+{
+  if (!num_latencies)
+    return 0;
+  long i=(long)(p*(num_latencies-1)+0.5);
+  return latencies[i];
+}
+
+static int json_bool;
+static int lines_out;
+
+static void run(const Scenario* scenario, const Backend* b,
+                int fds, int num_rounds)
+{
+  backend=b;
+  num_pipes=fds*scenario->fds_factor;
+  if (2*num_pipes+64>MAX_FDS) {
+    fprintf(stderr,"too many fds\n");
+    exit(1);
+  }
+  rng_state=0x9e3779b97f4a7c15ULL;
+  num_latencies=0;
+  num_pending=0;
+
+  pipes=(Pipe*)(malloc(sizeof(Pipe)*num_pipes));
+  if (!pipes)
+    pexit("malloc");
+
+  backend->setup(num_pipes);
+  {
+    int i;
+    for (i=0; i<num_pipes; i++)
+      open_pipe(i);
+  }
+  if (scenario->setup)
+    scenario->setup();
+
+  unsigned long long start=now_ns();
+  {
+    int round;
+    for (round=0; round<num_rounds; round++) {
+      scenario->round(round,num_rounds);
+      drain_round();
+    }
+  }
+  double secs=(now_ns()-start)/1e9;
+
+  qsort(latencies,num_latencies,sizeof(latencies[0]),compare_ull);
+
+  if (json_bool)
+    printf("%s{\"scenario\":\"%s\",\"backend\":\"%s\",\"fds\":%d,"
+           "\"rounds\":%d,\"events\":%ld,\"seconds\":%.6f,"
+           "\"events_per_sec\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+           "\"p999_ns\":%llu}",
+           lines_out ? ",\n " : "[",
+           scenario->name,b->name,num_pipes,num_rounds,num_latencies,secs,
+           num_latencies/secs,percentile(0.5),percentile(0.99),
+           percentile(0.999));
+  else
+    printf("%s,%s,%d,%d,%ld,%.6f,%.1f,%llu,%llu,%llu\n",
+           scenario->name,b->name,num_pipes,num_rounds,num_latencies,secs,
+           num_latencies/secs,percentile(0.5),percentile(0.99),
+           percentile(0.999));
+  fflush(stdout);
+  lines_out++;
+
+  {
+    int i;
+    for (i=0; i<num_pipes; i++)
+      close_pipe(i);
+  }
+  backend->teardown();
+  free(pipes);
+  free(zipf_cdf);
+  free(zipf_pipe);
+  zipf_cdf=0;
+  zipf_pipe=0;
+}
+
+static void usage(void)
+{
+  int i;
+  fprintf(stderr,"usage: bench [--csv | --json] [--scenario NAME]..."
+          " [--backend NAME]...\n"
+          "\t[--fds N] [--rounds N] [--trace FILE]\n"
+          "scenarios:");
+  for (i=0; i<NUM_SCENARIOS; i++)
+    fprintf(stderr," %s",scenarios[i].name);
+  fprintf(stderr,"\nbackends:");
+  for (i=0; i<NUM_BACKENDS; i++)
+    fprintf(stderr," %s",backends[i].name);
+  fprintf(stderr,"\n");
+  exit(2);
+}
+
+int main(int argc, const char* argv[])
+{
+  int want_scenario[NUM_SCENARIOS], want_backend[NUM_BACKENDS];
+  int any_scenario_bool=0, any_backend_bool=0;
+  int fds=1000, num_rounds=2000;
+  int i, j;
+
+  memset(want_scenario,0,sizeof(want_scenario));
+  memset(want_backend,0,sizeof(want_backend));
+
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i],"--csv")) {
+      json_bool=0;
+    } else if (!strcmp(argv[i],"--json")) {
+      json_bool=1;
+    } else if (!strcmp(argv[i],"--scenario") && (i+1<argc)) {
+      i++;
+      for (j=0; (j<NUM_SCENARIOS) && strcmp(argv[i],scenarios[j].name); j++)
+        ;
+      if (j==NUM_SCENARIOS)
+        usage();
+      want_scenario[j]=any_scenario_bool=1;
+    } else if (!strcmp(argv[i],"--backend") && (i+1<argc)) {
+      i++;
+      for (j=0; (j<NUM_BACKENDS) && strcmp(argv[i],backends[j].name); j++)
+        ;
+      if (j==NUM_BACKENDS)
+        usage();
+      want_backend[j]=any_backend_bool=1;
+    } else if (!strcmp(argv[i],"--fds") && (i+1<argc)) {
+      fds=atoi(argv[++i]);
+    } else if (!strcmp(argv[i],"--rounds") && (i+1<argc)) {
+      num_rounds=atoi(argv[++i]);
+    } else if (!strcmp(argv[i],"--trace") && (i+1<argc)) {
+      trace_fd=open(argv[++i],O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+      if (trace_fd<0)
+        pexit(argv[i]);
+    } else {
+      usage();
+    }
+  }
+
+  if ((fds<1) || (num_rounds<1))
+    usage();
+
+  {
+    struct rlimit fdlimit={MAX_FDS,MAX_FDS};
+    setrlimit(RLIMIT_NOFILE,&fdlimit);
+  }
+
+  if (!json_bool)
+    printf("scenario,backend,fds,rounds,events,seconds,events_per_sec,"
+           "p50_ns,p99_ns,p999_ns\n");
+
+  for (i=0; i<NUM_SCENARIOS; i++) {
+    if (any_scenario_bool && !want_scenario[i])
+      continue;
+    for (j=0; j<NUM_BACKENDS; j++)
+      if (!any_backend_bool || want_backend[j])
+        run(scenarios+i,backends+j,fds,num_rounds);
+  }
+
+  if (json_bool)
+    printf(lines_out ? "]\n" : "[]\n");
+
+  free(latencies);
+  return 0;
+}
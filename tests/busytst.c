@@ -0,0 +1,88 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Busy polling: a spin that finds something, a budget that shrinks to
+ *  nothing while calls keep timing out, and grows back once things
+ *  turn up at once again.
+ */
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  CHECK((flexipoll_set_busy_poll(fp,-1)<0) && (errno==EINVAL));
+  CHECK((flexipoll_set_busy_poll(0,10)<0) && (errno==EFAULT));
+
+  FlexipollStats stats;
+  int fds[2];
+  CHECK(pipe(fds)==0);
+  CHECK(flexipoll_add_fd(fp,fds[0],POLLIN)==0);
+  FlexipollEvent events[4];
+
+  /* Off by default. */
+  CHECK(write(fds[1],"x",1)==1);
+  CHECK(flexipoll_poll_events(fp,events,4,10)==1);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(!stats.spins && !stats.spin_polls && !stats.spin_budget_ns);
+
+  CHECK(flexipoll_set_busy_poll(fp,1000)==0);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.spin_budget_ns==1000000);
+  CHECK(flexipoll_poll_events(fp,events,4,10)==1);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert((stats.spins==1) && (stats.spin_hits==1) && (stats.spin_polls==1));
+
+  /* A zero timeout never spins. */
+  CHECK(flexipoll_poll_events(fp,events,4,0)==1);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.spins==1);
+
+  /* Nothing turning up within 5ms, again and again. */
+  {
+    char c;
+    CHECK(read(fds[0],&c,1)==1);
+  }
+  int i;
+  for (i=0; i<20; i++)
+    CHECK(flexipoll_poll_events(fp,events,4,5)==0);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.spin_budget_ns==0);
+  assert(stats.spin_hits==1);
+  {
+    unsigned long long spins=stats.spins;
+    CHECK(flexipoll_poll_events(fp,events,4,1)==0);
+    CHECK(flexipoll_get_stats(fp,&stats)==0);
+    assert(stats.spins==spins);
+  }
+
+  /* Then always something ready. */
+  CHECK(write(fds[1],"x",1)==1);
+  for (i=0; (i<200) && !stats.spin_budget_ns; i++) {
+    CHECK(flexipoll_poll_events(fp,events,4,5)==1);
+    CHECK(flexipoll_get_stats(fp,&stats)==0);
+  }
+  assert(stats.spin_budget_ns>0);
+  {
+    unsigned long long hits=stats.spin_hits;
+    CHECK(flexipoll_poll_events(fp,events,4,5)==1);
+    CHECK(flexipoll_get_stats(fp,&stats)==0);
+    assert(stats.spin_hits==hits+1);
+  }
+
+  CHECK(flexipoll_set_busy_poll(fp,0)==0);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(!stats.spin_budget_ns);
+
+  close(fds[0]);
+  close(fds[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
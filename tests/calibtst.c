@@ -0,0 +1,103 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Measuring costs, deriving thresholds from them, and recalibrating
+ *  from what a Flexipoll sees of itself.
+ */
+
+#define NUM_FDS 100
+
+static int in_epoll_tier(Flexipoll fp, int fd)
+{
+  FlexipollFdStats stats;
+  CHECK(flexipoll_fd_stats(fp,fd,&stats)==0);
+  return stats.in_epoll_bool;
+}
+
+int main(int argc, const char* argv[])
+{
+  FlexipollCosts costs;
+  CHECK(flexipoll_measure_costs(&costs)==0);
+  assert((costs.poll_ns>0) && (costs.epoll_event_ns>0)
+         && (costs.epoll_ctl_ns>0));
+  printf("poll %.1f ns/fd, epoll_wait %.1f ns/event, epoll_ctl %.1f ns\n",
+         costs.poll_ns,costs.epoll_event_ns,costs.epoll_ctl_ns);
+
+  CHECK(!flexipoll_new_ex(0x100) && (errno==EINVAL));
+
+  Flexipoll fp=flexipoll_new_ex(FLEXIPOLL_NEW_CALIBRATE);
+  CHECK(fp);
+  {
+    FlexipollCosts applied;
+    CHECK(flexipoll_get_costs(fp,&applied)==0);
+    assert(applied.poll_ns>0);
+  }
+
+  {
+    FlexipollCosts bad=costs;
+    bad.epoll_event_ns=0;
+    CHECK((flexipoll_apply_costs(fp,&bad)<0) && (errno==EINVAL));
+  }
+
+  /* epoll 100 times dearer per event than poll() per fd: only fds
+   *  ready nearly every call are worth keeping in the poll tier.
+   */
+  costs.poll_ns=1;
+  costs.epoll_event_ns=100;
+  costs.epoll_ctl_ns=1;
+  CHECK(flexipoll_apply_costs(fp,&costs)==0);
+
+  int fds[2], busy[2];
+  CHECK(pipe(fds)==0);
+  CHECK(pipe(busy)==0);
+  CHECK(write(busy[1],"x",1)==1);
+  CHECK(flexipoll_add_fd(fp,busy[0],POLLIN)==0);
+
+  int dups[NUM_FDS];
+  int i;
+  for (i=0; i<NUM_FDS; i++) {
+    dups[i]=dup(fds[0]);
+    CHECK(dups[i]>=0);
+    CHECK(flexipoll_add_fd(fp,dups[i],POLLIN)==0);
+  }
+
+  /* Recalibrate every 10 calls; keep the idle fds in the poll tier
+   *  long enough to be timed.
+   */
+  CHECK(flexipoll_set_recalibration(fp,10)==0);
+  CHECK(flexipoll_set_migration_budget(fp,1)==0);
+  FlexipollEvent ev;
+  for (i=0; i<30; i++)
+    CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+
+  {
+    FlexipollCosts observed;
+    CHECK(flexipoll_get_costs(fp,&observed)==0);
+    assert(observed.poll_ns!=1); /* recalibrated */
+    assert(observed.poll_ns>0);
+  }
+
+  /* Still, the busy fd stays and the idle ones go. */
+  for (i=0; i<200; i++)
+    CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+  assert(!in_epoll_tier(fp,busy[0]));
+  assert(in_epoll_tier(fp,dups[0]));
+
+  CHECK(flexipoll_set_recalibration(fp,0)==0);
+
+  for (i=0; i<NUM_FDS; i++)
+    close(dups[i]);
+  close(fds[0]);
+  close(fds[1]);
+  close(busy[0]);
+  close(busy[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
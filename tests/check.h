@@ -0,0 +1,29 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <flexipoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* For the tests.  Calls that do the work go in CHECK(), not assert(),
+ *  which NDEBUG would compile out along with them: if cond doesn't
+ *  hold, it says where, perror()s, and exits non-zero.  assert() is
+ *  for checks alone.
+ */
+#define CHECK(cond)                                     \
+  do {                                                  \
+    if (!(cond)) {                                      \
+      fprintf(stderr,"%s:%d: ",__FILE__,__LINE__);     \
+      perror(#cond);                                    \
+      exit(1);                                          \
+    }                                                   \
+  } while (0)
+
+static inline FlexipollStats stats_of(Flexipoll fp)
+{
+  FlexipollStats stats;
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  return stats;
+}
+
+#endif /*_CHECK_H_*/
@@ -0,0 +1,123 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Priority classes: with more fds ready than fit, higher classes come
+ *  first, from either tier, and the rest wait; and an fd of a higher
+ *  class that becomes ready meanwhile goes ahead of those waiting.
+ */
+
+#define NUM_BULK 8
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  FlexipollEvent events[4];
+  int bulk[NUM_BULK][2], high[2][2], mid[2];
+  int N, i;
+
+  CHECK((flexipoll_add_fd_ex(fp,0,POLLIN,
+                             FLEXIPOLL_CLASS(FLEXIPOLL_CLASSES),0)<0)
+        && (errno==EINVAL));
+
+  for (i=0; i<NUM_BULK; i++) {
+    CHECK(pipe(bulk[i])==0);
+    CHECK(flexipoll_add_fd_data(fp,bulk[i][0],POLLIN,bulk[i])==0);
+    CHECK(write(bulk[i][1],"x",1)==1);
+  }
+  CHECK(pipe(high[0])==0);
+  CHECK(pipe(high[1])==0);
+  CHECK(pipe(mid)==0);
+  CHECK(flexipoll_add_fd_ex(fp,high[0][0],POLLIN,
+                            FLEXIPOLL_CLASS(2)|FLEXIPOLL_PIN_POLL,
+                            high[0])==0);
+  CHECK(flexipoll_add_fd_ex(fp,high[1][0],POLLIN,
+                            FLEXIPOLL_CLASS(2)|FLEXIPOLL_PIN_EPOLL,
+                            high[1])==0);
+  CHECK(flexipoll_add_fd_ex(fp,mid[0],POLLIN,FLEXIPOLL_CLASS(1),mid)==0);
+  CHECK(write(high[0][1],"x",1)==1);
+  CHECK(write(high[1][1],"x",1)==1);
+  CHECK(write(mid[1],"x",1)==1);
+
+  /* Both tiers' class 2 first, then class 1, then the bulk. */
+  N=flexipoll_poll_events(fp,events,3,0);
+  assert(N==3);
+  assert((events[0].data==high[0]) || (events[0].data==high[1]));
+  assert((events[1].data==high[0]) || (events[1].data==high[1]));
+  assert(events[0].data!=events[1].data);
+  assert(events[2].data==mid);
+
+  {
+    char c;
+    CHECK(read(high[0][0],&c,1)==1);
+    CHECK(read(high[1][0],&c,1)==1);
+    CHECK(read(mid[0],&c,1)==1);
+  }
+
+  /* Bulk fds are held over; a class 2 fd that becomes ready meanwhile
+   *  still goes first.
+   */
+  N=flexipoll_poll_events(fp,events,2,0);
+  assert(N==2);
+  for (i=0; i<N; i++)
+    assert((events[i].data!=high[0]) && (events[i].data!=mid));
+
+  FlexipollStats before=stats_of(fp);
+  CHECK(write(high[0][1],"x",1)==1);
+  N=flexipoll_poll_events(fp,events,2,0);
+  assert((N==2) && (events[0].data==high[0]));
+  assert(events[1].data!=high[1]);
+  {
+    FlexipollStats after=stats_of(fp);
+    assert(after.urgent_polls==before.urgent_polls+1);
+  }
+  {
+    char c;
+    CHECK(read(high[0][0],&c,1)==1);
+  }
+
+  /* Reclassed, it queues with the rest. */
+  CHECK(flexipoll_add_fd_ex(fp,high[0][0],POLLIN,FLEXIPOLL_PIN_POLL,
+                            high[0])==0);
+  CHECK(write(high[0][1],"x",1)==1);
+  before=stats_of(fp);
+  N=flexipoll_poll_events(fp,events,1,0);
+  assert((N==1) && (events[0].data!=high[0]));
+  assert(stats_of(fp).urgent_polls==before.urgent_polls+1);
+
+  /* Every fd is still reported in the end. */
+  {
+    int seen=0, tries;
+    for (tries=0; (tries<100) && (seen<NUM_BULK+1); tries++) {
+      N=flexipoll_poll_events(fp,events,4,0);
+      for (i=0; i<N; i++) {
+        char c;
+        CHECK(read(events[i].fd,&c,1)==1);
+        seen++;
+      }
+    }
+    assert(seen==NUM_BULK+1);
+    CHECK(flexipoll_poll_events(fp,events,4,0)==0);
+  }
+
+  for (i=0; i<NUM_BULK; i++) {
+    close(bulk[i][0]);
+    close(bulk[i][1]);
+  }
+  for (i=0; i<2; i++) {
+    close(high[i][0]);
+    close(high[i][1]);
+  }
+  close(mid[0]);
+  close(mid[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
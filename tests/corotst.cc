@@ -0,0 +1,166 @@
+#include <flexipoll_coro.hpp>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Coroutines on a Loop: echo servers and their clients ping-ponging
+ *  over socketpairs, a reader and a writer on one fd, and errors.
+ */
+
+#define NUM_PAIRS 50
+#define ROUNDS 200
+
+static int echoed, finished;
+
+static void nonblocking(int fd)
+{
+  CHECK(fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK)==0);
+}
+
+static flexipoll::Task echo(flexipoll::Loop<>& loop, int fd)
+{
+  char buff[64];
+  for (;;) {
+    ssize_t N=read(fd,buff,sizeof(buff));
+    if (N<0) {
+      assert(errno==EAGAIN);
+      co_await loop.readable(fd);
+      continue;
+    }
+    if (!N)
+      break;
+    CHECK(write(fd,buff,N)==N);
+    echoed++;
+  }
+  loop.forget(fd);
+  close(fd);
+}
+
+static flexipoll::Task client(flexipoll::Loop<>& loop, int fd)
+{
+  int i;
+  for (i=0; i<ROUNDS; i++) {
+    char c='a'+(i%26);
+    CHECK(write(fd,&c,1)==1);
+    flexipoll::Events revents=co_await loop.readable(fd);
+    assert(any(revents & flexipoll::Events::in));
+    char got;
+    CHECK(read(fd,&got,1)==1);
+    assert(got==c);
+  }
+  loop.forget(fd);
+  close(fd);
+  finished++;
+}
+
+static flexipoll::Task await_one(flexipoll::Loop<>& loop, int fd,
+                                 bool write_bool, int* done)
+{
+  flexipoll::Events revents=write_bool ? co_await loop.writable(fd)
+                                       : co_await loop.readable(fd);
+  assert(any(revents & (write_bool ? flexipoll::Events::out
+                                   : flexipoll::Events::in)));
+  (*done)++;
+}
+
+static flexipoll::Task await_twice(flexipoll::Loop<>& loop, int fd,
+                                   int* errno_seen)
+{
+  try {
+    co_await loop.readable(fd);
+  }
+  catch (const std::system_error& err) {
+    *errno_seen=err.code().value();
+  }
+}
+
+int main(int argc, const char* argv[])
+{
+  flexipoll::Loop<> loop;
+
+  int i;
+  for (i=0; i<NUM_PAIRS; i++) {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+    nonblocking(sv[0]);
+    nonblocking(sv[1]);
+    echo(loop,sv[0]);
+    client(loop,sv[1]);
+  }
+  assert(loop.parked()==2*NUM_PAIRS);
+  /* Each client's write is already waiting for its echo server. */
+  loop.run_once(0);
+  while (finished<NUM_PAIRS)
+    loop.run_once(-1);
+  assert(echoed==NUM_PAIRS*ROUNDS);
+  loop.run(); /* the echo servers see EOF */
+  assert(loop.parked()==0);
+
+  {
+    FlexipollStats stats;
+    CHECK(flexipoll_get_stats(loop.native_handle(),&stats)==0);
+    assert(stats.calls>0);
+  }
+
+  /* A reader and a writer on one fd, and a second reader refused. */
+  {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+    nonblocking(sv[0]);
+    int read_done=0, write_done=0, errno_seen=0;
+    await_one(loop,sv[0],false,&read_done);
+    await_one(loop,sv[0],true,&write_done);
+    await_twice(loop,sv[0],&errno_seen);
+    assert(errno_seen==EBUSY);
+    assert(loop.parked()==2);
+
+    loop.run_once(0);
+    assert((write_done==1) && (read_done==0));
+    assert(loop.parked()==1);
+    loop.run_once(0);
+    assert(read_done==0);
+
+    try {
+      loop.forget(sv[0]);
+      assert(!"no exception");
+    }
+    catch (const std::system_error& err) {
+      assert(err.code().value()==EBUSY);
+    }
+
+    CHECK(write(sv[1],"x",1)==1);
+    loop.run();
+    assert(read_done==1);
+
+    /* And again, on the same, now disarmed, entry. */
+    await_one(loop,sv[0],false,&read_done);
+    loop.run();
+    assert(read_done==2);
+
+    loop.forget(sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+  }
+
+  /* A Loop going away destroys what's still parked. */
+  {
+    int fds[2], done=0;
+    CHECK(pipe(fds)==0);
+    {
+      flexipoll::Loop<> doomed;
+      await_one(doomed,fds[0],false,&done);
+      assert(doomed.parked()==1);
+    }
+    assert(done==0);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <flexipoll.hpp>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* The C++ wrapper: each policy reports the same ready fds, with their
+ *  data, and errors come out as exceptions.
+ */
+
+struct EagerThresholds {
+  static constexpr float below=0.1f;
+  static constexpr float above=0.2f;
+  static constexpr int half_life=4;
+};
+
+static_assert((flexipoll::Events::in|flexipoll::Events::out)
+              !=flexipoll::Events::in, "events combine");
+static_assert(flexipoll::any(flexipoll::Events::in
+                             &(flexipoll::Events::in|flexipoll::Events::hup)),
+              "events intersect");
+
+template <class Policy>
+static void exercise(const char* name)
+{
+  flexipoll::Poller<Policy> poller(4);
+  int fds[3][2];
+  int i;
+  for (i=0; i<3; i++) {
+    CHECK(pipe(fds[i])==0);
+    poller.add(fds[i][0],flexipoll::Events::in,fds[i]);
+  }
+  assert(poller.size()==3);
+
+  /* Re-adding changes, not duplicates. */
+  poller.add(fds[0][0],flexipoll::Events::in|flexipoll::Events::pri,fds[0]);
+  assert(poller.size()==3);
+
+  CHECK(poller.wait(0).empty());
+
+  CHECK(write(fds[1][1],"x",1)==1);
+  CHECK(write(fds[2][1],"x",1)==1);
+  for (i=0; i<10; i++) {
+    int seen=0;
+    for (flexipoll::Event ev : poller.wait(0)) {
+      assert(!ev.is_timer());
+      assert(any(ev.revents() & flexipoll::Events::in));
+      assert((ev.fd()==fds[1][0]) || (ev.fd()==fds[2][0]));
+      assert(ev.template data<int>()[0]==ev.fd());
+      seen|=(ev.fd()==fds[1][0]) ? 1 : 2;
+    }
+    assert(seen==3);
+  }
+
+  poller.remove(fds[1][0]);
+  poller.remove(fds[1][0]); /* not registered: no error */
+  assert(poller.size()==2);
+  {
+    flexipoll::Ready ready=poller.wait(0);
+    assert(ready.size()==1);
+    assert(ready[0].fd()==fds[2][0]);
+  }
+
+  /* Moving leaves the original empty but destructible. */
+  flexipoll::Poller<Policy> moved(std::move(poller));
+  CHECK(moved.wait(-1).size()==1);
+
+  try {
+    moved.add(-1,flexipoll::Events::in);
+    assert(!"no exception");
+  }
+  catch (const std::system_error& err) {
+    assert(err.code().value()==EBADF);
+  }
+
+  for (i=0; i<3; i++) {
+    moved.remove(fds[i][0]);
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  assert(moved.size()==0);
+  printf("%s ok\n",name);
+}
+
+int main(int argc, const char* argv[])
+{
+  exercise<flexipoll::PollOnly>("PollOnly");
+  exercise<flexipoll::EpollOnly>("EpollOnly");
+  exercise<flexipoll::Adaptive<>>("Adaptive<>");
+  exercise<flexipoll::Adaptive<EagerThresholds>>("Adaptive<EagerThresholds>");
+
+  /* Adaptive passes flags through. */
+  {
+    flexipoll::Poller<flexipoll::Adaptive<EagerThresholds>> poller;
+    int fds[2];
+    CHECK(pipe(fds)==0);
+    CHECK(write(fds[1],"x",1)==1);
+    poller.add(fds[0],flexipoll::Events::in,nullptr,
+               flexipoll::Flags::oneshot|flexipoll::Flags::pin_epoll);
+    FlexipollFdStats stats;
+    CHECK(flexipoll_fd_stats(poller.native_handle(),fds[0],&stats)==0);
+    assert(stats.in_epoll_bool);
+    CHECK(poller.wait(0).size()==1);
+    CHECK(poller.wait(0).empty());
+    poller.rearm(fds[0]);
+    CHECK(poller.wait(0).size()==1);
+
+    try {
+      poller.rearm(fds[1]);
+      assert(!"no exception");
+    }
+    catch (const std::system_error& err) {
+      assert(err.code().value()==EINVAL);
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  /* Adaptive counts fds closed while registered out once they're
+   *  reported, and not again when removed.
+   */
+  {
+    flexipoll::Poller<flexipoll::Adaptive<>> poller;
+    int fds[2][2];
+    for (int i=0; i<2; i++) {
+      CHECK(pipe(fds[i])==0);
+      poller.add(fds[i][0],flexipoll::Events::in);
+    }
+    assert(poller.size()==2);
+
+    close(fds[0][0]);
+    flexipoll::Ready ready=poller.wait(0);
+    assert(ready.size()==1);
+    assert(ready[0].fd()==fds[0][0]);
+    assert(any(ready[0].revents() & flexipoll::Events::nval));
+    assert(poller.size()==1);
+    poller.remove(fds[0][0]);
+    assert(poller.size()==1);
+
+    close(fds[0][1]);
+    close(fds[1][0]);
+    close(fds[1][1]);
+  }
+
+  printf("ok\n");
+  return 0;
+}
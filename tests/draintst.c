@@ -0,0 +1,197 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* The drain stage: pipes read into the slab, datagrams a batch at a
+ *  time with their senders, end of file, fds left undrained, and what
+ *  happens when a read fills its share.
+ */
+
+static void nonblocking(int fd)
+{
+  CHECK(fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK)==0);
+}
+
+/* The chunks for fd among chunks[0..N]. */
+static int count_for(const FlexipollChunk* chunks, int N, int fd)
+{
+  int res=0, i;
+  for (i=0; i<N; i++)
+    if (chunks[i].fd==fd)
+      res++;
+  return res;
+}
+
+static const FlexipollChunk* find(const FlexipollChunk* chunks, int N,
+                                  int fd)
+{
+  int i;
+  for (i=0; i<N; i++)
+    if (chunks[i].fd==fd)
+      return chunks+i;
+  return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  CHECK((flexipoll_set_drain(fp,1024,0)<0) && (errno==EINVAL));
+  CHECK((flexipoll_set_drain(fp,64,64)<0) && (errno==EINVAL));
+  CHECK(flexipoll_set_drain(fp,64*1024,16)==0);
+
+  FlexipollChunk chunks[64];
+  int N;
+
+  /* A pipe, drained; another, only reported. */
+  int drained[2], plain[2];
+  CHECK(pipe(drained)==0);
+  CHECK(pipe(plain)==0);
+  nonblocking(drained[0]);
+  CHECK(flexipoll_add_fd_ex(fp,drained[0],POLLIN,FLEXIPOLL_DRAIN,
+                            drained)==0);
+  CHECK(flexipoll_add_fd_data(fp,plain[0],POLLIN,plain)==0);
+
+  CHECK(write(drained[1],"hello",5)==5);
+  CHECK(write(plain[1],"x",1)==1);
+  N=flexipoll_poll_drain(fp,chunks,64,0);
+  assert(N==2);
+  {
+    const FlexipollChunk* chunk=find(chunks,N,drained[0]);
+    assert(chunk && (chunk->data==drained) && (chunk->revents & POLLIN));
+    assert((chunk->len==5) && !memcmp(chunk->buf,"hello",5));
+    assert(!chunk->error && !chunk->from);
+
+    chunk=find(chunks,N,plain[0]);
+    assert(chunk && (chunk->data==plain) && !chunk->buf);
+  }
+  {
+    char c;
+    CHECK(read(plain[0],&c,1)==1);
+  }
+  CHECK(flexipoll_poll_drain(fp,chunks,64,0)==0);
+
+  /* More than one read's worth: the rest comes next call, even when
+   *  edge-triggered.
+   */
+  CHECK(flexipoll_add_fd_ex(fp,drained[0],POLLIN,
+                            FLEXIPOLL_DRAIN|FLEXIPOLL_EDGE,drained)==0);
+  CHECK(write(drained[1],"0123456789abcdefXYZ",19)==19);
+  N=flexipoll_poll_drain(fp,chunks,64,0);
+  assert((N==1) && (chunks[0].len==16));
+  assert(!memcmp(chunks[0].buf,"0123456789abcdef",16));
+  N=flexipoll_poll_drain(fp,chunks,64,0);
+  assert((N==1) && (chunks[0].len==3) && !memcmp(chunks[0].buf,"XYZ",3));
+  CHECK(flexipoll_poll_drain(fp,chunks,64,0)==0);
+
+  /* End of file. */
+  close(drained[1]);
+  N=flexipoll_poll_drain(fp,chunks,64,0);
+  assert((N==1) && chunks[0].buf && (chunks[0].len==0) && !chunks[0].error);
+  CHECK(flexipoll_remove_fd(fp,drained[0])==0);
+  close(drained[0]);
+
+  /* A blocking pipe, or stream socket, holding just one read's worth:
+   *  the read after finds nothing, and doesn't wait for more.
+   */
+  int socket_bool;
+  for (socket_bool=0; socket_bool<2; socket_bool++) {
+    int blocking[2];
+    CHECK((socket_bool ? socketpair(AF_UNIX,SOCK_STREAM,0,blocking)
+           : pipe(blocking))==0);
+    CHECK(flexipoll_add_fd_ex(fp,blocking[0],POLLIN,FLEXIPOLL_DRAIN,
+                              blocking)==0);
+    CHECK(write(blocking[1],"0123456789abcdef",16)==16);
+    N=flexipoll_poll_drain(fp,chunks,64,0);
+    assert((N==1) && (chunks[0].len==16) && !chunks[0].error);
+    CHECK(flexipoll_poll_drain(fp,chunks,64,100)==0);
+    CHECK(write(blocking[1],"x",1)==1);
+    N=flexipoll_poll_drain(fp,chunks,64,100);
+    assert((N==1) && (chunks[0].len==1) && (chunks[0].buf[0]=='x'));
+    CHECK(flexipoll_remove_fd(fp,blocking[0])==0);
+    close(blocking[0]);
+    close(blocking[1]);
+  }
+
+  /* Datagrams, a batch at a time, and one too big. */
+  int rx=socket(AF_INET,SOCK_DGRAM,0), tx=socket(AF_INET,SOCK_DGRAM,0);
+  CHECK((rx>=0) && (tx>=0));
+  struct sockaddr_in addr;
+  socklen_t addrlen=sizeof(addr);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  CHECK(bind(rx,(struct sockaddr*)(&addr),sizeof(addr))==0);
+  CHECK(getsockname(rx,(struct sockaddr*)(&addr),&addrlen)==0);
+  CHECK(flexipoll_add_fd_ex(fp,rx,POLLIN,FLEXIPOLL_DRAIN,0)==0);
+
+  int i;
+  for (i=0; i<10; i++) {
+    char msg[8];
+    int len=snprintf(msg,sizeof(msg),"m%d",i);
+    CHECK(sendto(tx,msg,len,0,(struct sockaddr*)(&addr),sizeof(addr))==len);
+  }
+  CHECK(sendto(tx,"0123456789abcdefXYZ",19,0,(struct sockaddr*)(&addr),
+               sizeof(addr))==19);
+
+  {
+    FlexipollStats before, after;
+    CHECK(flexipoll_get_stats(fp,&before)==0);
+    N=flexipoll_poll_drain(fp,chunks,64,0);
+    CHECK(flexipoll_get_stats(fp,&after)==0);
+    assert(after.drain_reads==before.drain_reads+1);
+  }
+  assert(N==11);
+  assert(count_for(chunks,N,rx)==11);
+  for (i=0; i<10; i++) {
+    char msg[8];
+    int len=snprintf(msg,sizeof(msg),"m%d",i);
+    assert((chunks[i].len==len) && !memcmp(chunks[i].buf,msg,len));
+    assert(!chunks[i].error);
+    assert(chunks[i].fromlen==sizeof(struct sockaddr_in));
+    assert(chunks[i].from->sa_family==AF_INET);
+  }
+  assert((chunks[10].error==EMSGSIZE) && (chunks[10].len==16));
+
+  /* Fewer chunks than datagrams: the rest come next call. */
+  for (i=0; i<5; i++)
+    CHECK(sendto(tx,"d",1,0,(struct sockaddr*)(&addr),sizeof(addr))==1);
+  CHECK(flexipoll_poll_drain(fp,chunks,3,0)==3);
+  CHECK(flexipoll_poll_drain(fp,chunks,3,0)==2);
+  CHECK(flexipoll_poll_drain(fp,chunks,3,0)==0);
+
+  CHECK(flexipoll_remove_fd(fp,rx)==0);
+  CHECK(flexipoll_remove_fd(fp,plain[0])==0);
+  close(rx);
+  close(tx);
+  close(plain[0]);
+  close(plain[1]);
+
+  /* A timer still comes through. */
+  {
+    FlexipollTimer timer=flexipoll_timer_new(fp,&fp);
+    CHECK(timer);
+    CHECK(flexipoll_timer_arm(timer,1)==0);
+    while (!(N=flexipoll_poll_drain(fp,chunks,64,100)))
+      ;
+    assert((N==1) && (chunks[0].fd==-1) && (chunks[0].data==&fp));
+    flexipoll_timer_delete(timer);
+  }
+
+  CHECK((flexipoll_poll_drain(fp,0,64,0)<0) && (errno==EFAULT));
+  CHECK((flexipoll_poll_drain(fp,chunks,0,0)<0) && (errno==EINVAL));
+
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* flexipoll_fd(): readable just while there's something to report,
+ *  from either tier, held over, from a timer or a wakeup; edge-
+ *  triggered and oneshot fds in the poll tier; and with io_uring.
+ */
+
+static int readable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd=fd;
+  pfd.events=POLLIN;
+  pfd.revents=0;
+  CHECK(poll(&pfd,1,0)>=0);
+  return (pfd.revents & POLLIN)!=0;
+}
+
+static void consume(int fd)
+{
+  char c;
+  CHECK(read(fd,&c,1)==1);
+}
+
+/* A pipe in each tier, each in turn. */
+static void both_tiers(Flexipoll fp, int embed_fd)
+{
+  int in_poll[2], in_epoll[2], fds[4];
+  CHECK(pipe(in_poll)==0);
+  CHECK(pipe(in_epoll)==0);
+  CHECK(flexipoll_add_fd_ex(fp,in_poll[0],POLLIN,FLEXIPOLL_PIN_POLL,0)==0);
+  CHECK(flexipoll_add_fd_ex(fp,in_epoll[0],POLLIN,FLEXIPOLL_PIN_EPOLL,
+                            0)==0);
+  /* io_uring leaves registering to the next call. */
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+  assert(!readable(embed_fd));
+
+  CHECK(write(in_poll[1],"x",1)==1);
+  assert(readable(embed_fd));
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==1);
+  assert(fds[0]==in_poll[0]);
+  consume(in_poll[0]);
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+  assert(!readable(embed_fd));
+
+  CHECK(write(in_epoll[1],"x",1)==1);
+  assert(readable(embed_fd));
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==1);
+  assert(fds[0]==in_epoll[0]);
+  consume(in_epoll[0]);
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+  assert(!readable(embed_fd));
+
+  CHECK(flexipoll_remove_fd(fp,in_poll[0])==0);
+  CHECK(flexipoll_remove_fd(fp,in_epoll[0])==0);
+  close(in_poll[0]);
+  close(in_poll[1]);
+  close(in_epoll[0]);
+  close(in_epoll[1]);
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+  CHECK((flexipoll_fd(0)<0) && (errno==EFAULT));
+
+  int embed_fd=flexipoll_fd(fp);
+  CHECK(embed_fd>=0);
+  CHECK(flexipoll_fd(fp)==embed_fd);
+  assert(!readable(embed_fd));
+
+  int fds[4];
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+
+  both_tiers(fp,embed_fd);
+
+  /* Edge-triggered in the poll tier: more than fit are held over, and
+   *  once both are out, the data still there doesn't count.
+   */
+  {
+    int a[2], b[2];
+    CHECK(pipe(a)==0);
+    CHECK(pipe(b)==0);
+    CHECK(flexipoll_add_fd_ex(fp,a[0],POLLIN,
+                              FLEXIPOLL_EDGE|FLEXIPOLL_PIN_POLL,0)==0);
+    CHECK(flexipoll_add_fd_ex(fp,b[0],POLLIN,
+                              FLEXIPOLL_EDGE|FLEXIPOLL_PIN_POLL,0)==0);
+    CHECK(write(a[1],"x",1)==1);
+    CHECK(write(b[1],"x",1)==1);
+    assert(readable(embed_fd));
+    CHECK(flexipoll_poll_nowait(fp,fds,1)==1);
+    assert(readable(embed_fd));
+    CHECK(flexipoll_poll_nowait(fp,fds,1)==1);
+    CHECK(flexipoll_poll_nowait(fp,fds,1)==0);
+    assert(!readable(embed_fd));
+
+    consume(a[0]);
+    CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+    CHECK(write(a[1],"x",1)==1);
+    assert(readable(embed_fd));
+    CHECK(flexipoll_poll_nowait(fp,fds,4)==1);
+    assert(fds[0]==a[0]);
+    assert(!readable(embed_fd));
+
+    CHECK(flexipoll_remove_fd(fp,a[0])==0);
+    CHECK(flexipoll_remove_fd(fp,b[0])==0);
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+  }
+
+  /* Oneshot in the poll tier: out until rearmed. */
+  {
+    int a[2];
+    CHECK(pipe(a)==0);
+    CHECK(flexipoll_add_fd_ex(fp,a[0],POLLIN,
+                              FLEXIPOLL_ONESHOT|FLEXIPOLL_PIN_POLL,0)==0);
+    CHECK(write(a[1],"x",1)==1);
+    CHECK(flexipoll_poll_nowait(fp,fds,4)==1);
+    assert(!readable(embed_fd));
+    CHECK(flexipoll_rearm(fp,a[0])==0);
+    assert(readable(embed_fd));
+    CHECK(flexipoll_poll_nowait(fp,fds,4)==1);
+    CHECK(flexipoll_remove_fd(fp,a[0])==0);
+    close(a[0]);
+    close(a[1]);
+  }
+
+  /* A timer. */
+  {
+    FlexipollTimer timer=flexipoll_timer_new(fp,&fp);
+    FlexipollEvent events[4];
+    struct pollfd pfd;
+    CHECK(timer);
+    CHECK(flexipoll_timer_arm(timer,20)==0);
+    assert(!readable(embed_fd));
+    pfd.fd=embed_fd;
+    pfd.events=POLLIN;
+    CHECK(poll(&pfd,1,1000)==1);
+    CHECK(flexipoll_poll_events(fp,events,4,0)==1);
+    assert((events[0].fd==-1) && (events[0].data==&fp));
+    assert(!readable(embed_fd));
+    flexipoll_timer_delete(timer);
+  }
+
+  /* A wakeup. */
+  CHECK(flexipoll_wakeup(fp)==0);
+  assert(readable(embed_fd));
+  CHECK(flexipoll_poll_nowait(fp,fds,4)==0);
+  assert(!readable(embed_fd));
+
+  flexipoll_delete(fp);
+
+  /* io_uring, if it's there, asked for after the fact. */
+  fp=flexipoll_new();
+  CHECK(fp);
+  embed_fd=flexipoll_fd(fp);
+  CHECK(embed_fd>=0);
+  if (flexipoll_use_io_uring(fp)==0) {
+    assert(!readable(embed_fd));
+    both_tiers(fp,embed_fd);
+  }
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
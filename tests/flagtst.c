@@ -0,0 +1,116 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Runs the FLEXIPOLL_EDGE and FLEXIPOLL_ONESHOT checks with every fd
+ *  kept in the poll tier, then with every fd moved to epoll.
+ */
+
+static int poll_once(Flexipoll fp, FlexipollEvent* ev)
+{
+  int N=flexipoll_poll_events(fp,ev,1,0);
+  if (N<0) {
+    perror("flexipoll_poll_events");
+    _exit(1);
+  }
+  return N;
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+static void drain(int fd)
+{
+  char buff[64];
+  CHECK(read(fd,buff,sizeof(buff))>0);
+}
+
+static void check(float below, float above)
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+  CHECK(flexipoll_set_thresholds(fp,below,above)==0);
+  CHECK(flexipoll_set_migration_budget(fp,0)==0);
+
+  int edge[2], oneshot[2];
+  CHECK(pipe(edge)==0);
+  CHECK(pipe(oneshot)==0);
+
+  CHECK(flexipoll_add_fd_ex(fp,edge[0],POLLIN,FLEXIPOLL_EDGE,edge)==0);
+  CHECK(flexipoll_add_fd_ex(fp,oneshot[0],POLLIN,FLEXIPOLL_ONESHOT,
+                            oneshot)==0);
+
+  FlexipollEvent ev;
+
+  /* Let the fds settle into their tier; migrations only happen on
+   *  calls that find something.
+   */
+  {
+    int i;
+    CHECK(write(edge[1],"x",1)==1);
+    for (i=0; i<4; i++)
+      poll_once(fp,&ev);
+    drain(edge[0]);
+    poll_once(fp,&ev);
+  }
+
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert((ev.fd==edge[0]) && (ev.data==edge) && (ev.revents & POLLIN));
+  CHECK(poll_once(fp,&ev)==0);
+
+  /* Still readable, but reported already: no reason not to block, and
+   *  nothing to report after, until a wakeup.
+   */
+  {
+    unsigned long long polls=stats_of(fp).poll_calls;
+    long start=now_ms();
+    CHECK(flexipoll_poll_events(fp,&ev,1,100)==0);
+    assert(now_ms()-start>=90);
+    assert(stats_of(fp).poll_calls-polls<=2);
+    CHECK(poll_once(fp,&ev)==0);
+    CHECK(flexipoll_wakeup(fp)==0);
+    int fd;
+    CHECK(flexipoll_poll(fp,&fd,1)==0);
+  }
+  drain(edge[0]);
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==edge[0]);
+  drain(edge[0]);
+
+  CHECK(write(oneshot[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert((ev.fd==oneshot[0]) && (ev.data==oneshot));
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(flexipoll_rearm(fp,oneshot[0])==0);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==oneshot[0]);
+  drain(oneshot[0]);
+  CHECK(flexipoll_rearm(fp,oneshot[0])==0);
+  CHECK(poll_once(fp,&ev)==0);
+
+  close(edge[0]);
+  close(edge[1]);
+  close(oneshot[0]);
+  close(oneshot[1]);
+  flexipoll_delete(fp);
+}
+
+int main(int argc, const char* argv[])
+{
+  check(0,0); /* nothing ever leaves the poll tier */
+  check(1,1); /* everything goes to epoll, and stays there */
+
+  printf("ok\n");
+  return 0;
+}
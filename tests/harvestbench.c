@@ -0,0 +1,105 @@
+/* harvestbench.c
+ *	What flexipoll spends per poll-tier fd per call, outside poll()
+ *	itself: reading back revents, updating activity, deciding what
+ *	to migrate.
+ *
+ * Registers num_fds fds, all kept in the poll tier, of which one in
+ *  100 is always readable; each is a dup() of one of two pipes, so it
+ *  costs one fd.  Timing is on, so the time blocked in poll() can be
+ *  subtracted out.
+ */
+#include <flexipoll.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)(ts.tv_sec))*1000000000+ts.tv_nsec;
+}
+
+int main(int argc, const char* argv[])
+{
+  int num_fds=(argc>1) ? atoi(argv[1]) : 10000;
+  int num_calls=(argc>2) ? atoi(argv[2]) : 2000;
+
+  if ((argc>3) || (num_fds<1) || (num_calls<1)) {
+    fprintf(stderr,"usage: harvestbench [num fds [num calls]]\n");
+    return 2;
+  }
+
+  {
+    struct rlimit fdlimit;
+    if (getrlimit(RLIMIT_NOFILE,&fdlimit)==0) {
+      fdlimit.rlim_cur=fdlimit.rlim_max;
+      setrlimit(RLIMIT_NOFILE,&fdlimit);
+    }
+  }
+
+  Flexipoll fp=flexipoll_new();
+  if (!fp) {
+    perror("flexipoll_new");
+    return 1;
+  }
+  flexipoll_set_thresholds(fp,0,1); /* nothing changes tiers */
+  flexipoll_set_timing(fp,1);
+
+  int idle[2], busy[2];
+  if ((pipe(idle)<0) || (pipe(busy)<0)) {
+    perror("pipe");
+    return 1;
+  }
+  if (write(busy[1],"x",1)!=1) {
+    perror("write");
+    return 1;
+  }
+
+  int i;
+  for (i=0; i<num_fds; i++) {
+    int fd=dup((i%100) ? idle[0] : busy[0]);
+    if (fd<0) {
+      perror("dup");
+      return 1;
+    }
+    if (flexipoll_add_fd(fp,fd,POLLIN)<0) {
+      perror("flexipoll_add_fd");
+      return 1;
+    }
+  }
+
+  FlexipollEvent* evs=(FlexipollEvent*)(malloc(sizeof(FlexipollEvent)
+                                               *num_fds));
+  if (!evs) {
+    perror("malloc");
+    return 1;
+  }
+
+  /* Warm up, then measure. */
+  for (i=0; i<num_calls/10; i++)
+    flexipoll_poll_events(fp,evs,num_fds,0);
+  flexipoll_reset_stats(fp);
+
+  unsigned long long start=now_ns();
+  for (i=0; i<num_calls; i++)
+    if (flexipoll_poll_events(fp,evs,num_fds,0)<=0) {
+      perror("flexipoll_poll_events");
+      return 1;
+    }
+  unsigned long long total=now_ns()-start;
+
+  FlexipollStats stats;
+  flexipoll_get_stats(fp,&stats);
+
+  double per_fd=(double)(total-stats.poll_ns)/num_calls/num_fds;
+  printf("%d fds, %d calls: %.2f ns/fd/call outside poll(),"
+         " %.2f ns/fd/call in it\n",
+         num_fds,num_calls,per_fd,(double)(stats.poll_ns)/num_calls/num_fds);
+
+  flexipoll_delete(fp);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Registration hints: starting tiers, priors and pins. */
+
+static int in_epoll_tier(Flexipoll fp, int fd)
+{
+  FlexipollFdStats stats;
+  CHECK(flexipoll_fd_stats(fp,fd,&stats)==0);
+  return stats.in_epoll_bool;
+}
+
+static float activity(Flexipoll fp, int fd)
+{
+  FlexipollFdStats stats;
+  CHECK(flexipoll_fd_stats(fp,fd,&stats)==0);
+  return stats.activity;
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+  CHECK(flexipoll_set_migration_budget(fp,0)==0);
+
+  int plain[2], idle[2], busy[2], hot[2], cold[2];
+  CHECK(pipe(plain)==0);
+  CHECK(pipe(idle)==0);
+  CHECK(pipe(busy)==0);
+  CHECK(pipe(hot)==0);
+  CHECK(pipe(cold)==0);
+
+  /* Contradictions and out-of-range priors. */
+  CHECK((flexipoll_add_fd_ex(fp,plain[0],POLLIN,
+                             FLEXIPOLL_PIN_POLL|FLEXIPOLL_START_EPOLL,0)<0)
+        && (errno==EINVAL));
+  CHECK((flexipoll_add_fd_ex(fp,plain[0],POLLIN,
+                             FLEXIPOLL_PIN_POLL|FLEXIPOLL_PIN_EPOLL,0)<0)
+        && (errno==EINVAL));
+  CHECK((flexipoll_add_fd_ex(fp,plain[0],POLLIN,FLEXIPOLL_PRIOR(101),0)<0)
+        && (errno==EINVAL));
+  CHECK((flexipoll_post_add_fd(fp,plain[0],POLLIN,FLEXIPOLL_PRIOR(200),0)<0)
+        && (errno==EINVAL));
+
+  /* Where each starts. */
+  CHECK(flexipoll_add_fd(fp,plain[0],POLLIN)==0);
+  assert(!in_epoll_tier(fp,plain[0]));
+  CHECK(flexipoll_add_fd_ex(fp,idle[0],POLLIN,FLEXIPOLL_PRIOR(5),0)==0);
+  assert(in_epoll_tier(fp,idle[0]));
+  assert((activity(fp,idle[0])>0.04) && (activity(fp,idle[0])<0.06));
+  CHECK(flexipoll_add_fd_ex(fp,busy[0],POLLIN,FLEXIPOLL_START_EPOLL,0)==0);
+  assert(in_epoll_tier(fp,busy[0]));
+  assert(activity(fp,busy[0])==0);
+  CHECK(flexipoll_add_fd_ex(fp,hot[0],POLLIN,
+                            FLEXIPOLL_PIN_POLL|FLEXIPOLL_PRIOR(0),0)==0);
+  assert(!in_epoll_tier(fp,hot[0]));
+  CHECK(flexipoll_add_fd_ex(fp,cold[0],POLLIN,
+                            FLEXIPOLL_PIN_EPOLL|FLEXIPOLL_PRIOR(100),0)==0);
+  assert(in_epoll_tier(fp,cold[0]));
+
+  /* busy is ready every call, cold too, hot never; only busy moves. */
+  CHECK(write(busy[1],"x",1)==1);
+  CHECK(write(cold[1],"x",1)==1);
+  FlexipollEvent evs[8];
+  int i;
+  for (i=0; i<200; i++)
+    CHECK(flexipoll_poll_events(fp,evs,8,0)==2);
+  assert(!in_epoll_tier(fp,busy[0]));
+  assert(in_epoll_tier(fp,cold[0]));
+  assert(activity(fp,cold[0])>0.9);
+  assert(!in_epoll_tier(fp,hot[0]));
+  assert(activity(fp,hot[0])<0.01);
+  assert(in_epoll_tier(fp,plain[0])); /* idle, so it went */
+
+  /* Pinning a registered fd moves it now; unpinning lets it go. */
+  CHECK(flexipoll_add_fd_ex(fp,cold[0],POLLIN,FLEXIPOLL_PIN_POLL,0)==0);
+  assert(!in_epoll_tier(fp,cold[0]));
+  CHECK(flexipoll_add_fd_ex(fp,hot[0],POLLIN,0,0)==0);
+  CHECK(write(busy[1],"x",1)==1);
+  for (i=0; i<2; i++)
+    CHECK(flexipoll_poll_events(fp,evs,8,0)==2);
+  assert(in_epoll_tier(fp,hot[0]));
+  for (i=0; i<2; i++)
+    CHECK(flexipoll_poll_events(fp,evs,8,0)==2);
+  assert(!in_epoll_tier(fp,cold[0]));
+
+  for (i=0; i<2; i++) {
+    close(plain[i]);
+    close(idle[i]);
+    close(busy[i]);
+    close(hot[i]);
+    close(cold[i]);
+  }
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
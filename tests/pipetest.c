@@ -40,16 +40,19 @@ enum {
 	MODE_POLL,
 	MODE_SYS_EPOLL,
 	MODE_FLEXIPOLL,
-        MODE_KEVENT_POLL
+	MODE_FLEXIPOLL_URING
 } mode = MODE_POLL;
 
 const char *modes[] = {
 	"poll",
 	"sys-epoll",
         "flexipoll",
+        "flexipoll-uring",
 };
 
 int gnuplot = 0;
+int calibrate = 0;
+int drain = 0;
 
 int epoll_fd = -1;
 int done;
@@ -185,16 +188,9 @@ void process_token(int fd, struct token *toke, int nr)
 	}
 }
 
-void read_and_process_token(int fd)
+void process_tokens(int fd, char *buf, int nr)
 {
-	//char buf[BUFSIZE];
 	struct token *toke;
-	struct fdinfo *inf = &fdinfo[fd];
-	char *buf = inf->buf;
-	int nr;
-	nr = read(fd, buf, BUFSIZE);
-	if (-1 == nr)
-		pexit("read");
 	/* kludge: works around epoll edge notification bug */
 	toke = (struct token *)buf;
 	while (nr >= BUFSIZE) {
@@ -205,6 +201,18 @@ void read_and_process_token(int fd)
 	assert(nr == 0);
 }
 
+void read_and_process_token(int fd)
+{
+	//char buf[BUFSIZE];
+	struct fdinfo *inf = &fdinfo[fd];
+	char *buf = inf->buf;
+	int nr;
+	nr = read(fd, buf, BUFSIZE);
+	if (-1 == nr)
+		pexit("read");
+	process_tokens(fd, buf, nr);
+}
+
 
 void makeapipe(int idx)
 {
@@ -247,9 +255,10 @@ void makeapipe(int idx)
 			pexit("epoll_ctl");
 	}
 
-	if (mode == MODE_FLEXIPOLL) {
-          if (flexipoll_add_fd(fp,fds[READ],POLLIN)<0) {
-            pexit("flexipoll_add_fd");
+	if (mode == MODE_FLEXIPOLL || mode == MODE_FLEXIPOLL_URING) {
+          if (flexipoll_add_fd_ex(fp,fds[READ],POLLIN,
+                                  drain ? FLEXIPOLL_DRAIN : 0,0)<0) {
+            pexit("flexipoll_add_fd_ex");
           }
 	}
 
@@ -321,6 +330,35 @@ void flexipoll_main_loop(void)
   }
 }
 
+/* As flexipoll_main_loop(), with flexipoll doing the reads. */
+void flexipoll_drain_main_loop(void)
+{
+  FlexipollChunk chunks[1024];
+  const int max_chunks=sizeof(chunks)/sizeof(chunks[0]);
+
+  int res;
+  int pass=1;
+  while (!done) {
+    send_pending_tokes();
+    res = flexipoll_poll_drain(fp,chunks,max_chunks,-1);
+    if (res < 0) {
+      fprintf(stderr,"Failure on pass %d\n",pass);
+      pexit("flexipoll_poll_drain");
+    }
+
+    int i;
+    for (i=0; i<res; i++) {
+      if (chunks[i].error) {
+        errno=chunks[i].error;
+        pexit("read");
+      }
+      if (chunks[i].buf)
+        process_tokens(chunks[i].fd,chunks[i].buf,chunks[i].len);
+    }
+    pass++;
+  }
+}
+
 void sys_epoll_setup(void)
 {
 	epoll_fd = epoll_create(MAX_FDS);
@@ -377,20 +415,26 @@ int main(int argc, char *argv[])
 			mode = MODE_SYS_EPOLL;
 		} else if (0 == strcmp(argv[1], "--flexipoll")) {
 			mode = MODE_FLEXIPOLL;
+		} else if (0 == strcmp(argv[1], "--flexipoll-uring")) {
+			mode = MODE_FLEXIPOLL_URING;
 		} else if (0 == strcmp(argv[1], "--bufsize")) {
 			argv++,argc--;
 			BUFSIZE = atoi(argv[1]);
 			assert(BUFSIZE > (int)sizeof(struct token));
 		} else if (0 == strcmp(argv[1], "--gnuplot")) {
 			gnuplot = 1;
+		} else if (0 == strcmp(argv[1], "--calibrate")) {
+			calibrate = 1;
+		} else if (0 == strcmp(argv[1], "--drain")) {
+			drain = 1;
 		} else
 			break;
 		argv++,argc--;
 	}
 
 	if (argc != 4) {
-		fprintf(stderr, "usage: pipetest [--poll | --sys-epoll | --flexipoll]\n"
-            "\t[--bufsize] <num pipes> <message threads> <max generation>\n");
+		fprintf(stderr, "usage: pipetest [--poll | --sys-epoll | --flexipoll | --flexipoll-uring]\n"
+            "\t[--bufsize] [--calibrate] [--drain] <num pipes> <message threads> <max generation>\n");
 		return 2;
 	}
 
@@ -421,6 +465,20 @@ int main(int argc, char *argv[])
 	if (mode == MODE_SYS_EPOLL)
 		sys_epoll_setup();
 
+	if (mode == MODE_FLEXIPOLL_URING && flexipoll_use_io_uring(fp) < 0)
+		pexit("flexipoll_use_io_uring");
+
+	if (calibrate) {
+		FlexipollCosts costs;
+		if (flexipoll_measure_costs(&costs) < 0)
+			pexit("flexipoll_measure_costs");
+		if (flexipoll_apply_costs(fp, &costs) < 0)
+			pexit("flexipoll_apply_costs");
+	}
+
+	if (drain && flexipoll_set_drain(fp, 64*1024, BUFSIZE) < 0)
+		pexit("flexipoll_set_drain");
+
 	makepipes(nr);
 
 	/* epoll and poll both have their startup overhead in 
@@ -441,7 +499,9 @@ int main(int argc, char *argv[])
 	if (mode == MODE_SYS_EPOLL)
 		sys_epoll_main_loop();
 
-	if (mode == MODE_FLEXIPOLL)
+	if ((mode == MODE_FLEXIPOLL || mode == MODE_FLEXIPOLL_URING) && drain)
+		flexipoll_drain_main_loop();
+	else if (mode == MODE_FLEXIPOLL || mode == MODE_FLEXIPOLL_URING)
 		flexipoll_main_loop();
 
 	gettimeofday(&etv, NULL);
@@ -0,0 +1,91 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Another thread registers pipes with the poller, writes to them and
+ *  unregisters them, while the main thread sits in
+ *  flexipoll_poll_events() with no timeout.
+ */
+
+#define NUM_PIPES 200
+
+static Flexipoll fp;
+static int pipes[NUM_PIPES][2];
+static volatile int seen[NUM_PIPES];
+
+static void* poster(void* arg)
+{
+  int i;
+  for (i=0; i<NUM_PIPES; i++) {
+    CHECK(flexipoll_post_add_fd(fp,pipes[i][0],POLLIN,FLEXIPOLL_ONESHOT,
+                                pipes[i])==0);
+    CHECK(write(pipes[i][1],"x",1)==1);
+  }
+  return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+  fp=flexipoll_new();
+  CHECK(fp);
+
+  CHECK(flexipoll_post_add_fd(0,0,POLLIN,0,0)<0);
+  CHECK(flexipoll_post_add_fd(fp,-1,POLLIN,0,0)<0);
+  CHECK(flexipoll_post_remove_fd(fp,-1)<0);
+
+  int i;
+  for (i=0; i<NUM_PIPES; i++)
+    CHECK(pipe(pipes[i])==0);
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread,0,poster,0)==0);
+
+  int remaining=NUM_PIPES;
+  while (remaining) {
+    FlexipollEvent evs[16];
+    int N=flexipoll_poll_events(fp,evs,sizeof(evs)/sizeof(evs[0]),-1);
+    CHECK(N>=0);
+
+    int j;
+    for (j=0; j<N; j++) {
+      int k=((int(*)[2])(evs[j].data))-pipes;
+      assert((k>=0) && (k<NUM_PIPES));
+      assert(evs[j].fd==pipes[k][0]);
+      assert(!seen[k]); /* one-shot */
+      seen[k]=1;
+      remaining--;
+    }
+  }
+
+  CHECK(pthread_join(thread,0)==0);
+
+  /* A bare wakeup makes a blocked poll come back empty-handed. */
+  {
+    FlexipollEvent ev;
+    CHECK(flexipoll_wakeup(fp)==0);
+    CHECK(flexipoll_poll_events(fp,&ev,1,-1)==0);
+  }
+
+  /* Posted removals take effect on the next call. */
+  for (i=0; i<NUM_PIPES; i++) {
+    CHECK(flexipoll_post_rearm(fp,pipes[i][0])==0);
+    CHECK(flexipoll_post_remove_fd(fp,pipes[i][0])==0);
+  }
+  {
+    FlexipollEvent ev;
+    CHECK(flexipoll_poll_events(fp,&ev,1,50)==0);
+  }
+
+  for (i=0; i<NUM_PIPES; i++) {
+    close(pipes[i][0]);
+    close(pipes[i][1]);
+  }
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* More fds ready than the caller has room for: the rest must come
+ *  out on later calls, each exactly once, from both tiers, without
+ *  another trip to the kernel.
+ */
+
+#define PER_TIER 4
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  int epolled[PER_TIER][2], polled[PER_TIER][2];
+  FlexipollEvent ev;
+  int i;
+
+  /* Send the first lot to epoll... */
+  CHECK(flexipoll_set_thresholds(fp,1,1)==0);
+  for (i=0; i<PER_TIER; i++) {
+    CHECK(pipe(epolled[i])==0);
+    CHECK(flexipoll_add_fd_data(fp,epolled[i][0],POLLIN,epolled[i])==0);
+    CHECK(write(epolled[i][1],"x",1)==1);
+  }
+  for (i=0; i<4*PER_TIER; i++)
+    CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+  for (i=0; i<PER_TIER; i++) {
+    FlexipollFdStats stats;
+    CHECK(flexipoll_fd_stats(fp,epolled[i][0],&stats)==0);
+    assert(stats.in_epoll_bool);
+  }
+
+  /* ... and keep the second lot in the poll tier. */
+  CHECK(flexipoll_set_thresholds(fp,0,1)==0);
+  for (i=0; i<PER_TIER; i++) {
+    CHECK(pipe(polled[i])==0);
+    CHECK(flexipoll_add_fd_data(fp,polled[i][0],POLLIN,polled[i])==0);
+    CHECK(write(polled[i][1],"x",1)==1);
+  }
+
+  CHECK(flexipoll_reset_stats(fp)==0);
+
+  int seen_epolled=0, seen_polled=0;
+  for (i=0; i<2*PER_TIER; i++) {
+    CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+    int j;
+    for (j=0; j<PER_TIER; j++) {
+      if (ev.data==epolled[j]) {
+        assert(!(seen_epolled & (1<<j)));
+        seen_epolled|=1<<j;
+      } else if (ev.data==polled[j]) {
+        assert(!(seen_polled & (1<<j)));
+        seen_polled|=1<<j;
+      }
+    }
+  }
+  assert(seen_epolled==(1<<PER_TIER)-1);
+  assert(seen_polled==(1<<PER_TIER)-1);
+
+  {
+    FlexipollStats stats;
+    CHECK(flexipoll_get_stats(fp,&stats)==0);
+    assert(stats.poll_calls==1);
+    assert(stats.epoll_wait_calls==1);
+    assert(stats.events==2*PER_TIER);
+  }
+
+  /* A held-over fd that's removed isn't reported. */
+  CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+  {
+    FlexipollEvent next;
+    int fd=(ev.data==epolled[0]) ? epolled[1][0] : epolled[0][0];
+    int first=ev.fd;
+    CHECK(flexipoll_remove_fd(fp,fd)==0);
+    for (i=0; i<2*PER_TIER-2; i++) {
+      CHECK(flexipoll_poll_events(fp,&next,1,0)==1);
+      assert((next.fd!=fd) && (next.fd!=first));
+    }
+  }
+
+  for (i=0; i<PER_TIER; i++) {
+    close(epolled[i][0]);
+    close(epolled[i][1]);
+    close(polled[i][0]);
+    close(polled[i][1]);
+  }
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,145 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* Fds closed while registered: reported once with POLLNVAL and then
+ *  unregistered, from either tier; an fd number reused while epoll
+ *  still watches the old file; and removal of fds waiting to be
+ *  reported.
+ */
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  FlexipollEvent events[8];
+  int N, i;
+
+  /* The poll tier: poll() says so at once. */
+  {
+    int fds[2];
+    CHECK(pipe(fds)==0);
+    CHECK(flexipoll_add_fd_ex(fp,fds[0],POLLIN,FLEXIPOLL_PIN_POLL,fds)==0);
+    close(fds[0]);
+    N=flexipoll_poll_events(fp,events,8,0);
+    assert((N==1) && (events[0].fd==fds[0]) && (events[0].data==fds));
+    assert(events[0].revents & POLLNVAL);
+    assert(flexipoll_events(fp,fds[0])==POLLNVAL);
+
+    FlexipollStats stats=stats_of(fp);
+    assert((stats.retired==1) && (stats.poll_tier_fds==0));
+    CHECK(flexipoll_poll_events(fp,events,8,0)==0);
+    CHECK(flexipoll_remove_fd(fp,fds[0])==0);
+    close(fds[1]);
+  }
+
+  /* The epoll tier: found in time, while something else keeps the
+   *  calls coming.
+   */
+  {
+    int busy[2], fds[2];
+    CHECK(pipe(busy)==0);
+    CHECK(pipe(fds)==0);
+    CHECK(flexipoll_add_fd_ex(fp,busy[0],POLLIN,FLEXIPOLL_PIN_POLL,0)==0);
+    CHECK(flexipoll_add_fd_ex(fp,fds[0],POLLIN,FLEXIPOLL_PIN_EPOLL,fds)==0);
+    CHECK(write(busy[1],"x",1)==1);
+    close(fds[0]);
+
+    int seen=0;
+    for (i=0; (i<1000) && !seen; i++) {
+      N=flexipoll_poll_events(fp,events,8,0);
+      while (N-->0)
+        if (events[N].fd==fds[0]) {
+          assert((events[N].revents==POLLNVAL) && (events[N].data==fds));
+          seen=1;
+        }
+    }
+    assert(seen);
+    FlexipollStats stats=stats_of(fp);
+    assert((stats.retired==2) && (stats.epoll_tier_fds==0));
+
+    CHECK(flexipoll_remove_fd(fp,busy[0])==0);
+    close(busy[0]);
+    close(busy[1]);
+    close(fds[1]);
+  }
+
+  /* A number reused while a duplicate keeps epoll watching the old
+   *  file: the old file's events are dropped, the new one's reported.
+   */
+  {
+    int old[2], dup_fd;
+    CHECK(pipe(old)==0);
+    dup_fd=dup(old[0]);
+    CHECK(dup_fd>=0);
+    CHECK(flexipoll_add_fd_ex(fp,old[0],POLLIN,FLEXIPOLL_PIN_EPOLL,old)==0);
+    int reused=old[0];
+    close(old[0]);
+
+    int fresh[2];
+    CHECK(pipe(fresh)==0);
+    assert(fresh[0]==reused);
+    CHECK(flexipoll_add_fd_ex(fp,fresh[0],POLLIN,FLEXIPOLL_PIN_EPOLL,
+                              fresh)==0);
+
+    CHECK(write(old[1],"x",1)==1);
+    unsigned long long stale=stats_of(fp).stale_events;
+    CHECK(flexipoll_poll_events(fp,events,8,0)==0);
+    assert(stats_of(fp).stale_events==stale+1);
+
+    CHECK(write(fresh[1],"x",1)==1);
+    N=flexipoll_poll_events(fp,events,8,0);
+    assert((N==1) && (events[0].fd==fresh[0]) && (events[0].data==fresh));
+
+    CHECK(flexipoll_remove_fd(fp,fresh[0])==0);
+    close(fresh[0]);
+    close(fresh[1]);
+    close(dup_fd);
+    close(old[1]);
+  }
+
+  /* Removing, and re-adding, fds held over for the next call. */
+  {
+    int fds[3][2];
+    for (i=0; i<3; i++) {
+      CHECK(pipe(fds[i])==0);
+      CHECK(flexipoll_add_fd_data(fp,fds[i][0],POLLIN,fds[i])==0);
+      CHECK(write(fds[i][1],"x",1)==1);
+    }
+    CHECK(flexipoll_poll_events(fp,events,1,0)==1);
+    int first=events[0].fd, second=-1, third=-1;
+    for (i=0; i<3; i++)
+      if (fds[i][0]!=first) {
+        if (second<0)
+          second=fds[i][0];
+        else
+          third=fds[i][0];
+      }
+
+    CHECK(flexipoll_remove_fd(fp,second)==0);
+    CHECK(flexipoll_remove_fd(fp,third)==0);
+    CHECK(flexipoll_add_fd(fp,third,POLLIN)==0);
+    /* Both held-over reports are stale: the next call polls anew. */
+    N=flexipoll_poll_events(fp,events,8,0);
+    assert(N==2);
+    assert(((events[0].fd==first) && (events[1].fd==third))
+           || ((events[0].fd==third) && (events[1].fd==first)));
+
+    for (i=0; i<3; i++) {
+      CHECK(flexipoll_remove_fd(fp,fds[i][0])==0);
+      close(fds[i][0]);
+      close(fds[i][1]);
+    }
+  }
+
+  assert(stats_of(fp).retired==2);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
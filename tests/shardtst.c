@@ -0,0 +1,110 @@
+#define _GNU_SOURCE /* for pipe2() */
+
+#include <flexipoll_shards.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "check.h"
+
+/* Passes tokens round a ring of pipes, handled by a sharded poller,
+ *  checking that no fd is ever handled by two threads at once.
+ */
+
+#define NUM_PIPES 256
+#define NUM_TOKENS 32
+#define NUM_PASSES 200000
+
+struct pipe_info {
+  int fds[2];
+  atomic_int busy_bool;
+};
+
+static struct pipe_info pipes[NUM_PIPES];
+static atomic_long passes;
+
+static void handler(const FlexipollEvent* event, void* ctx)
+{
+  struct pipe_info* info=(struct pipe_info*)(event->data);
+
+  CHECK(!atomic_exchange(&(info->busy_bool),1));
+
+  unsigned char buff[NUM_TOKENS];
+  int nbytes=read(event->fd,buff,sizeof(buff));
+  if (nbytes>0) {
+    /* Pass each token on to a pseudo-random pipe, so load skews
+     *  around over time.
+     */
+    int i;
+    for (i=0; i<nbytes; i++) {
+      if (atomic_fetch_add(&passes,1)>=NUM_PASSES)
+        break;
+      int next=(int)(((info-pipes)*7+buff[i]*13+i)%NUM_PIPES);
+      buff[i]++;
+      CHECK(write(pipes[next].fds[1],buff+i,1)==1);
+    }
+  }
+
+  atomic_store(&(info->busy_bool),0);
+}
+
+int main(int argc, const char* argv[])
+{
+  FlexipollShards shards=flexipoll_shards_new(4,handler,0,0);
+  if (!shards) {
+    perror("flexipoll_shards_new");
+    return 1;
+  }
+
+  int i;
+  for (i=0; i<NUM_PIPES; i++) {
+    if (pipe2(pipes[i].fds,O_NONBLOCK)<0) {
+      perror("pipe2");
+      return 2;
+    }
+    atomic_init(&(pipes[i].busy_bool),0);
+    if (flexipoll_shards_add_fd(shards,pipes[i].fds[0],POLLIN,pipes+i)<0) {
+      perror("flexipoll_shards_add_fd");
+      return 3;
+    }
+  }
+
+  for (i=0; i<flexipoll_shards_count(shards); i++)
+    assert(flexipoll_shards_num_fds(shards,i)==NUM_PIPES/4);
+
+  /* No fd that big is open, so the registry doesn't grow to fit it. */
+  if ((flexipoll_shards_add_fd(shards,2000000000,POLLIN,0)>=0)
+      || (errno!=EBADF)) {
+    fprintf(stderr,"flexipoll_shards_add_fd: fd 2000000000 accepted\n");
+    return 5;
+  }
+
+  if (flexipoll_shards_start(shards)<0) {
+    perror("flexipoll_shards_start");
+    return 4;
+  }
+
+  for (i=0; i<NUM_TOKENS; i++) {
+    unsigned char token=(unsigned char)i;
+    CHECK(write(pipes[i].fds[1],&token,1)==1);
+  }
+
+  while (atomic_load(&passes)<NUM_PASSES) {
+    struct timespec ts={0,1000000};
+    nanosleep(&ts,0);
+  }
+
+  /* Removal from outside the workers. */
+  for (i=0; i<NUM_PIPES; i+=2)
+    CHECK(flexipoll_shards_remove_fd(shards,pipes[i].fds[0])==0);
+
+  flexipoll_shards_delete(shards);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+static int errors, last_fd, last_error;
+
+static void on_error(Flexipoll fp, const char* what, int fd, int error,
+                     void* ctx)
+{
+  assert(ctx==&errors);
+  errors++;
+  last_fd=fd;
+  last_error=error;
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+  CHECK(flexipoll_set_thresholds(fp,1,1)==0); /* everything to epoll */
+  CHECK(flexipoll_set_timing(fp,1)==0);
+  CHECK(flexipoll_set_error_handler(fp,on_error,&errors)==0);
+
+  int fds[2];
+  CHECK(pipe(fds)==0);
+  CHECK(flexipoll_add_fd(fp,fds[0],POLLIN)==0);
+  CHECK(write(fds[1],"x",1)==1);
+
+  FlexipollEvent ev;
+  int i;
+  for (i=0; i<10; i++)
+    CHECK(flexipoll_poll_events(fp,&ev,1,0)==1);
+
+  FlexipollStats stats;
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.calls==10);
+  assert(stats.events==10);
+  assert(stats.poll_calls==10);
+  assert(stats.to_epoll==1 && stats.to_poll==0);
+  assert(stats.epoll_tier_fds==1 && stats.poll_tier_fds==0);
+  assert(stats.epoll_ctl_calls==1 && stats.epoll_ctl_failures==0);
+  assert(stats.epoll_wait_calls>=1);
+  {
+    unsigned long long timed=0;
+    for (i=0; i<FLEXIPOLL_HISTOGRAM_BUCKETS; i++)
+      timed+=stats.latency[i];
+    assert(timed==stats.calls);
+  }
+
+  FlexipollFdStats fd_stats;
+  CHECK(flexipoll_fd_stats(fp,fds[0],&fd_stats)==0);
+  assert(fd_stats.in_epoll_bool && (fd_stats.migrations==1));
+  assert((fd_stats.activity>0) && (fd_stats.activity<=1));
+  CHECK((flexipoll_fd_stats(fp,fds[1],&fd_stats)<0) && (errno==EINVAL));
+
+  /* epoll forgets a closed fd, so changing its events fails. */
+  int fd=fds[0];
+  close(fds[0]);
+  CHECK(flexipoll_add_fd(fp,fd,POLLIN|POLLPRI)<0);
+  assert((errors==1) && (last_fd==fd) && (last_error==EBADF));
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.epoll_ctl_failures==1);
+
+  /* ... and so does a posted request, with nobody waiting on it. */
+  CHECK(flexipoll_post_add_fd(fp,fd,POLLIN,0,0)==0);
+  CHECK(flexipoll_poll_events(fp,&ev,1,0)==0);
+  assert(errors==3); /* epoll_ctl, then the post */
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert(stats.posted==0);
+  CHECK(flexipoll_remove_fd(fp,fd)==0);
+
+  CHECK(flexipoll_reset_stats(fp)==0);
+  CHECK(flexipoll_get_stats(fp,&stats)==0);
+  assert((stats.calls==0) && (stats.epoll_ctl_calls==0));
+
+  close(fds[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
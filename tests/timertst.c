@@ -0,0 +1,106 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_TIMERS 300
+#define MAX_TIMEOUT 1500
+#define SLACK 50000 /* microseconds */
+
+struct timer_info {
+  FlexipollTimer timer;
+  long long due; /* microseconds */
+  int cancelled_bool, fired_bool;
+};
+
+/* Finer than the timer wheel's ticks, so as to catch a timer that
+ *  fires early within one.
+ */
+static long long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((long long)(ts.tv_sec))*1000000+ts.tv_nsec/1000;
+}
+
+int main(int argc, const char* argv[])
+{
+  static struct timer_info infos[NUM_TIMERS];
+
+  Flexipoll fp=flexipoll_new();
+  if (!fp) {
+    perror("flexipoll_new");
+    return 1;
+  }
+
+  srand(1);
+
+  int i;
+  for (i=0; i<NUM_TIMERS; i++) {
+    int timeout=(i<10) ? i : rand()%MAX_TIMEOUT;
+    infos[i].timer=flexipoll_timer_new(fp,infos+i);
+    if (!infos[i].timer) {
+      perror("flexipoll_timer_new");
+      return 2;
+    }
+    infos[i].due=now_us()+timeout*1000LL;
+    if (flexipoll_timer_arm(infos[i].timer,timeout)<0) {
+      perror("flexipoll_timer_arm");
+      return 3;
+    }
+    infos[i].cancelled_bool=infos[i].fired_bool=0;
+  }
+
+  for (i=0; i<NUM_TIMERS; i+=7) {
+    flexipoll_timer_cancel(infos[i].timer);
+    infos[i].cancelled_bool=1;
+    assert(!flexipoll_timer_armed(infos[i].timer));
+  }
+
+  int remaining=0;
+  for (i=0; i<NUM_TIMERS; i++)
+    if (!infos[i].cancelled_bool)
+      remaining++;
+
+  while (remaining) {
+    FlexipollEvent evs[16];
+    int N=flexipoll_poll_events(fp,evs,sizeof(evs)/sizeof(evs[0]),-1);
+    if (N<0) {
+      perror("flexipoll_poll_events");
+      return 4;
+    }
+
+    long long now=now_us();
+    int j;
+    for (j=0; j<N; j++) {
+      struct timer_info* info=(struct timer_info*)(evs[j].data);
+      assert(evs[j].fd==-1);
+      assert(!info->cancelled_bool);
+      assert(!info->fired_bool);
+      assert(now>=info->due);
+      if (now>info->due+SLACK)
+        fprintf(stderr,"timer %d late by %lld us\n",
+                (int)(info-infos),now-info->due);
+      info->fired_bool=1;
+      remaining--;
+    }
+  }
+
+  {
+    FlexipollEvent ev;
+    int N=flexipoll_poll_events(fp,&ev,1,20);
+    if (N<0) {
+      perror("flexipoll_poll_events");
+      return 5;
+    }
+    assert(N==0);
+  }
+
+  for (i=0; i<NUM_TIMERS; i++)
+    flexipoll_timer_delete(infos[i].timer);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
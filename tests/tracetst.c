@@ -0,0 +1,122 @@
+#include <flexipoll_trace.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* The trace: records for registration, calls, ready fds, moves and
+ *  removal, in order; a ring that overflows; and dumps that pick up
+ *  where the last left off.
+ */
+
+static FlexipollTraceHeader header;
+static FlexipollTraceRecord records[64];
+
+/* Dumps fp's trace into a file, and reads it back into header and
+ *  records.  Returns the number of records.
+ */
+static int dump(Flexipoll fp)
+{
+  FILE* f=tmpfile();
+  CHECK(f);
+  CHECK(flexipoll_write_trace(fp,fileno(f))==0);
+  rewind(f);
+  CHECK(fread(&header,sizeof(header),1,f)==1);
+  assert((header.magic==FLEXIPOLL_TRACE_MAGIC)
+         && (header.version==FLEXIPOLL_TRACE_VERSION)
+         && (header.record_bytes==sizeof(FlexipollTraceRecord)));
+  assert(header.records<=64);
+  CHECK(fread(records,sizeof(FlexipollTraceRecord),header.records,f)
+        ==header.records);
+  CHECK(fgetc(f)==EOF);
+  fclose(f);
+  return (int)(header.records);
+}
+
+static void check(const FlexipollTraceRecord* record, unsigned type, int fd,
+                  unsigned a)
+{
+  assert((record->type==type) && (record->fd==fd) && (record->a==a));
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  CHECK((flexipoll_set_trace(fp,-1)<0) && (errno==EINVAL));
+  CHECK((flexipoll_write_trace(fp,1)<0) && (errno==EINVAL));
+  CHECK(flexipoll_set_trace(fp,60)==0); /* 64, in fact */
+
+  int a[2], b[2];
+  CHECK(pipe(a)==0);
+  CHECK(pipe(b)==0);
+  CHECK(flexipoll_add_fd_ex(fp,a[0],POLLIN,FLEXIPOLL_PIN_POLL,0)==0);
+  CHECK(flexipoll_add_fd_ex(fp,b[0],POLLIN,FLEXIPOLL_PIN_EPOLL,0)==0);
+  CHECK(write(a[1],"x",1)==1);
+  CHECK(write(b[1],"x",1)==1);
+
+  FlexipollEvent events[4];
+  CHECK(flexipoll_poll_events(fp,events,4,0)==2);
+  /* Moved by re-registering. */
+  CHECK(flexipoll_add_fd_ex(fp,b[0],POLLIN,FLEXIPOLL_PIN_POLL,0)==0);
+  CHECK(flexipoll_remove_fd(fp,a[0])==0);
+
+  CHECK(dump(fp)==7);
+  assert((header.half_life==16) && (header.dropped==0));
+  assert((header.threshold_below>0.57f) && (header.threshold_below<0.59f));
+  check(records+0,FLEXIPOLL_TRACE_ADD,a[0],FLEXIPOLL_TRACE_POLL_TIER);
+  assert(records[0].b==FLEXIPOLL_PIN_POLL);
+  check(records+1,FLEXIPOLL_TRACE_ADD,b[0],FLEXIPOLL_TRACE_EPOLL_TIER);
+  check(records+2,FLEXIPOLL_TRACE_CALL,2,1);
+  assert(records[2].b==1);
+  {
+    /* The tiers take turns to go first. */
+    int i, seen=0;
+    for (i=3; i<5; i++) {
+      assert(records[i].type==FLEXIPOLL_TRACE_READY);
+      assert(records[i].b==POLLIN);
+      if (records[i].fd==a[0]) {
+        assert(records[i].a==FLEXIPOLL_TRACE_POLL_TIER);
+        seen|=1;
+      } else if (records[i].fd==b[0]) {
+        assert(records[i].a==FLEXIPOLL_TRACE_EPOLL_TIER);
+        seen|=2;
+      }
+    }
+    assert(seen==3);
+  }
+  check(records+5,FLEXIPOLL_TRACE_MIGRATE,b[0],FLEXIPOLL_TRACE_POLL_TIER);
+  check(records+6,FLEXIPOLL_TRACE_REMOVE,a[0],FLEXIPOLL_TRACE_POLL_TIER);
+
+  /* Nothing new since. */
+  CHECK(dump(fp)==0);
+
+  /* 100 calls with b ready overflow the ring: the newest 64 records
+   *  survive.
+   */
+  {
+    int i;
+    for (i=0; i<100; i++)
+      CHECK(flexipoll_poll_events(fp,events,4,0)==1);
+  }
+  CHECK(dump(fp)==64);
+  assert(header.dropped==200-64);
+  check(records+62,FLEXIPOLL_TRACE_CALL,1,1);
+  check(records+63,FLEXIPOLL_TRACE_READY,b[0],FLEXIPOLL_TRACE_POLL_TIER);
+
+  CHECK(flexipoll_set_trace(fp,0)==0);
+  CHECK(flexipoll_poll_events(fp,events,4,0)==1);
+  CHECK((flexipoll_write_trace(fp,1)<0) && (errno==EINVAL));
+
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include <flexipoll.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
 
 int main(int argc, const char* argv[])
 {
@@ -15,6 +17,12 @@ int main(int argc, const char* argv[])
     return 2;
   }
 
+  /* No fd that big is open, so no table grows to fit it. */
+  if ((flexipoll_add_fd(fp,2000000000,POLLIN)>=0) || (errno!=EBADF)) {
+    fprintf(stderr,"flexipoll_add_fd: fd 2000000000 accepted\n");
+    return 9;
+  }
+
   int fds_with_events[10];
   const int max_fds=sizeof(fds_with_events)/sizeof(fds_with_events[0]);
 
@@ -28,6 +36,79 @@ int main(int argc, const char* argv[])
   int events=flexipoll_events(fp,0);
   assert (events==POLLIN);
 
+  {
+    static int cookie;
+    if (flexipoll_add_fd_data(fp,0,POLLIN,&cookie)<0) {
+      perror("flexipoll_add_fd_data");
+      return 7;
+    }
+
+    FlexipollEvent evs[10];
+    N=flexipoll_poll_events(fp,evs,sizeof(evs)/sizeof(evs[0]),-1);
+    if (N<0) {
+      perror("flexipoll_poll_events");
+      return 8;
+    }
+
+    assert(N==1);
+    assert(evs[0].fd==0);
+    assert(evs[0].revents==POLLIN);
+    assert(evs[0].data==&cookie);
+  }
+
+  /* Fds removed while waiting to change tiers make way for others. */
+  {
+    Flexipoll other=flexipoll_new();
+    int fds[2], dups[200];
+    const int num_dups=sizeof(dups)/sizeof(dups[0]);
+    if (!other || (pipe(fds)<0) || (write(fds[1],"x",1)!=1)
+        || (flexipoll_set_migration_budget(other,1)<0)
+        || (flexipoll_add_fd(other,fds[0],POLLIN)<0)) {
+      perror("migration backlog setup");
+      return 10;
+    }
+
+    int round, i;
+    for (round=0; round<2; round++) {
+      for (i=0; i<num_dups; i++) {
+        dups[i]=dup(fds[1]);
+        if ((dups[i]<0)
+            || (flexipoll_add_fd_ex(other,dups[i],POLLIN,
+                                    FLEXIPOLL_START_POLL|FLEXIPOLL_PRIOR(0),
+                                    0)<0)) {
+          perror("flexipoll_add_fd_ex");
+          return 11;
+        }
+      }
+
+      FlexipollEvent ev;
+      FlexipollStats stats;
+      if ((flexipoll_poll_events(other,&ev,1,0)!=1)
+          || (flexipoll_get_stats(other,&stats)<0)) {
+        perror("flexipoll_poll_events");
+        return 12;
+      }
+      assert(stats.migrations_pending<num_dups);
+
+      for (i=0; i<num_dups; i++) {
+        if (flexipoll_remove_fd(other,dups[i])<0) {
+          perror("flexipoll_remove_fd");
+          return 13;
+        }
+        close(dups[i]);
+      }
+      if (flexipoll_get_stats(other,&stats)<0) {
+        perror("flexipoll_get_stats");
+        return 14;
+      }
+      assert(stats.migrations_pending==0);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    flexipoll_delete(other);
+  }
+
   {
     char buff[512];
     int nbytes=read(0,buff,sizeof(buff));
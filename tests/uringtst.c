@@ -0,0 +1,178 @@
+#include <flexipoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "check.h"
+
+/* The epoll tier kept by io_uring: level-triggered, FLEXIPOLL_EDGE
+ *  and FLEXIPOLL_ONESHOT fds, re-registering, removing, moving
+ *  between tiers and wakeups.  Passes, saying so, if the kernel has no
+ *  io_uring.
+ */
+
+static int poll_once(Flexipoll fp, FlexipollEvent* ev)
+{
+  int N=flexipoll_poll_events(fp,ev,1,0);
+  if (N<0) {
+    perror("flexipoll_poll_events");
+    _exit(1);
+  }
+  return N;
+}
+
+static void drain(int fd)
+{
+  char buff[64];
+  CHECK(read(fd,buff,sizeof(buff))>0);
+}
+
+static int in_epoll_tier(Flexipoll fp, int fd)
+{
+  FlexipollFdStats stats;
+  CHECK(flexipoll_fd_stats(fp,fd,&stats)==0);
+  return stats.in_epoll_bool;
+}
+
+/* Lets everything settle into the epoll tier; migrations only happen
+ *  on calls that find something.
+ */
+static void settle(Flexipoll fp, int fd, int wfd)
+{
+  FlexipollEvent ev;
+  int i;
+  CHECK(write(wfd,"x",1)==1);
+  for (i=0; i<4; i++)
+    poll_once(fp,&ev);
+  drain(fd);
+  while (poll_once(fp,&ev))
+    ;
+}
+
+int main(int argc, const char* argv[])
+{
+  Flexipoll fp=flexipoll_new();
+  CHECK(fp);
+
+  if (flexipoll_use_io_uring(fp)<0) {
+    assert(errno!=EBUSY);
+    printf("no io_uring (%d); ok\n",errno);
+    flexipoll_delete(fp);
+    return 0;
+  }
+  CHECK(flexipoll_use_io_uring(fp)==0);
+
+  CHECK(flexipoll_set_thresholds(fp,1,1)==0); /* everything to io_uring */
+  CHECK(flexipoll_set_migration_budget(fp,0)==0);
+
+  int level[2], edge[2], oneshot[2];
+  CHECK(pipe(level)==0);
+  CHECK(pipe(edge)==0);
+  CHECK(pipe(oneshot)==0);
+
+  CHECK(flexipoll_add_fd_data(fp,level[0],POLLIN,level)==0);
+  CHECK(flexipoll_add_fd_ex(fp,edge[0],POLLIN,FLEXIPOLL_EDGE,edge)==0);
+  CHECK(flexipoll_add_fd_ex(fp,oneshot[0],POLLIN,FLEXIPOLL_ONESHOT,
+                            oneshot)==0);
+
+  CHECK(flexipoll_use_io_uring(fp)==0); /* already, so no EBUSY */
+  {
+    Flexipoll other=flexipoll_new();
+    CHECK(other);
+    CHECK(flexipoll_add_fd(other,level[0],POLLIN)==0);
+    CHECK((flexipoll_use_io_uring(other)<0) && (errno==EBUSY));
+    flexipoll_delete(other);
+  }
+
+  settle(fp,level[0],level[1]);
+  settle(fp,edge[0],edge[1]);
+  settle(fp,oneshot[0],oneshot[1]);
+  CHECK(flexipoll_rearm(fp,oneshot[0])==0);
+  assert(in_epoll_tier(fp,level[0]));
+  assert(in_epoll_tier(fp,edge[0]));
+  assert(in_epoll_tier(fp,oneshot[0]));
+
+  FlexipollEvent ev;
+  int i;
+
+  /* Level-triggered: reported every call until drained. */
+  CHECK(write(level[1],"x",1)==1);
+  for (i=0; i<3; i++) {
+    CHECK(poll_once(fp,&ev)==1);
+    assert((ev.fd==level[0]) && (ev.data==level) && (ev.revents & POLLIN));
+  }
+  drain(level[0]);
+  while (poll_once(fp,&ev)) /* one may be in flight */
+    assert(ev.fd==level[0]);
+  CHECK(poll_once(fp,&ev)==0);
+
+  /* Edge-triggered: once per write. */
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert((ev.fd==edge[0]) && (ev.data==edge) && (ev.revents & POLLIN));
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==edge[0]);
+  drain(edge[0]);
+
+  /* One-shot: once, then again after a rearm. */
+  CHECK(write(oneshot[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert((ev.fd==oneshot[0]) && (ev.data==oneshot));
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(flexipoll_rearm(fp,oneshot[0])==0);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==oneshot[0]);
+  drain(oneshot[0]);
+  CHECK(flexipoll_rearm(fp,oneshot[0])==0);
+  CHECK(poll_once(fp,&ev)==0);
+
+  /* Re-registering for other events replaces the old poll. */
+  CHECK(flexipoll_add_fd_data(fp,level[0],POLLPRI,level)==0);
+  CHECK(write(level[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==0);
+  CHECK(flexipoll_add_fd_data(fp,level[0],POLLIN,level)==0);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==level[0]);
+
+  /* A removed fd isn't reported, even with a completion in flight. */
+  CHECK(flexipoll_remove_fd(fp,level[0])==0);
+  CHECK(poll_once(fp,&ev)==0);
+  drain(level[0]);
+
+  /* And a wakeup gets through. */
+  CHECK(flexipoll_wakeup(fp)==0);
+  CHECK(flexipoll_poll_events(fp,&ev,1,-1)==0);
+
+  /* Back to the poll tier when busy, and reported all the while. */
+  CHECK(flexipoll_set_thresholds(fp,0,0)==0);
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==edge[0]);
+  assert(!in_epoll_tier(fp,edge[0]));
+  CHECK(write(edge[1],"x",1)==1);
+  CHECK(poll_once(fp,&ev)==1);
+  assert(ev.fd==edge[0]);
+
+  {
+    FlexipollStats stats;
+    CHECK(flexipoll_get_stats(fp,&stats)==0);
+    assert(stats.io_uring_enter_calls>0);
+    assert(stats.epoll_ctl_calls==0);
+    assert(stats.epoll_wait_calls==0);
+  }
+
+  close(level[0]);
+  close(level[1]);
+  close(edge[0]);
+  close(edge[1]);
+  close(oneshot[0]);
+  close(oneshot[1]);
+  flexipoll_delete(fp);
+
+  printf("ok\n");
+  return 0;
+}
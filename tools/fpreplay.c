@@ -0,0 +1,671 @@
+/* fpreplay.c
+ *	Re-runs a flexipoll trace (see flexipoll_trace.h) under other
+ *	classification policies, and estimates what each would have
+ *	cost.
+ *
+ * Readiness is a property of the fds, not of the tier they're in, so a
+ *  trace says which fds each call would have found ready whatever the
+ *  policy.  Each policy is stepped through the same calls, keeping its
+ *  own tiers, and charged per call by the cost model flexipoll itself
+ *  uses (see flexipoll_apply_costs()): poll_ns per poll-tier fd, plus
+ *  one for the epoll fd; epoll_event_ns per fd epoll reports; and
+ *  epoll_ctl_ns per fd joining, leaving or changing tiers in the epoll
+ *  tier.  System calls are counted alongside.
+ *
+ * Policies:
+ *   recorded	what flexipoll actually did
+ *   poll	every fd in the poll tier
+ *   epoll	every fd in the epoll tier
+ *   BELOW/ABOVE/HALF_LIFE
+ *		flexipoll's own, with those thresholds and half-life (and
+ *		the traced migration budget); the traced settings, and a
+ *		few either side of them, unless --policy says otherwise
+ *
+ * Fds registered before tracing began are only known once they're
+ *  ready; the rest, going by the tier sizes traced, are taken to be
+ *  idle, which puts them in the epoll tier under flexipoll's policies.
+ *  Edge-triggered fds are reported differently by the two tiers, so
+ *  their traces only approximate what another policy would have seen.
+ */
+#include <flexipoll_trace.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Policy kinds. */
+#define RECORDED 0
+#define ALL_POLL 1
+#define ALL_EPOLL 2
+#define ADAPTIVE 3
+
+#define MAX_POLICIES 32
+
+/* As in flexipoll.c: an fd starting without a prior starts at
+ *  START_ACTIVITY, and one that has just migrated stays put for
+ *  half_life<<n calls, n counting its recent migrations.
+ */
+#define START_ACTIVITY 0.6
+#define MAX_MIGRATION_BACKOFF 6
+#define PRIOR_FLAGS 0xff00
+
+/* One fd, as a policy sees it. */
+typedef struct SimFd {
+  int tier; /* FLEXIPOLL_TRACE_POLL_TIER etc., or -1 if unregistered */
+  int pinned_bool;
+  int dirty_bool;
+  unsigned gen; /* bumped as it moves, to invalidate its Due */
+  double activity; /* as of call number stamp */
+  unsigned long long stamp;
+  unsigned long long last_migration, hold;
+  unsigned migrations;
+} SimFd;
+
+/* When a poll-tier fd, left idle, will have dropped below the lower
+ *  threshold; kept in a heap, soonest first.
+ */
+typedef struct Due {
+  unsigned long long call;
+  int fd;
+  unsigned gen;
+} Due;
+
+typedef struct Policy {
+  char name[48];
+  int kind;
+  double below, above, decay;
+  int half_life, budget;
+
+  SimFd* fds;
+  int poll_count;
+
+  Due* due;
+  int num_due, due_capacity;
+  int* dirty;
+  int num_dirty;
+
+  unsigned long long calls; /* that found something */
+  unsigned long long syscalls, migrations;
+  double ns;
+} Policy;
+
+static Policy policies[MAX_POLICIES];
+static int num_policies;
+
+static int num_fds; /* length of every fds array, and of known */
+static char* known; /* fds registered, as far as the trace says */
+static int num_known;
+
+static FlexipollCosts costs;
+
+/* The call in progress, and its ready fds. */
+static int call_open_bool;
+static int call_result;
+static unsigned call_poll_fds, call_epoll_fds;
+static FlexipollTraceRecord* ready;
+static int num_ready, ready_capacity;
+
+static unsigned long long total_calls, total_records, total_dropped;
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: fpreplay [--costs POLL_NS,EPOLL_EVENT_NS,EPOLL_CTL_NS]\n"
+          "                [--policy BELOW/ABOVE/HALF_LIFE]... TRACE\n");
+  exit(2);
+}
+
+static void* xrealloc(void* p, size_t bytes)
+{
+  void* res=realloc(p,bytes);
+  if (!res) {
+    perror("realloc");
+    exit(1);
+  }
+  return res;
+}
+
+/* Makes room for fd in known and every policy's fds. */
+static void grow_fds(int fd)
+{
+  if (fd<num_fds)
+    return;
+
+  int n=num_fds ? num_fds : 64, i, j;
+  while (n<=fd)
+    n*=2;
+
+  known=(char*)(xrealloc(known,n));
+  memset(known+num_fds,0,n-num_fds);
+  for (i=0; i<num_policies; i++) {
+    Policy* p=policies+i;
+    p->fds=(SimFd*)(xrealloc(p->fds,sizeof(SimFd)*n));
+    for (j=num_fds; j<n; j++) {
+      memset(p->fds+j,0,sizeof(SimFd));
+      p->fds[j].tier=-1;
+    }
+    p->dirty=(int*)(xrealloc(p->dirty,sizeof(int)*n));
+  }
+  num_fds=n;
+}
+
+static void add_policy(int kind, const char* name, double below,
+                       double above, int half_life)
+{
+  if (num_policies==MAX_POLICIES) {
+    fprintf(stderr,"fpreplay: too many policies\n");
+    exit(2);
+  }
+
+  Policy* p=policies+num_policies++;
+  memset(p,0,sizeof(Policy));
+  p->kind=kind;
+  if (name)
+    snprintf(p->name,sizeof(p->name),"%s",name);
+  else
+    snprintf(p->name,sizeof(p->name),"%.3f/%.3f/%d",below,above,half_life);
+  p->below=below;
+  p->above=above;
+  p->half_life=half_life;
+  p->decay=pow(2,-1.0/half_life);
+}
+
+/* fd's activity as of the current call. */
+static double current_activity(const Policy* p, const SimFd* f)
+{
+  return f->activity*pow(p->decay,(double)(p->calls-f->stamp));
+}
+
+static void push_due(Policy* p, unsigned long long call, int fd)
+{
+  if (p->num_due==p->due_capacity) {
+    p->due_capacity=p->due_capacity ? p->due_capacity*2 : 64;
+    p->due=(Due*)(xrealloc(p->due,sizeof(Due)*p->due_capacity));
+  }
+
+  int i=p->num_due++;
+  while (i && (p->due[(i-1)/2].call>call)) {
+    p->due[i]=p->due[(i-1)/2];
+    i=(i-1)/2;
+  }
+  p->due[i].call=call;
+  p->due[i].fd=fd;
+  p->due[i].gen=p->fds[fd].gen;
+}
+
+static Due pop_due(Policy* p)
+{
+  Due res=p->due[0], last=p->due[--(p->num_due)];
+  int i=0;
+  for (;;) {
+    int child=2*i+1;
+    if (child>=p->num_due)
+      break;
+    if ((child+1<p->num_due) && (p->due[child+1].call<p->due[child].call))
+      child++;
+    if (p->due[child].call>=last.call)
+      break;
+    p->due[i]=p->due[child];
+    i=child;
+  }
+  if (p->num_due)
+    p->due[i]=last;
+  return res;
+}
+
+/* Has a poll-tier fd looked at again once it could have dropped below
+ *  the lower threshold.
+ */
+static void schedule(Policy* p, int fd)
+{
+  SimFd* f=p->fds+fd;
+  unsigned long long calls=0;
+  if (f->activity>=p->below)
+    calls=(unsigned long long)(log(p->below/f->activity)/log(p->decay))+1;
+  push_due(p,f->stamp+calls,fd);
+}
+
+/* Queues fd to change tiers, unless it's pinned, already queued or
+ *  still settling from its last move, in which case it's looked at
+ *  again when it may.
+ */
+static void mark_dirty(Policy* p, int fd)
+{
+  SimFd* f=p->fds+fd;
+  if (f->pinned_bool || f->dirty_bool)
+    return;
+  if (p->calls-f->last_migration<f->hold) {
+    if (f->tier==FLEXIPOLL_TRACE_POLL_TIER)
+      push_due(p,f->last_migration+f->hold,fd);
+    return;
+  }
+  f->dirty_bool=1;
+  p->dirty[p->num_dirty++]=fd;
+}
+
+/* Whether fd, at activity a, belongs in the other tier. */
+static int misplaced(const Policy* p, const SimFd* f, double a)
+{
+  return (f->tier==FLEXIPOLL_TRACE_POLL_TIER) ? (a<p->below) : (a>p->above);
+}
+
+static void migrate_fd(Policy* p, int fd)
+{
+  SimFd* f=p->fds+fd;
+
+  if (p->calls-f->last_migration
+      >((unsigned long long)(p->half_life)<<(MAX_MIGRATION_BACKOFF+1)))
+    f->migrations=0;
+  f->hold=(unsigned long long)(p->half_life)
+    <<(f->migrations<MAX_MIGRATION_BACKOFF ?
+       f->migrations : MAX_MIGRATION_BACKOFF);
+  f->last_migration=p->calls;
+  f->migrations++;
+
+  f->activity=current_activity(p,f);
+  f->stamp=p->calls;
+  f->gen++;
+  p->migrations++;
+  p->syscalls++;
+  p->ns+=costs.epoll_ctl_ns;
+
+  if (f->tier==FLEXIPOLL_TRACE_POLL_TIER) {
+    f->tier=FLEXIPOLL_TRACE_EPOLL_TIER;
+    p->poll_count--;
+  } else {
+    f->tier=FLEXIPOLL_TRACE_POLL_TIER;
+    p->poll_count++;
+    schedule(p,fd);
+  }
+}
+
+/* Registers fd with p, as flexipoll_add_fd_ex() would with flags;
+ *  charged for it if charge_bool.
+ */
+static void sim_add(Policy* p, int fd, unsigned flags, int charge_bool)
+{
+  SimFd* f=p->fds+fd;
+  int pct=(int)((flags & PRIOR_FLAGS)>>8)-1, epoll_bool;
+
+  f->activity=(pct>=0) ? pct/100.0 : START_ACTIVITY;
+  if (p->kind==ALL_POLL) {
+    epoll_bool=0;
+  } else if (p->kind==ALL_EPOLL) {
+    epoll_bool=1;
+  } else if (flags & (FLEXIPOLL_START_EPOLL|FLEXIPOLL_PIN_EPOLL)) {
+    epoll_bool=1;
+    if (pct<0)
+      f->activity=0;
+  } else if (flags & (FLEXIPOLL_START_POLL|FLEXIPOLL_PIN_POLL)) {
+    epoll_bool=0;
+  } else {
+    epoll_bool=(pct>=0) && (f->activity<p->below);
+  }
+
+  f->tier=epoll_bool ? FLEXIPOLL_TRACE_EPOLL_TIER : FLEXIPOLL_TRACE_POLL_TIER;
+  f->pinned_bool=(flags & (FLEXIPOLL_PIN_POLL|FLEXIPOLL_PIN_EPOLL))!=0;
+  f->dirty_bool=0;
+  f->gen++;
+  f->stamp=f->last_migration=p->calls;
+  f->hold=0;
+  f->migrations=0;
+
+  if (epoll_bool) {
+    if (charge_bool) {
+      p->syscalls++;
+      p->ns+=costs.epoll_ctl_ns;
+    }
+  } else {
+    p->poll_count++;
+    if (p->kind==ADAPTIVE)
+      schedule(p,fd);
+  }
+}
+
+static void sim_remove(Policy* p, int fd)
+{
+  SimFd* f=p->fds+fd;
+  if (f->tier==FLEXIPOLL_TRACE_EPOLL_TIER) {
+    p->syscalls++;
+    p->ns+=costs.epoll_ctl_ns;
+  } else {
+    p->poll_count--;
+  }
+  f->tier=-1;
+  f->gen++;
+}
+
+/* fd registered in tier with flags; or, unless traced_bool, first
+ *  seen ready there, having been registered before tracing began.
+ */
+static void on_add(int fd, unsigned tier, unsigned flags, int traced_bool)
+{
+  int i;
+  grow_fds(fd);
+  if (!known[fd]) {
+    known[fd]=1;
+    num_known++;
+  }
+
+  for (i=0; i<num_policies; i++) {
+    Policy* p=policies+i;
+    if (p->kind==RECORDED) {
+      if (traced_bool && (tier==FLEXIPOLL_TRACE_EPOLL_TIER)) {
+        p->syscalls++;
+        p->ns+=costs.epoll_ctl_ns;
+      }
+    } else if (p->fds[fd].tier<0) {
+      sim_add(p,fd,flags,traced_bool);
+    }
+  }
+}
+
+static void on_remove(int fd, unsigned tier)
+{
+  int i;
+  if ((fd>=num_fds) || !known[fd])
+    return;
+  known[fd]=0;
+  num_known--;
+
+  for (i=0; i<num_policies; i++) {
+    Policy* p=policies+i;
+    if (p->kind==RECORDED) {
+      if (tier==FLEXIPOLL_TRACE_EPOLL_TIER) {
+        p->syscalls++;
+        p->ns+=costs.epoll_ctl_ns;
+      }
+    } else if (p->fds[fd].tier>=0) {
+      sim_remove(p,fd);
+    }
+  }
+}
+
+/* Steps p through the call in progress. */
+static void sim_call(Policy* p)
+{
+  int unseen=(int)(call_poll_fds+call_epoll_fds)-num_known, i;
+  int poll_fds, epoll_ready=0;
+
+  if (unseen<0)
+    unseen=0;
+
+  switch (p->kind) {
+  case RECORDED:
+    poll_fds=call_poll_fds;
+    for (i=0; i<num_ready; i++)
+      epoll_ready+=(ready[i].a==FLEXIPOLL_TRACE_EPOLL_TIER);
+    break;
+  case ALL_POLL:
+    poll_fds=p->poll_count+unseen;
+    break;
+  case ALL_EPOLL:
+    poll_fds=0;
+    epoll_ready=num_ready;
+    break;
+  default:
+    poll_fds=p->poll_count;
+    for (i=0; i<num_ready; i++)
+      epoll_ready+=(p->fds[ready[i].fd].tier==FLEXIPOLL_TRACE_EPOLL_TIER);
+    break;
+  }
+
+  p->syscalls+=1+(epoll_ready>0);
+  p->ns+=costs.poll_ns*(poll_fds+1)+costs.epoll_event_ns*epoll_ready;
+
+  if ((p->kind!=ADAPTIVE) || (call_result<=0))
+    return;
+
+  /* Much as flexipoll_poll() does it. */
+  p->calls++;
+  for (i=0; i<num_ready; i++) {
+    int fd=ready[i].fd;
+    SimFd* f=p->fds+fd;
+    f->activity=current_activity(p,f)+(1-p->decay);
+    f->stamp=p->calls;
+    if (misplaced(p,f,f->activity))
+      mark_dirty(p,fd);
+  }
+
+  while (p->num_due && (p->due[0].call<=p->calls)) {
+    Due due=pop_due(p);
+    SimFd* f=p->fds+due.fd;
+    if ((due.gen!=f->gen) || (f->tier!=FLEXIPOLL_TRACE_POLL_TIER))
+      continue;
+    f->activity=current_activity(p,f);
+    f->stamp=p->calls;
+    if (misplaced(p,f,f->activity))
+      mark_dirty(p,due.fd);
+    else
+      schedule(p,due.fd);
+  }
+
+  /* First come, first moved, within the budget; flexipoll picks the
+   *  costliest, which only matters when the budget runs out.
+   */
+  int moved=0, kept=0;
+  for (i=0; i<p->num_dirty; i++) {
+    int fd=p->dirty[i];
+    SimFd* f=p->fds+fd;
+    if ((f->tier<0) || !misplaced(p,f,current_activity(p,f))) {
+      f->dirty_bool=0;
+      if (f->tier==FLEXIPOLL_TRACE_POLL_TIER)
+        schedule(p,fd);
+    } else if (!p->budget || (moved<p->budget)) {
+      f->dirty_bool=0;
+      migrate_fd(p,fd);
+      moved++;
+    } else {
+      p->dirty[kept++]=fd;
+    }
+  }
+  p->num_dirty=kept;
+}
+
+static void end_call(void)
+{
+  int i;
+  if (!call_open_bool)
+    return;
+  for (i=0; i<num_policies; i++)
+    sim_call(policies+i);
+  total_calls++;
+  num_ready=0;
+  call_open_bool=0;
+}
+
+static void on_record(const FlexipollTraceRecord* record)
+{
+  int i;
+  total_records++;
+
+  switch (record->type) {
+  case FLEXIPOLL_TRACE_CALL:
+    end_call();
+    call_open_bool=1;
+    call_result=record->fd;
+    call_poll_fds=record->a;
+    call_epoll_fds=record->b;
+    break;
+
+  case FLEXIPOLL_TRACE_READY:
+    if (!call_open_bool || (record->fd<0))
+      break;
+    /* Registered before tracing began, presumably. */
+    if ((record->fd>=num_fds) || !known[record->fd])
+      on_add(record->fd,record->a,
+             (record->a==FLEXIPOLL_TRACE_EPOLL_TIER) ?
+             FLEXIPOLL_START_EPOLL : FLEXIPOLL_START_POLL,0);
+    if (num_ready==ready_capacity) {
+      ready_capacity=ready_capacity ? ready_capacity*2 : 64;
+      ready=(FlexipollTraceRecord*)
+        (xrealloc(ready,sizeof(FlexipollTraceRecord)*ready_capacity));
+    }
+    ready[num_ready++]=*record;
+    break;
+
+  case FLEXIPOLL_TRACE_MIGRATE:
+    for (i=0; i<num_policies; i++)
+      if (policies[i].kind==RECORDED) {
+        policies[i].syscalls++;
+        policies[i].migrations++;
+        policies[i].ns+=costs.epoll_ctl_ns;
+      }
+    break;
+
+  case FLEXIPOLL_TRACE_ADD:
+    if (record->fd>=0)
+      on_add(record->fd,record->a,record->b,1);
+    break;
+
+  case FLEXIPOLL_TRACE_REMOVE:
+    on_remove(record->fd,record->a);
+    break;
+  }
+}
+
+/* Reads the next dump's header into header.  Returns 0 at end of
+ *  file, <0 on error.
+ */
+static int read_header(FILE* in, FlexipollTraceHeader* header)
+{
+  size_t N=fread(header,1,sizeof(*header),in);
+  if (!N)
+    return 0;
+  if ((N!=sizeof(*header)) || (header->magic!=FLEXIPOLL_TRACE_MAGIC)
+      || (header->version!=FLEXIPOLL_TRACE_VERSION)
+      || (header->record_bytes!=sizeof(FlexipollTraceRecord))) {
+    fprintf(stderr,"fpreplay: not a flexipoll trace, or a damaged one\n");
+    return -1;
+  }
+  return 1;
+}
+
+static void parse_costs(const char* arg)
+{
+  if ((sscanf(arg,"%f,%f,%f",&(costs.poll_ns),&(costs.epoll_event_ns),
+              &(costs.epoll_ctl_ns))!=3)
+      || (costs.poll_ns<=0) || (costs.epoll_event_ns<=0)
+      || (costs.epoll_ctl_ns<=0))
+    usage();
+}
+
+int main(int argc, const char* argv[])
+{
+  const char* path=0;
+  const char* custom[MAX_POLICIES];
+  int num_custom=0, costs_bool=0;
+  int i;
+
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i],"--costs") && (i+1<argc)) {
+      parse_costs(argv[++i]);
+      costs_bool=1;
+    } else if (!strcmp(argv[i],"--policy") && (i+1<argc)) {
+      if (num_custom==MAX_POLICIES-3)
+        usage();
+      custom[num_custom++]=argv[++i];
+    } else if ((argv[i][0]!='-') && !path) {
+      path=argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!path)
+    usage();
+
+  FILE* in=fopen(path,"rb");
+  if (!in) {
+    perror(path);
+    return 1;
+  }
+
+  FlexipollTraceHeader header;
+  int res=read_header(in,&header);
+  if (res<=0) {
+    if (!res)
+      fprintf(stderr,"fpreplay: %s is empty\n",path);
+    return 1;
+  }
+
+  /* Costs: as given, else as traced, else as measured here. */
+  if (!costs_bool) {
+    costs=header.costs;
+    if ((costs.poll_ns<=0) || (costs.epoll_event_ns<=0)
+        || (costs.epoll_ctl_ns<=0)) {
+      if (flexipoll_measure_costs(&costs)<0) {
+        perror("flexipoll_measure_costs");
+        return 1;
+      }
+    }
+  }
+
+  add_policy(RECORDED,"recorded",0,0,1);
+  add_policy(ALL_POLL,"poll",0,0,1);
+  add_policy(ALL_EPOLL,"epoll",0,0,1);
+  if (num_custom) {
+    for (i=0; i<num_custom; i++) {
+      float below, above;
+      int half_life;
+      if ((sscanf(custom[i],"%f/%f/%d",&below,&above,&half_life)!=3)
+          || (below<=0) || (below>above) || (above>=1) || (half_life<1))
+        usage();
+      add_policy(ADAPTIVE,0,below,above,half_life);
+    }
+  } else {
+    static const double shifts[]={-0.2,-0.1,0,0.1,0.2};
+    double below=header.threshold_below, above=header.threshold_above;
+    int half_life=header.half_life, j;
+    for (j=0; j<(int)(sizeof(shifts)/sizeof(shifts[0])); j++)
+      if ((below+shifts[j]>0) && (above+shifts[j]<1))
+        add_policy(ADAPTIVE,0,below+shifts[j],above+shifts[j],half_life);
+    if (half_life>1)
+      add_policy(ADAPTIVE,0,below,above,half_life/4 ? half_life/4 : 1);
+    add_policy(ADAPTIVE,0,below,above,half_life*4);
+  }
+  for (i=0; i<num_policies; i++)
+    policies[i].budget=header.migration_budget;
+
+  do {
+    total_dropped+=header.dropped;
+    uint64_t left=header.records;
+    while (left) {
+      FlexipollTraceRecord records[1024];
+      size_t want=(left<1024) ? (size_t)(left) : 1024, j;
+      size_t N=fread(records,sizeof(FlexipollTraceRecord),want,in);
+      for (j=0; j<N; j++)
+        on_record(records+j);
+      if (N<want) {
+        fprintf(stderr,"fpreplay: %s is cut short\n",path);
+        left=0;
+        break;
+      }
+      left-=N;
+    }
+  } while ((res=read_header(in,&header))>0);
+  end_call();
+  fclose(in);
+  if (res<0)
+    return 1;
+
+  printf("%llu calls, %llu records, %llu dropped; costs %.1f/%.1f/%.1f ns\n",
+         total_calls,total_records,total_dropped,costs.poll_ns,
+         costs.epoll_event_ns,costs.epoll_ctl_ns);
+  printf("%-20s %14s %12s %14s %10s\n","policy","syscalls","migrations",
+         "est_us","ns_per_call");
+  for (i=0; i<num_policies; i++) {
+    const Policy* p=policies+i;
+    printf("%-20s %14llu %12llu %14.0f %10.0f\n",p->name,p->syscalls,
+           p->migrations,p->ns/1000,total_calls ? p->ns/total_calls : 0);
+  }
+
+  for (i=0; i<num_policies; i++) {
+    free(policies[i].fds);
+    free(policies[i].due);
+    free(policies[i].dirty);
+  }
+  free(known);
+  free(ready);
+  return 0;
+}